@@ -1,10 +1,12 @@
 #define DEBUG_MODE 1
 
-#ifdef STUB
-#include "helib-stub.h"
-#else
 #include "helib-instance.h"
-#endif
+
+#include <map>
+#include "circuit.h"
+#include "metrics.h"
+#include "mixed-ctxt.h"
+#include "thread-pool.h"
 
 const int nrounds = 10;
 
@@ -43,14 +45,57 @@ void print_state(pt_state st) {
     printf("\n");
 }  
 
-typedef vector<Ctxt>     CtxtByte;  // [8]
+// AES numbers the bytes of a block column by column, but the state here is
+// kept row by row, byte 4*row + column, as shift_rows and mix_columns index
+// it. Swapping the two is its own inverse.
+pt_state transpose_state(const pt_state& st) {
+    pt_state t (16);
+    for (int k = 0; k < 16; k++)
+        t[4 * (k % 4) + k / 4] = st[k];
+    return t;
+}
+
+u8 xtime(u8 a) {
+    return (a << 1) ^ (a & 0x80 ? 0x1b : 0);
+}
+
+// Plain AES-128 on a block in AES byte order, to check the homomorphic
+// result against
+pt_state aes_encrypt(pt_state st, const vector<pt_roundkey>& rks) {
+    for (int k = 0; k < 16; k++)
+        st[k] ^= rks[0][k];
+    for (int r = 1; r <= nrounds; r++) {
+        pt_state t (16);
+        // SubBytes and ShiftRows: row k%4 moves left by k%4 columns
+        for (int k = 0; k < 16; k++)
+            t[k] = s_box[st[(k + 4 * (k % 4)) % 16]];
+        if (r < nrounds)
+            for (int c = 0; c < 16; c += 4) {
+                u8 a0 = t[c], a1 = t[c+1], a2 = t[c+2], a3 = t[c+3];
+                u8 all = a0 ^ a1 ^ a2 ^ a3;
+                t[c]   ^= all ^ xtime(a0 ^ a1);
+                t[c+1] ^= all ^ xtime(a1 ^ a2);
+                t[c+2] ^= all ^ xtime(a2 ^ a3);
+                t[c+3] ^= all ^ xtime(a3 ^ a0);
+            }
+        for (int k = 0; k < 16; k++)
+            st[k] = t[k] ^ rks[r][k];
+    }
+    return st;
+}
+
+typedef vector<MixedCtxt> CtxtByte; // [8]
 typedef vector<CtxtByte> CtxtState; // [16]
 
+// The round kernels below are templates over the bit type B: MixedCtxt runs
+// them directly, Wire records them into a Circuit.
+
 EncryptedArray* global_ea;
 FHESecKey* global_seckey;
 
-// constants
-CtxtByte* global_c;
+// the rounds as optimized circuits, with and without MixColumns
+Circuit* global_round;
+Circuit* global_last_round;
 
 u8 r_con (u32 i) {
     static u8 lookup[] = { 1, 2, 4, 8, 16, 32, 64, 128, 27,
@@ -77,12 +122,13 @@ void next_polys(u8 ps[16], u32 round) {
 
 typedef u8 old_roundkey[16];
 
-void key_expand(old_roundkey key, old_roundkey rkeys[nrounds])
+// the key itself and one key for each round
+void key_expand(old_roundkey key, old_roundkey rkeys[nrounds+1])
 {
     old_roundkey tmp_key;
     memcpy(tmp_key, key, 16);
     memcpy(rkeys[0], tmp_key, 16);
-    for (int i = 0; i < nrounds-1; i++) {
+    for (int i = 0; i < nrounds; i++) {
         next_polys(tmp_key, i);
         memcpy(rkeys[i+1], tmp_key, 16);
     }
@@ -95,10 +141,10 @@ vector<pt_roundkey> key_expand (pt_roundkey key)
     for (int i = 0; i < 16; i++) {
         temp[i] = key[i];
     }
-    old_roundkey rkeys[nrounds];
+    old_roundkey rkeys[nrounds+1];
     key_expand(temp, rkeys);
-    vector<pt_roundkey> ret (nrounds);
-    for (int i = 0; i < nrounds; i++) {
+    vector<pt_roundkey> ret (nrounds+1);
+    for (int i = 0; i <= nrounds; i++) {
         pt_roundkey k (16);
         for (int j = 0; j < 16; j++) {
             k[j] = rkeys[i][j];
@@ -108,7 +154,8 @@ vector<pt_roundkey> key_expand (pt_roundkey key)
     return ret;
 }
 
-CtxtByte& byte_xor (CtxtByte& lhs, const CtxtByte& rhs) {
+template <typename B>
+vector<B>& byte_xor (vector<B>& lhs, const vector<B>& rhs) {
     for (int i = 0; i < 8; i++)
         lhs[i] += rhs[i];
     return lhs;
@@ -151,63 +198,76 @@ void decode_state (u8 ret[16], const vector<vector<vector<long>>>& inp) {
     }
 }
 
-void add_key(CtxtState key0, CtxtState& input) {
+template <typename B>
+void add_key(const vector<vector<B>>& key0, vector<vector<B>>& input) {
     for (int i = 0; i < 16; i++)
-        for (int j = 0; j < 8; j++)
-            input[i][j] += key0[i][j];
-}
-
-// C++ thinks the modulus of a negative number is negative, which is bad.
-int mod (int n, int m) {
-    int res = n % m;
-    if (res < 0) res *= -1;
-    return res;
-}
-
-void xform_byte(CtxtByte& b) {
-    //static vector<NTL::ZZX> c;
-    //if (c.size() == 0) {
-        //// if c hasn't been filled in yet,
-        //// we need to generate the constant 0x1b
-        //// in a way that we can use.
-        //PlaintextArray zero_p(*global_ea);
-        //PlaintextArray one_p(*global_ea);
-        //zero_p.replicate(0);
-        //one_p.replicate(1);
-        //NTL::ZZX zero, one;
-        //global_ea->encode(zero, zero_p);
-        //global_ea->encode(one, one_p);
-        //// because 0b01100011 = 0x63
-        //c.push_back(one);
-        //c.push_back(one);
-        //c.push_back(zero);
-        //c.push_back(zero);
-        //c.push_back(zero);
-        //c.push_back(one);
-        //c.push_back(one);
-        //c.push_back(zero);
-    //}
-    CtxtByte bp = b;
-    for (int i = 0; i < 8; i++) {
-        bp[i] += b[mod(i-4,8)];
-        bp[i] += b[mod(i-5,8)];
-        bp[i] += b[mod(i-6,8)];
-        bp[i] += b[mod(i-7,8)];
-        bp[i] += (*global_c)[i];
-        //bp[i].addConstant(c[i]);
-        //b[i].addConstant(c[i]);
-    }
-    b = bp;
+        byte_xor(input[i], key0[i]);
 }
 
-void sub_byte (CtxtByte& b) {
-    // TODO need to take the inverse
-    xform_byte(b);
+template <typename B>
+B bxor (const B& a, const B& b) { B r = a; r += b; return r; }
+
+template <typename B>
+B band (const B& a, const B& b) { B r = a; r *= b; return r; }
+
+template <typename B>
+B bxnor (const B& a, const B& b, const B& one) { B r = bxor(a, b); r += one; return r; }
+
+// The S-box as the circuit of Boyar and Peralta ("A depth-16 circuit for the
+// AES S-box", 2011): 34 ANDs of multiplicative depth 4, the inverse and the
+// affine map together, so 10 rounds need depth 40. one is 1 in every slot,
+// for the XNORs. U0 is the most significant bit of the byte, b[7].
+template <typename B>
+void sub_byte (vector<B>& b, const B& one) {
+    const B &U0 = b[7], &U1 = b[6], &U2 = b[5], &U3 = b[4],
+            &U4 = b[3], &U5 = b[2], &U6 = b[1], &U7 = b[0];
+    // top linear layer
+    B T1 = bxor(U0, U3), T2 = bxor(U0, U5), T3 = bxor(U0, U6), T4 = bxor(U3, U5),
+      T5 = bxor(U4, U6), T6 = bxor(T1, T5), T7 = bxor(U1, U2), T8 = bxor(U7, T6),
+      T9 = bxor(U7, T7), T10 = bxor(T6, T7), T11 = bxor(U1, U5), T12 = bxor(U2, U5),
+      T13 = bxor(T3, T4), T14 = bxor(T6, T11), T15 = bxor(T5, T11), T16 = bxor(T5, T12),
+      T17 = bxor(T9, T16), T18 = bxor(U3, U7), T19 = bxor(T7, T18), T20 = bxor(T1, T19),
+      T21 = bxor(U6, U7), T22 = bxor(T7, T21), T23 = bxor(T2, T22), T24 = bxor(T2, T10),
+      T25 = bxor(T20, T17), T26 = bxor(T3, T16), T27 = bxor(T1, T12);
+    // nonlinear middle: the inverse in GF(2^4)^2, 34 ANDs four deep
+    B M1 = band(T13, T6), M2 = band(T23, T8), M3 = bxor(T14, M1), M4 = band(T19, U7),
+      M5 = bxor(M4, M1), M6 = band(T3, T16), M7 = band(T22, T9), M8 = bxor(T26, M6),
+      M9 = band(T20, T17), M10 = bxor(M9, M6), M11 = band(T1, T15), M12 = band(T4, T27),
+      M13 = bxor(M12, M11), M14 = band(T2, T10), M15 = bxor(M14, M11), M16 = bxor(M3, M2),
+      M17 = bxor(M5, T24), M18 = bxor(M8, M7), M19 = bxor(M10, M15), M20 = bxor(M16, M13),
+      M21 = bxor(M17, M15), M22 = bxor(M18, M13), M23 = bxor(M19, T25), M24 = bxor(M22, M23),
+      M25 = band(M22, M20), M26 = bxor(M21, M25), M27 = bxor(M20, M21), M28 = bxor(M23, M25),
+      M29 = band(M28, M27), M30 = band(M26, M24), M31 = band(M20, M23), M32 = band(M27, M31),
+      M33 = bxor(M27, M25), M34 = band(M21, M22), M35 = band(M24, M34), M36 = bxor(M24, M25),
+      M37 = bxor(M21, M29), M38 = bxor(M32, M33), M39 = bxor(M23, M30), M40 = bxor(M35, M36),
+      M41 = bxor(M38, M40), M42 = bxor(M37, M39), M43 = bxor(M37, M38), M44 = bxor(M39, M40),
+      M45 = bxor(M42, M41), M46 = band(M44, T6), M47 = band(M40, T8), M48 = band(M39, U7),
+      M49 = band(M43, T16), M50 = band(M38, T9), M51 = band(M37, T17), M52 = band(M42, T15),
+      M53 = band(M45, T27), M54 = band(M41, T10), M55 = band(M44, T13), M56 = band(M40, T23),
+      M57 = band(M39, T19), M58 = band(M43, T3), M59 = band(M38, T22), M60 = band(M37, T20),
+      M61 = band(M42, T1), M62 = band(M45, T4), M63 = band(M41, T2);
+    // bottom linear layer
+    B L0 = bxor(M61, M62), L1 = bxor(M50, M56), L2 = bxor(M46, M48), L3 = bxor(M47, M55),
+      L4 = bxor(M54, M58), L5 = bxor(M49, M61), L6 = bxor(M62, L5), L7 = bxor(M46, L3),
+      L8 = bxor(M51, M59), L9 = bxor(M52, M53), L10 = bxor(M53, L4), L11 = bxor(M60, L2),
+      L12 = bxor(M48, M51), L13 = bxor(M50, L0), L14 = bxor(M52, M61), L15 = bxor(M55, L1),
+      L16 = bxor(M56, L0), L17 = bxor(M57, L1), L18 = bxor(M58, L8), L19 = bxor(M63, L4),
+      L20 = bxor(L0, L1), L21 = bxor(L1, L7), L22 = bxor(L3, L12), L23 = bxor(L18, L2),
+      L24 = bxor(L15, L9), L25 = bxor(L6, L10), L26 = bxor(L7, L9), L27 = bxor(L8, L10),
+      L28 = bxor(L11, L14), L29 = bxor(L11, L17);
+    // outputs, S0 the most significant
+    B S0 = bxor(L6, L24), S1 = bxnor(L16, L26, one), S2 = bxnor(L19, L28, one),
+      S3 = bxor(L6, L21), S4 = bxor(L20, L22), S5 = bxor(L25, L29), S6 = bxnor(L13, L27, one),
+      S7 = bxnor(L6, L23, one);
+    B S[8] = { S0, S1, S2, S3, S4, S5, S6, S7 };
+    for (int i = 0; i < 8; i++)
+        b[7-i] = S[i];
 }
 
-void shift_rows(CtxtState& input) {/*{{{*/
+template <typename B>
+void shift_rows(vector<vector<B>>& input) {/*{{{*/
     // row 2
-    CtxtByte tmp = input[4];
+    vector<B> tmp = input[4];
     input[4] = input[5];
     input[5] = input[6];
     input[6] = input[7];
@@ -227,49 +287,32 @@ void shift_rows(CtxtState& input) {/*{{{*/
     input[13] = tmp;
 }
 
-void mix_byte_shift(CtxtByte& b) {
-    static vector<NTL::ZZX> oneBee;
-    if (oneBee.size() == 0) {
-        // if oneBee hasn't been filled in yet,
-        // we need to generate the constant 0x1b
-        // in a way that we can use.
-        PlaintextArray zero_p(*global_ea);
-        PlaintextArray one_p(*global_ea);
-        zero_p.replicate(0);
-        one_p.replicate(1);
-        NTL::ZZX zero, one;
-        global_ea->encode(zero, zero_p);
-        global_ea->encode(one, one_p);
-        // because 0b00011011 == 0x1b
-        oneBee.push_back(one);
-        oneBee.push_back(one);
-        oneBee.push_back(zero);
-        oneBee.push_back(one);
-        oneBee.push_back(one);
-        oneBee.push_back(zero);
-        oneBee.push_back(zero);
-        oneBee.push_back(zero);
-    }
-    Ctxt tmp = b[7];
+// bee is the constant 0x1b, replicated to every slot. Its bits are
+// all-zero or all-one, so multiplying by them folds away.
+template <typename B>
+void mix_byte_shift(vector<B>& b, const vector<B>& bee) {
+    B tmp = b[7];
     for (int i = 6; i >= 0; i--) {
-        Ctxt v = tmp;
-        v.multByConstant(oneBee[i]);
+        B v = tmp;
+        v *= bee[i+1];
         b[i+1] = b[i];
         b[i+1] += v;
     }
     b[0] = tmp;
 }
 
-void mix_columns(CtxtByte& r0,
-                 CtxtByte& r1,
-                 CtxtByte& r2,
-                 CtxtByte& r3) {
-    CtxtByte a0 = r0, a1 = r1, a2 = r2, a3 = r3;
-    CtxtByte b0 = r0, b1 = r1, b2 = r2, b3 = r3;
-    mix_byte_shift(b0);
-    mix_byte_shift(b1);
-    mix_byte_shift(b2);
-    mix_byte_shift(b3);
+template <typename B>
+void mix_columns(vector<B>& r0,
+                 vector<B>& r1,
+                 vector<B>& r2,
+                 vector<B>& r3,
+                 const vector<B>& bee) {
+    vector<B> a0 = r0, a1 = r1, a2 = r2, a3 = r3;
+    vector<B> b0 = r0, b1 = r1, b2 = r2, b3 = r3;
+    mix_byte_shift(b0, bee);
+    mix_byte_shift(b1, bee);
+    mix_byte_shift(b2, bee);
+    mix_byte_shift(b3, bee);
     r0 = b0;
     r1 = b1;
     r2 = b2;
@@ -280,15 +323,74 @@ void mix_columns(CtxtByte& r0,
     byte_xor(byte_xor(byte_xor(byte_xor(r3, a2), a1), b0), a0);
 }
 
+// SubBytes, ShiftRows, MixColumns unless it is the last round, AddRoundKey
+template <typename B>
+void aes_round(vector<vector<B>>& st, const vector<vector<B>>& key,
+               const B& one, const vector<B>& bee, bool last) {
+    for (int i = 0; i < 16; i++)
+        sub_byte(st[i], one);
+    shift_rows(st);
+    if (!last)
+        for (int i = 0; i < 4; i++)
+            mix_columns(st[i], st[i+4], st[i+8], st[i+12], bee);
+    add_key(key, st);
+}
+
+// A round as a circuit. The inputs are the 128 state bits and then the 128
+// round key bits, byte by byte, bit 0 first; the outputs the new state.
+Circuit round_circuit(bool last) {
+    Circuit circ (*global_ea);
+    vector<vector<Wire>> st (16, vector<Wire>(8)), key (16, vector<Wire>(8));
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 8; j++)
+            st[i][j] = circ.input();
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 8; j++)
+            key[i][j] = circ.input();
+    vector<Wire> bee (8);
+    for (int j = 0; j < 8; j++)
+        bee[j] = circ.constant((0x1b >> j) & 1);
+    aes_round(st, key, circ.constant(1), bee, last);
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 8; j++)
+            circ.output(st[i][j]);
+    return circ;
+}
+
+void print_circuit(const char *what, const Circuit& circ) {
+    Circuit::Stats st = circ.stats();
+    printf("%s: %zu gates (%zu AND, %zu XOR), AND depth %zu, XOR depth %zu\n",
+           what, st.gates, st.ands, st.xors, st.depth, st.xorDepth);
+}
+
+void run_round(const Circuit& circ, const CtxtState& key, CtxtState& input) {
+    vector<const MixedCtxt*> in;
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 8; j++)
+            in.push_back(&input[i][j]);
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 8; j++)
+            in.push_back(&key[i][j]);
+    vector<MixedCtxt> out = circ.evaluate(in);
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 8; j++)
+            input[i][j] = move(out[8*i + j]);
+}
+
+// the block in slot 0, in AES byte order
 void decrypt_aes_block(u8 result[16], const CtxtState& c_pt, const FHESecKey& secretKey)
 {
+    pt_state st (16);
     for (int i = 0; i < 16; i++) {
-        result[i] = 0;
         for (int j = 0; j < 8; j++) {
             vector<long> v;
-            global_ea->decrypt(c_pt[i][j], secretKey, v);
-            result[i] |= (v[0] << j);
+            c_pt[i][j].decrypt(secretKey, v);
+            st[i] |= (v[0] << j);
         }
+    }
+    st = transpose_state(st);
+    for (int i = 0; i < 16; i++) {
+        result[i] = st[i];
         printf("%02x", result[i]);
     }
     printf("\n");
@@ -299,55 +401,48 @@ void first_round(const CtxtState& key0, CtxtState& input) {
 }
 
 void middle_round(const CtxtState& key, CtxtState& input) {
-    time_t old_time, new_time;
-    u8 result[16];
-    old_time = std::time(NULL);
-    for (int i = 0; i < 16; i++)
-        sub_byte(input[i]);
-    printf("  sub bytes: ");
-    decrypt_aes_block(result, input, *global_seckey);
-    shift_rows(input);
-    printf("  shift rows: ");
-    decrypt_aes_block(result, input, *global_seckey);
-    for (int i = 0; i < 4; i++)
-        mix_columns(input[i], input[i+4], input[i+8], input[i+12]);
-    printf("  mix columns: ");
-    decrypt_aes_block(result, input, *global_seckey);
-    add_key(key, input);
-    printf("  add key: ");
-    decrypt_aes_block(result, input, *global_seckey);
-    new_time = std::time(NULL);
-    cout << "  Round took " << (new_time - old_time) << "s" << endl;
+    MetricScope round ("middle_round", true);
+    run_round(*global_round, key, input);
+    cout << "  Round took ";
+    round.stop();
 }
 
 void final_round(const CtxtState& keyn, CtxtState& input) {
-    for (int i = 0; i < 16; i++)
-        sub_byte(input[i]);
-    shift_rows(input);
-    add_key(keyn, input);
+    run_round(*global_last_round, keyn, input);
 }
 
-CtxtByte encrypt_byte( const EncryptedArray& ea, const FHEPubKey& pk, u8 inp )
+// Every byte of the state in turn through SubBytes, a slot for each byte
+// value, against s_box. Returns how many came out wrong.
+int test_sub_bytes(const EncryptedArray& ea, const FHEPubKey& pk, const FHESecKey& sk)
 {
-    vector<vector<long>> inp_vec (encode_byte(inp, ea.size()));
-    vector<Ctxt> ct_byte;
-    for (int i = 0; i < 8; i++) {
-        Ctxt new_ctx(pk);
-        ea.encrypt(new_ctx, pk, inp_vec[i]);
-        ct_byte.push_back(new_ctx);
-    }
-    return ct_byte;
-}
-
-u8 decrypt_byte ( const EncryptedArray& ea, const FHESecKey& sk, CtxtByte inp )
-{
-    vector<vector<long>> derp_vec (8);
-    for (int i=0; i < 8; i++) {
-        ea.decrypt( inp[i], sk, derp_vec[i] );
+    long nslots = ea.size();
+    MixedCtxt one (ea, 1);
+    int wrong = 0;
+    for (long first = 0; first < 256; first += nslots) {
+        CtxtByte b;
+        for (int j = 0; j < 8; j++) {
+            vector<long> bits (nslots);
+            for (long s = 0; s < nslots && first + s < 256; s++)
+                bits[s] = ((first + s) >> j) & 1;
+            Ctxt ct (pk);
+            ea.encrypt(ct, pk, bits);
+            b.push_back(MixedCtxt(ea, move(ct)));
+        }
+        sub_byte(b, one);
+        vector<vector<long>> out (8);
+        for (int j = 0; j < 8; j++)
+            b[j].decrypt(sk, out[j]);
+        for (long s = 0; s < nslots && first + s < 256; s++) {
+            u8 res = 0;
+            for (int j = 0; j < 8; j++)
+                res |= out[j][s] << j;
+            wrong += res != s_box[first + s];
+        }
     }
-    return decode_byte(derp_vec);
+    return wrong;
 }
 
+// a block in AES byte order, in slot 0
 CtxtState encrypt_state
 ( 
     const EncryptedArray& ea,
@@ -355,14 +450,14 @@ CtxtState encrypt_state
     pt_state st
 )
 {
-    vector<vector<vector<long>>> pt (encode_state(st,ea.size()));
+    vector<vector<vector<long>>> pt (encode_state(transpose_state(st), ea.size()));
     CtxtState c_st;
     for (int i = 0; i < 16; i++) {
-        vector<Ctxt> vs;
+        CtxtByte vs;
         for (int j = 0; j < 8; j++) {
             Ctxt new_ctx(pk);
             ea.encrypt(new_ctx, pk, pt[i][j]);
-            vs.push_back(new_ctx);
+            vs.push_back(MixedCtxt(ea, move(new_ctx)));
         }
         c_st.push_back(vs);
     }
@@ -391,83 +486,339 @@ void print_result (u8 result[16]) {
 }/*}}}*/
 
 
-int main(int argc, char **argv) {
+////////////////////////////////////////////////////////////////////////////////
+// bytes layout
+//
+// With HE_AES_LAYOUT=bytes the slots are GF(2^8), the field AES computes
+// in, and a block is 16 slots of a single ciphertext: byte k of block b, in
+// AES byte order, sits in slot 16b+k. One ciphertext carries nslots/16
+// blocks, and a round works on it alone instead of on 128. SubBytes is x^254
+// from Frobenius maps and four products, then the affine map as a
+// polynomial in the Frobenius maps; ShiftRows and MixColumns are rotations
+// times constant masks.
+
+// X^8 + X^4 + X^3 + X + 1
+ZZX aes_poly() {
+    ZZX G;
+    SetCoeff(G, 8);
+    SetCoeff(G, 4);
+    SetCoeff(G, 3);
+    SetCoeff(G, 1);
+    SetCoeff(G, 0);
+    return G;
+}
+
+ZZX byte_poly(u8 b) {
+    ZZX p;
+    for (int i = 0; i < 8; i++)
+        if ((b >> i) & 1) SetCoeff(p, i);
+    return p;
+}
+
+u8 poly_byte(const ZZX& p) {
+    u8 b = 0;
+    for (int i = 0; i < 8 && i <= deg(p); i++)
+        if (IsOne(coeff(p, i))) b |= 1 << i;
+    return b;
+}
+
+// A map that is linear over GF(2^8) within each block, byte k of the
+// result being the sum over s of m[k][s] times byte s. It is the sum of
+// rotate(in, r) times masks[r] over the distances r = k - s it needs.
+struct ByteLinear {
+    vector<long> rots;
+    vector<ZZX> masks;
+};
+
+ByteLinear byte_linear(const EncryptedArray& ea, const u8 m[16][16]) {
+    long nblocks = ea.size() / 16;
+    map<long, vector<ZZX>> terms;
+    for (int k = 0; k < 16; k++)
+        for (int s = 0; s < 16; s++) {
+            if (!m[k][s]) continue;
+            vector<ZZX> &v = terms[k - s];
+            if (v.empty()) v.resize(ea.size());
+            for (long b = 0; b < nblocks; b++)
+                v[16*b + k] = byte_poly(m[k][s]);
+        }
+    ByteLinear lin;
+    for (auto &t : terms) {
+        ZZX mask;
+        ea.encode(mask, t.second);
+        lin.rots.push_back(t.first);
+        lin.masks.push_back(mask);
+    }
+    return lin;
+}
+
+void apply_linear(const EncryptedArray& ea, const ByteLinear& lin, Ctxt& ct) {
+    vector<Ctxt> terms (lin.rots.size(), ct);
+    ThreadPool::shared().parallelEach(terms.size(), [&](size_t i) {
+        if (lin.rots[i]) ea.rotate(terms[i], lin.rots[i]);
+        terms[i].multByConstant(lin.masks[i]);
+    });
+    ct = terms[0];
+    for (size_t i = 1; i < terms.size(); i++)
+        ct += terms[i];
+}
+
+// a value in every slot
+ZZX byte_const(const EncryptedArray& ea, u8 b) {
+    ZZX p;
+    ea.encode(p, vector<ZZX>(ea.size(), byte_poly(b)));
+    return p;
+}
+
+struct ByteAES {
+    const EncryptedArray* ea;
+    ByteLinear shift_rows, mix_columns;
+    // The affine map of the S-box is sum_j affine[j] y^(2^j) + 0x63 on the
+    // inverse y, with affine 05 09 f9 25 f4 01 b5 8f.
+    ZZX affine[8];
+    ZZX c63;
+};
+
+ByteAES byte_aes_setup(const EncryptedArray& ea) {
+    static const u8 affine[8] = { 0x05, 0x09, 0xf9, 0x25, 0xf4, 0x01, 0xb5, 0x8f };
+    static const u8 mix[4] = { 2, 3, 1, 1 };
+    u8 sr[16][16] = {}, mc[16][16] = {};
+    for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++) {
+            sr[r + 4*c][r + 4*((c + r) % 4)] = 1;
+            for (int i = 0; i < 4; i++)
+                mc[r + 4*c][(r + i) % 4 + 4*c] = mix[i];
+        }
+    ByteAES aes;
+    aes.ea = &ea;
+    aes.shift_rows = byte_linear(ea, sr);
+    aes.mix_columns = byte_linear(ea, mc);
+    for (int j = 0; j < 8; j++)
+        aes.affine[j] = byte_const(ea, affine[j]);
+    aes.c63 = byte_const(ea, 0x63);
+    return aes;
+}
+
+// switched down to the lowest level it can be at, as the circuit
+// evaluator does with its products
+void mod_down(Ctxt& ct) {
+    ct.modDownToLevel(ct.findBaseLevel());
+}
+
+// The S-box: y = x^254, which is the inverse of x and 0 for 0, in four
+// products three deep (x^3 = x x^2, x^14 = x^12 x^2, x^15 = x^12 x^3,
+// x^254 = x^240 x^14, the powers of two being Frobenius maps), then the
+// affine map on y.
+void byte_sub_bytes(const ByteAES& aes, Ctxt& x) {
+    Ctxt x2 = x;
+    x2.frobeniusAutomorph(1);
+    Ctxt x3 = x;
+    x3.multiplyBy(x2);
+    mod_down(x3);
+    Ctxt x12 = x3;
+    x12.frobeniusAutomorph(2);
+    Ctxt x14 = x12, y = x12;
+    ThreadPool::shared().parallelEach(2, [&](size_t i) {
+        Ctxt &p = i ? y : x14;
+        p.multiplyBy(i ? x3 : x2);
+        mod_down(p);
+    });
+    y.frobeniusAutomorph(4);
+    y.multiplyBy(x14);
+    mod_down(y);
+    vector<Ctxt> fs (8, y);
+    ThreadPool::shared().parallelEach(8, [&](size_t j) {
+        if (j) fs[j].frobeniusAutomorph(j);
+        fs[j].multByConstant(aes.affine[j]);
+    });
+    x = fs[0];
+    for (int j = 1; j < 8; j++)
+        x += fs[j];
+    x.addConstant(aes.c63);
+}
+
+void byte_round(const ByteAES& aes, const Ctxt& key, Ctxt& st, bool last) {
+    byte_sub_bytes(aes, st);
+    apply_linear(*aes.ea, aes.shift_rows, st);
+    if (!last)
+        apply_linear(*aes.ea, aes.mix_columns, st);
+    st += key;
+}
 
-    long m=0;/*{{{*/
-    long p=2;
-    long r=1;
-    long L=16;
-    long c=1;
-    long w=64;
-    long d=0;
-    long security=128;
-    NTL::ZZX G;
+// blocks[b] in the slots of block b, or a block in every block
+Ctxt byte_encrypt(const EncryptedArray& ea, const FHEPubKey& pk, const vector<pt_state>& blocks) {
+    vector<ZZX> slots (ea.size());
+    long nblocks = ea.size() / 16;
+    for (long b = 0; b < nblocks; b++)
+        for (int k = 0; k < 16; k++)
+            slots[16*b + k] = byte_poly(blocks[blocks.size() == 1 ? 0 : b][k]);
+    Ctxt ct (pk);
+    ea.encrypt(ct, pk, slots);
+    return ct;
+}
+
+vector<pt_state> byte_decrypt(const EncryptedArray& ea, const FHESecKey& sk, const Ctxt& ct) {
+    vector<ZZX> slots;
+    ea.decrypt(ct, sk, slots);
+    vector<pt_state> blocks (ea.size() / 16, pt_state(16));
+    for (size_t b = 0; b < blocks.size(); b++)
+        for (int k = 0; k < 16; k++)
+            blocks[b][k] = poly_byte(slots[16*b + k]);
+    return blocks;
+}
+
+// SubBytes on every byte value, slot i holding i mod 256. Returns how many
+// came out wrong.
+int byte_test_sub_bytes(const ByteAES& aes, const FHEPubKey& pk, const FHESecKey& sk) {
+    const EncryptedArray &ea = *aes.ea;
+    vector<ZZX> slots (ea.size());
+    for (size_t i = 0; i < slots.size(); i++)
+        slots[i] = byte_poly(i % 256);
+    Ctxt ct (pk);
+    ea.encrypt(ct, pk, slots);
+    byte_sub_bytes(aes, ct);
+    ea.decrypt(ct, sk, slots);
+    int wrong = 0;
+    for (size_t i = 0; i < slots.size() && i < 256; i++)
+        wrong += poly_byte(slots[i]) != s_box[i];
+    return wrong;
+}
+
+// AES on a ciphertext full of blocks: data in block 0, variations of it in
+// the rest, each checked against plain AES
+int byte_aes(const vector<pt_roundkey>& roundkeys, const pt_state& data) {
+    cout << "Initializing HElib values..." << endl;
+    MetricScope setup ("setup");
+    // not he_paramsFor: a set tuned for depth alone need not have d=8
+    HElibInstance he (he_presetFromEnv("aes-bytes"));
+    EncryptedArray ea (he.context(), aes_poly());
+    FHESecKey &secretKey = he.seckey();
+    const FHEPubKey &publicKey = he.pubkey();
+    if (ea.getDegree() != 8 || ea.size() < 16) {
+        cerr << "the slots are not GF(2^8); the preset needs d=8" << endl;
+        return 1;
+    }
+    ByteAES aes = byte_aes_setup(ea);
+    setup.stop();
+    long nblocks = ea.size() / 16;
+    printf("%ld blocks per ciphertext\n", nblocks);
 
+    int wrong;
+    {
+        MetricScope sb ("sub_byte", true);
+        wrong = byte_test_sub_bytes(aes, publicKey, secretKey);
+    }
+    printf("homomorphic SubBytes: %ld/%ld bytes match s_box\n",
+           min(ea.size(), 256L) - wrong, min(ea.size(), 256L));
+
+    vector<pt_state> blocks (nblocks, data);
+    for (long b = 1; b < nblocks; b++)
+        for (int k = 0; k < 16; k++)
+            blocks[b][k] ^= (u8) (b * 0x9e + k * 0x3b * b);
+
+    cout << "Encrypting keys..." << endl;
+    MetricScope encKeys ("encrypt keys", true);
+    vector<Ctxt> keys;
+    for (size_t i = 0; i < roundkeys.size(); i++)
+        keys.push_back(byte_encrypt(ea, publicKey, vector<pt_state>(1, roundkeys[i])));
+    cout << "  ";
+    encKeys.stop();
+
+    cout << "Encrypting cleartext..." << endl;
+    MetricScope encPt ("encrypt input", true);
+    Ctxt st = byte_encrypt(ea, publicKey, blocks);
+    cout << "  ";
+    encPt.stop();
+
+    cout << "Running AES..." << endl;
+    MetricScope run ("aes", true);
+    st += keys[0];
+    for (int i = 1; i <= nrounds; i++) {
+        MetricScope round ("round", true);
+        byte_round(aes, keys[i], st, i == nrounds);
+        cout << "  Round " << i << " took ";
+        round.stop();
+    }
+    cout << "  ";
+    run.stop();
+
+    cout << "Decrypting result..." << endl;
+    vector<pt_state> out = byte_decrypt(ea, secretKey, st);
+    long match = 0;
+    for (long b = 0; b < nblocks; b++)
+        match += out[b] == aes_encrypt(blocks[b], roundkeys);
+    cout << "Block 0  ";
+    print_result(&out[0][0]);
+    cout << endl << "Expected ";
+    pt_state expected (aes_encrypt(data, roundkeys));
+    print_result(&expected[0]);
+    printf("\n%ld/%ld blocks match plain AES\n", match, nblocks);
+    return match == nblocks && !wrong ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+
+    // the example of FIPS-197, appendix B
     pt_roundkey key ({
         0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 
         0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
     });
     pt_state data ({
-        0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff,
-        0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff
+        0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d,
+        0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34
     });
 
     cout << "Performing key expansion..." << endl;
     vector<pt_roundkey> roundkeys (key_expand(key));
+    const char *layout = getenv("HE_AES_LAYOUT");
+    if (layout && string(layout) == "bytes")
+        return byte_aes(roundkeys, data);
+    pt_state expected (aes_encrypt(data, roundkeys));
 
     cout << "Initializing HElib values..." << endl;
-    m = FindM(security,L,c,p,d,m,0);
-
-    FHEcontext context(m, p, r);
-    buildModChain(context, L, c);
-    FHESecKey secretKey(context);
-    const FHEPubKey& publicKey = secretKey;
+    MetricScope setup ("setup");
+    HElibInstance he (he_paramsFor("aes", 4 * nrounds, 0));/*{{{*/
+    EncryptedArray &ea = he.ea();
+    FHESecKey &secretKey = he.seckey();
+    const FHEPubKey &publicKey = he.pubkey();
     global_seckey = &secretKey;
-
-    G = context.alMod.getFactorsOverZZ()[0];
-    secretKey.GenSecKey(w);
-    addSome1DMatrices(secretKey);
-
-    EncryptedArray ea(context, G);
     global_ea = &ea;
-    long nslots = ea.size();
-    cout << "nslots=" << nslots << endl;
-    CtxtByte const_c = encrypt_byte(ea, publicKey, 0x63);
-    global_c = &const_c;
+    setup.stop();
     /*}}}*/
 
-    // test SubByte
-    puts("");
-    u8 inp = 0xAB;
-    CtxtByte test = encrypt_byte(ea, publicKey, inp);
-    sub_byte(test);
-    u8 res = decrypt_byte(ea, secretKey, test);
-    printf("homomorphic SubByte(0x%02x) = 0x%02x\n", inp, res);
-    printf("plaintext     s_box[0x%02x] = 0x%02x\n", inp, s_box[inp]);
+    Circuit round = round_circuit(false), last_round = round_circuit(true);
+    print_circuit("round circuit", round);
+    round.optimize();
+    last_round.optimize();
+    print_circuit("  optimized  ", round);
+    global_round = &round;
+    global_last_round = &last_round;
 
-    return 0;
+    int wrong;
+    {
+        MetricScope sb ("sub_byte", true);
+        wrong = test_sub_bytes(ea, publicKey, secretKey);
+    }
+    printf("homomorphic SubBytes: %d/256 bytes match s_box\n", 256 - wrong);
 
-    time_t old_time, new_time;/*{{{*/
-    old_time = std::time(NULL);
+    /*{{{*/
     cout << "Encrypting keys..." << endl;
 
     u8 result[16];
 
+    MetricScope encKeys ("encrypt keys", true);
     vector<CtxtState> encrypted_keys (encrypt_keys(ea, publicKey, roundkeys));
+    cout << "  ";
+    encKeys.stop();
 
-    new_time = std::time(NULL);
-    cout << "  " << (new_time - old_time) << "s" << endl;
-    old_time = new_time;
     cout << "Encrypting cleartext..." << endl;
-
+    MetricScope encPt ("encrypt input", true);
     CtxtState c_pt(encrypt_state(ea, publicKey, data));
     // c_pt <- data // "bit sliced"
-
-    new_time = std::time(NULL);
-    cout << "  " << (new_time - old_time) << "s" << endl;
-    old_time = new_time;
+    cout << "  ";
+    encPt.stop();
 
     cout << "Running AES..." << endl;
+    MetricScope aes ("aes", true);
     cout << "Input = " << flush;
     decrypt_aes_block(result, c_pt, secretKey);
 
@@ -475,30 +826,24 @@ int main(int argc, char **argv) {
     first_round(encrypted_keys[0], c_pt);
     decrypt_aes_block(result, c_pt, secretKey);
 
-    // checked to here
-
-    for (int i = 1; i < nrounds-1; i++) {
+    for (int i = 1; i < nrounds; i++) {
         middle_round(encrypted_keys[i], c_pt);
-        decrypt_aes_block(result, c_pt, secretKey);
-        if (DEBUG_MODE) goto end;
+        if (DEBUG_MODE) decrypt_aes_block(result, c_pt, secretKey);
     }
-    final_round(encrypted_keys[nrounds-1], c_pt);
-
-    end:
+    final_round(encrypted_keys[nrounds], c_pt);
 
-
-    new_time = std::time(NULL);
-    cout << "  " << (new_time - old_time) << "s" << endl;
-    old_time = new_time;
+    cout << "  ";
+    aes.stop();
     cout << "Decrypting result..." << endl;
-
+    MetricScope dec ("decrypt", true);
     decrypt_aes_block(result, c_pt, secretKey);
+    cout << "  ";
+    dec.stop();
 
-    new_time = std::time(NULL);
-    cout << "  " << (new_time - old_time) << "s" << endl;
-    old_time = new_time;
-
-    cout << endl << "And that's that." << endl;
+    bool match = equal(expected.begin(), expected.end(), result);
+    cout << "Expected ";
+    print_result(&expected[0]);
+    cout << endl << (match ? "Result matches plain AES" : "Result DOES NOT match plain AES") << endl;
 
-    return 0;/*}}}*/
+    return match && !wrong ? 0 : 1;/*}}}*/
 }
@@ -0,0 +1,377 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// A circuit of XOR and AND gates over slot vectors.
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <queue>
+#include "circuit.h"
+#include "thread-pool.h"
+
+Wire& Wire::operator+= (const Wire &other) {
+    *this = (c ? c : other.c)->gateXor(*this, other);
+    return *this;
+}
+
+Wire& Wire::operator*= (const Wire &other) {
+    *this = (c ? c : other.c)->gateAnd(*this, other);
+    return *this;
+}
+
+Circuit::Circuit (const EncryptedArray &ea) : ea(&ea), zero(-1), one(-1) {}
+
+int Circuit::add (Op op, int a, int b) {
+    if (a > b) swap(a, b);
+    auto key = make_tuple((int) op, a, b);
+    auto it = table.find(key);
+    if (it != table.end()) return it->second;
+    gates.push_back({ op, a, b });
+    table[key] = gates.size() - 1;
+    return gates.size() - 1;
+}
+
+Wire Circuit::input () {
+    gates.push_back({ INPUT, (int) inputs.size(), -1 });
+    inputs.push_back(gates.size() - 1);
+    return Wire(this, gates.size() - 1);
+}
+
+int Circuit::constGate (long bit) {
+    int &g = bit ? one : zero;
+    if (g < 0) {
+        consts.push_back(MixedCtxt(*ea, bit));
+        consts.back().encode();
+        gates.push_back({ CONST, (int) consts.size() - 1, -1 });
+        g = gates.size() - 1;
+    }
+    return g;
+}
+
+Wire Circuit::constant (long bit) {
+    return Wire(this, constGate(bit & 1));
+}
+
+Wire Circuit::constant (const MixedCtxt &v) {
+    assert(v.isClear());
+    if (v.isZero()) return constant(0);
+    if (v.isOnes()) return constant(1);
+    const SlotBuffer &bits = v.clear();
+    for (size_t g = 0; g < gates.size(); g++) {
+        if (gates[g].op != CONST) continue;
+        const SlotBuffer &other = consts[gates[g].a].clear();
+        if (equal(bits.data(), bits.data() + bits.nwords(), other.data())) {
+            return Wire(this, g);
+        }
+    }
+    consts.push_back(v);
+    consts.back().encode();
+    gates.push_back({ CONST, (int) consts.size() - 1, -1 });
+    return Wire(this, gates.size() - 1);
+}
+
+const MixedCtxt* Circuit::clearValue (int g) const {
+    return gates[g].op == CONST ? &consts[gates[g].a] : NULL;
+}
+
+Wire Circuit::gateXor (const Wire &a, const Wire &b) {
+    if (a.id == b.id) return constant(0);
+    const MixedCtxt *ca = clearValue(a.id), *cb = clearValue(b.id);
+    if (ca && cb) {
+        MixedCtxt v = *ca;
+        v.xorWith(*cb);
+        return constant(v);
+    }
+    if (ca && ca->isZero()) return b;
+    if (cb && cb->isZero()) return a;
+    return Wire(this, add(XOR, a.id, b.id));
+}
+
+Wire Circuit::gateAnd (const Wire &a, const Wire &b) {
+    if (a.id == b.id) return a;
+    const MixedCtxt *ca = clearValue(a.id), *cb = clearValue(b.id);
+    if (ca && cb) {
+        MixedCtxt v = *ca;
+        v.andWith(*cb);
+        return constant(v);
+    }
+    if ((ca && ca->isZero()) || (cb && cb->isOnes())) return a;
+    if ((cb && cb->isZero()) || (ca && ca->isOnes())) return b;
+    return Wire(this, add(AND, a.id, b.id));
+}
+
+void Circuit::output (const Wire &w) {
+    outputs.push_back(w.id);
+}
+
+Circuit::Stats Circuit::stats () const {
+    Stats st = { 0, 0, 0, 0, 0 };
+    vector<size_t> depth (gates.size(), 0), xdepth (gates.size(), 0);
+    for (size_t g = 0; g < gates.size(); g++) {
+        const Gate &gt = gates[g];
+        if (gt.op == INPUT || gt.op == CONST) continue;
+        depth[g]  = max(depth[gt.a], depth[gt.b]);
+        xdepth[g] = max(xdepth[gt.a], xdepth[gt.b]);
+        if (gt.op == XOR) {
+            st.xors++;
+            xdepth[g]++;
+        } else {
+            st.ands++;
+            depth[g]++;
+        }
+    }
+    st.gates = st.xors + st.ands;
+    for (size_t i = 0; i < outputs.size(); i++) {
+        st.depth    = max(st.depth, depth[outputs[i]]);
+        st.xorDepth = max(st.xorDepth, xdepth[outputs[i]]);
+    }
+    return st;
+}
+
+// how many outputs and gates an output needs read each gate; 0 for the
+// gates no output needs
+vector<size_t> Circuit::uses () const {
+    vector<size_t> n (gates.size(), 0);
+    for (size_t i = 0; i < outputs.size(); i++) n[outputs[i]]++;
+    for (size_t g = gates.size(); g-- > 0; ) {
+        if (n[g] && (gates[g].op == XOR || gates[g].op == AND)) {
+            n[gates[g].a]++;
+            n[gates[g].b]++;
+        }
+    }
+    return n;
+}
+
+// Records the gates again into a new circuit, which shares what can be
+// shared as it goes. Only gates an output needs are kept, unless keepDead.
+// With balance, each maximal XOR chain (XOR gates read only by the next
+// XOR) is flattened into its operands and joined again as a tree, always
+// joining the two that are ready first, so a late operand such as a fresh
+// product is added last instead of holding up the whole chain.
+void Circuit::rebuild (bool balance, bool keepDead) {
+    vector<size_t> n = uses();
+    vector<bool> isOutput (gates.size(), false);
+    for (size_t i = 0; i < outputs.size(); i++) isOutput[outputs[i]] = true;
+    // an XOR read once, by another XOR, belongs to that XOR's chain
+    vector<bool> inChain (gates.size(), false);
+    if (balance) {
+        for (size_t g = 0; g < gates.size(); g++) {
+            if (gates[g].op != XOR) continue;
+            int ops[2] = { gates[g].a, gates[g].b };
+            for (int k = 0; k < 2; k++) {
+                int o = ops[k];
+                if (gates[o].op == XOR && n[o] == 1 && !isOutput[o]) inChain[o] = true;
+            }
+        }
+    }
+
+    Circuit nc (*ea);
+    vector<Wire> to (gates.size());
+    for (size_t i = 0; i < inputs.size(); i++) to[inputs[i]] = nc.input();
+
+    // (ANDs, XORs) on the longest path into each gate of nc, for ordering
+    vector<pair<size_t, size_t>> ready;
+    auto readyOf = [&](const Wire &w) {
+        while (ready.size() < nc.gates.size()) {
+            const Gate &gt = nc.gates[ready.size()];
+            pair<size_t, size_t> r (0, 0);
+            if (gt.op == XOR || gt.op == AND) {
+                r = max(ready[gt.a], ready[gt.b]);
+                if (gt.op == AND) r.first++;
+                else r.second++;
+            }
+            ready.push_back(r);
+        }
+        return ready[w.id];
+    };
+
+    for (size_t g = 0; g < gates.size(); g++) {
+        if ((!n[g] && !keepDead) || inChain[g]) continue;
+        const Gate &gt = gates[g];
+        switch (gt.op) {
+        case INPUT:
+            break;
+        case CONST:
+            to[g] = nc.constant(consts[gt.a]);
+            break;
+        case AND:
+            to[g] = nc.gateAnd(to[gt.a], to[gt.b]);
+            break;
+        case XOR:
+            if (!balance) {
+                to[g] = nc.gateXor(to[gt.a], to[gt.b]);
+                break;
+            }
+            // the chain's operands; one that occurs twice cancels
+            vector<int> stack = { gt.a, gt.b };
+            vector<int> leaves;
+            while (!stack.empty()) {
+                int o = stack.back();
+                stack.pop_back();
+                if (inChain[o]) {
+                    stack.push_back(gates[o].a);
+                    stack.push_back(gates[o].b);
+                } else {
+                    leaves.push_back(to[o].id);
+                }
+            }
+            sort(leaves.begin(), leaves.end());
+            typedef pair<pair<size_t, size_t>, int> Item;
+            priority_queue<Item, vector<Item>, greater<Item>> q;
+            for (size_t i = 0; i < leaves.size(); ) {
+                size_t j = i;
+                while (j < leaves.size() && leaves[j] == leaves[i]) j++;
+                if ((j - i) % 2) {
+                    Wire w (&nc, leaves[i]);
+                    q.push(Item(readyOf(w), w.id));
+                }
+                i = j;
+            }
+            if (q.empty()) {
+                to[g] = nc.constant(0);
+                break;
+            }
+            while (q.size() > 1) {
+                Wire a (&nc, q.top().second);
+                q.pop();
+                Wire b (&nc, q.top().second);
+                q.pop();
+                Wire s = nc.gateXor(a, b);
+                q.push(Item(readyOf(s), s.id));
+            }
+            to[g] = Wire(&nc, q.top().second);
+            break;
+        }
+    }
+    for (size_t i = 0; i < outputs.size(); i++) nc.output(to[outputs[i]]);
+    *this = move(nc);
+}
+
+void Circuit::eliminateCommon () { rebuild(false, true); }
+
+void Circuit::removeDead () { rebuild(false, false); }
+
+void Circuit::rebalanceXors () { rebuild(true, false); }
+
+// Balancing can expose shared pairs and cancellations that show up in
+// another chain, so it runs until the circuit stops shrinking.
+void Circuit::optimize () {
+    size_t before;
+    do {
+        before = gates.size();
+        rebalanceXors();
+    } while (gates.size() < before);
+}
+
+vector<vector<int>> Circuit::schedule (size_t width, size_t maxLive) const {
+    const size_t mulCost = 16;          // an AND against an XOR, roughly
+    vector<size_t> rem = uses();
+    vector<size_t> height (gates.size(), 0), pending (gates.size(), 0);
+    vector<vector<int>> users (gates.size());
+    auto isOp = [&](int g) { return gates[g].op == XOR || gates[g].op == AND; };
+    auto cost = [&](int g) { return !isOp(g) ? 0 : gates[g].op == AND ? mulCost : 1; };
+    for (size_t g = gates.size(); g-- > 0; ) {
+        height[g] += cost(g);
+        if (!isOp(g)) continue;
+        int ops[2] = { gates[g].a, gates[g].b };
+        for (int k = 0; k < 2; k++) {
+            height[ops[k]] = max(height[ops[k]], height[g]);
+            users[ops[k]].push_back(g);
+            if (isOp(ops[k])) pending[g]++;
+        }
+    }
+
+    vector<int> ready;
+    for (size_t g = 0; g < gates.size(); g++) {
+        if (isOp(g) && !pending[g] && rem[g]) ready.push_back(g);
+    }
+    vector<vector<int>> waves;
+    long live = 0;
+    while (!ready.empty()) {
+        stable_sort(ready.begin(), ready.end(), [&](int a, int b) { return height[a] > height[b]; });
+        // values made less values freed, with the wave so far
+        auto net = [&](int g) {
+            long freed = 0;
+            if (isOp(gates[g].a) && rem[gates[g].a] == 1) freed++;
+            if (isOp(gates[g].b) && rem[gates[g].b] == 1) freed++;
+            return 1 - freed;
+        };
+        vector<int> wave, rest;
+        for (size_t i = 0; i < ready.size(); i++) {
+            int g = ready[i];
+            long d = net(g);
+            if (wave.size() >= width || (maxLive && d > 0 && live + d > (long) maxLive && !wave.empty())) {
+                rest.push_back(g);
+                continue;
+            }
+            wave.push_back(g);
+            live += d;
+            rem[gates[g].a]--;
+            rem[gates[g].b]--;
+        }
+        waves.push_back(wave);
+        ready.swap(rest);
+        for (size_t i = 0; i < wave.size(); i++) {
+            const vector<int> &us = users[wave[i]];
+            for (size_t k = 0; k < us.size(); k++) {
+                if (!--pending[us[k]] && rem[us[k]]) ready.push_back(us[k]);
+            }
+        }
+    }
+    return waves;
+}
+
+vector<MixedCtxt> Circuit::evaluate (const vector<const MixedCtxt*> &in, size_t maxLive) const {
+    assert(in.size() == inputs.size());
+    ThreadPool &pool = ThreadPool::shared();
+    vector<vector<int>> waves = schedule(pool.size(), maxLive);
+    vector<size_t> rem = uses();
+    vector<unique_ptr<MixedCtxt>> vals (gates.size());
+    auto value = [&](int g) -> const MixedCtxt& {
+        switch (gates[g].op) {
+        case INPUT: return *in[gates[g].a];
+        case CONST: return consts[gates[g].a];
+        default:    return *vals[g];
+        }
+    };
+    auto isOp = [&](int g) { return gates[g].op == XOR || gates[g].op == AND; };
+
+    MixedTally tally;
+    for (size_t w = 0; w < waves.size(); w++) {
+        const vector<int> &wave = waves[w];
+        pool.parallelEach(wave.size(), [&](size_t i) {
+            const Gate &gt = gates[wave[i]];
+            int a = gt.a, b = gt.b;
+            // an operand read for the last time is taken over, not copied
+            if (!(isOp(a) && rem[a] == 1) && isOp(b) && rem[b] == 1) swap(a, b);
+            unique_ptr<MixedCtxt> v;
+            if (isOp(a) && rem[a] == 1) v = move(vals[a]);
+            else v.reset(new MixedCtxt(value(a)));
+            if (gt.op == XOR) v->xorWith(value(b), &tally);
+            else v->andWith(value(b), &tally);
+            // as low as its noise allows, so the ops that read it are
+            // cheaper; a sum is already at the lower of its operands' levels
+            if (gt.op == AND) v->modDownToLevel(v->findBaseLevel());
+            vals[wave[i]] = move(v);
+        });
+        for (size_t i = 0; i < wave.size(); i++) {
+            int ops[2] = { gates[wave[i]].a, gates[wave[i]].b };
+            for (int k = 0; k < 2; k++) {
+                if (!--rem[ops[k]] && isOp(ops[k])) vals[ops[k]].reset();
+            }
+        }
+    }
+    tally.report();
+
+    vector<MixedCtxt> res;
+    res.reserve(outputs.size());
+    for (size_t i = 0; i < outputs.size(); i++) {
+        int g = outputs[i];
+        if (isOp(g) && !--rem[g]) res.push_back(move(*vals[g]));
+        else res.push_back(value(g));
+    }
+    return res;
+}
@@ -0,0 +1,113 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// A circuit of XOR and AND gates over slot vectors. A kernel records into
+// it through Wires, which have the same += (XOR) and *= (AND) as MixedCtxt,
+// so one template serves both the direct and the recorded version. With
+// the whole computation in hand, the passes here can:
+//
+//   eliminateCommon  share gates that compute the same thing
+//   removeDead       drop gates no output needs
+//   rebalanceXors    rebuild XOR chains as trees, joining the operands that
+//                    are ready first, and cancel operands that occur twice
+//
+// and schedule() orders the gates for evaluate(), which runs them on the
+// shared pool, deepest path first, holding at most a given number of
+// intermediate values at once. Values are MixedCtxts, so this runs on real
+// HElib and on helib-stub alike, and public constants still fold.
+
+#ifndef CIRCUIT_H
+#define CIRCUIT_H
+
+#include <map>
+#include <tuple>
+#include <vector>
+#include "mixed-ctxt.h"
+
+class Circuit;
+
+// A gate of a circuit being recorded. Wires of different circuits must
+// not be mixed.
+class Wire {
+public:
+    Wire () : c(NULL), id(-1) {}
+    Wire& operator+= (const Wire &other);
+    Wire& operator*= (const Wire &other);
+    int gate () const { return id; }
+private:
+    friend class Circuit;
+    Wire (Circuit *c, int id) : c(c), id(id) {}
+    Circuit *c;
+    int id;
+};
+
+class Circuit {
+public:
+    enum Op { INPUT, CONST, XOR, AND };
+
+    struct Gate {
+        Op op;
+        int a, b;           // operand gates; for INPUT and CONST the input or constant
+    };
+
+    struct Stats {
+        size_t gates;       // XOR and AND gates
+        size_t xors, ands;
+        size_t depth;       // ANDs on the longest path
+        size_t xorDepth;    // XORs on the longest path
+    };
+
+    explicit Circuit (const EncryptedArray &ea);
+
+    // Recording. Gates that were recorded before, or are XORs and ANDs of
+    // constants, or with 0 or 1, are not recorded again, so the kernels
+    // need not avoid them.
+    Wire input ();
+    Wire constant (const MixedCtxt &v);         // a public value
+    Wire constant (long bit);                   // in every slot
+    Wire gateXor (const Wire &a, const Wire &b);
+    Wire gateAnd (const Wire &a, const Wire &b);
+    void output (const Wire &w);
+
+    size_t ninputs () const { return inputs.size(); }
+    size_t noutputs () const { return outputs.size(); }
+    Stats stats () const;
+
+    // Wires recorded before a pass are no longer valid after it.
+    void eliminateCommon ();
+    void removeDead ();
+    void rebalanceXors ();
+    void optimize ();                           // all three
+
+    // The order evaluate() runs the gates in: waves of at most width gates
+    // that can run at once. Gates on the longest path of ANDs to an output
+    // go first. When maxLive (0 for no bound) intermediate values are held,
+    // gates that free at least as many as they make are preferred.
+    vector<vector<int>> schedule (size_t width, size_t maxLive = 0) const;
+
+    // The outputs for the given inputs, which are not changed. A value that
+    // is used for the last time is reused in place, and each product is
+    // switched down to the lowest level it can be at, as scheduleLevels
+    // does between SIMON rounds.
+    vector<MixedCtxt> evaluate (const vector<const MixedCtxt*> &in, size_t maxLive = 0) const;
+
+private:
+    friend class Wire;
+
+    const EncryptedArray *ea;
+    vector<Gate> gates;                         // operands come before their gate
+    vector<MixedCtxt> consts;
+    vector<int> inputs, outputs;
+    map<tuple<int, int, int>, int> table;       // (op, a, b) of each XOR and AND, a < b
+    int zero, one;                              // the constant gates, -1 until made
+
+    int add (Op op, int a, int b);
+    int constGate (long bit);
+    const MixedCtxt* clearValue (int g) const;
+    vector<size_t> uses () const;
+    void rebuild (bool balance, bool keepDead);
+};
+
+#endif
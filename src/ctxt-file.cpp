@@ -0,0 +1,214 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Files of ciphertexts, such as an encrypted SIMON key schedule, so they can
+// be encrypted once and reloaded by later runs.
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <streambuf>
+#include <unistd.h>
+#include "ctxt-file.h"
+
+static const char     MAGIC[8] = { 'H', 'E', 'C', 'T', 'X', 'T', '\0', '\0' };
+static const uint32_t VERSION  = 1;
+
+// fixed-width and little-endian on every machine we run on
+struct CtxtFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t labelLen;          // bytes of label after the header
+    int64_t  m, p, r, L, c;
+    int64_t  nslots;
+    uint64_t keyFingerprint;
+    uint64_t rows, cols;
+};
+
+// a streambuf that only hashes what is written to it, so the public key
+// (which is large) never has to be held in memory as text
+class FnvBuf : public streambuf {
+public:
+    uint64_t h;
+    FnvBuf () : h(0xcbf29ce484222325ULL) {}
+protected:
+    int overflow (int ch) {
+        if (ch != EOF) add((char) ch);
+        return ch;
+    }
+    streamsize xsputn (const char *s, streamsize n) {
+        for (streamsize i = 0; i < n; i++) add(s[i]);
+        return n;
+    }
+private:
+    void add (char ch) {
+        h ^= (unsigned char) ch;
+        h *= 0x100000001b3ULL;
+    }
+};
+
+uint64_t ctxt_keyFingerprint (const FHEPubKey &pubkey) {
+    FnvBuf buf;
+    ostream os (&buf);
+    os << pubkey;
+    return buf.h;
+}
+
+uint64_t ctxt_fingerprint (const vector<Ctxt> &cs) {
+    FnvBuf buf;
+    ostream os (&buf);
+    for (size_t i = 0; i < cs.size(); i++) os << cs[i];
+    return buf.h;
+}
+
+void ctxt_writeRecord (ostream &os, const Ctxt &c, ostringstream &tmp) {
+    tmp.str("");
+    tmp << c;
+    string s = tmp.str();
+    uint64_t len = s.size();
+    os.write((const char*) &len, sizeof len);
+    os.write(s.data(), s.size());
+}
+
+// Bytes left in is, so a corrupt length fails before it is allocated. A
+// stream that cannot seek gets a bound far above any ciphertext.
+static uint64_t remaining (istream &is) {
+    const uint64_t most = (uint64_t) 1 << 32;
+    streampos pos = is.tellg();
+    if (pos < 0 || !is.seekg(0, ios::end)) {
+        is.clear();
+        return most;
+    }
+    streampos end = is.tellg();
+    is.seekg(pos);
+    return end < pos ? 0 : (uint64_t) (end - pos);
+}
+
+bool ctxt_readRecord (istream &is, const FHEPubKey &pubkey, vector<Ctxt> &cs, string &tmp) {
+    uint64_t len;
+    is.read((char*) &len, sizeof len);
+    if (!is || len > remaining(is)) return false;
+    tmp.resize(len);
+    is.read(&tmp[0], len);
+    istringstream rec (tmp);
+    cs.emplace_back(pubkey);
+    rec >> cs.back();
+    if (!is || !rec) {
+        cs.pop_back();
+        return false;
+    }
+    return true;
+}
+
+static CtxtFileHeader makeHeader (const CtxtFileParams &params, const FHEPubKey &pubkey,
+                                  const string &label, uint64_t rows, uint64_t cols) {
+    CtxtFileHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, MAGIC, sizeof MAGIC);
+    h.version        = VERSION;
+    h.labelLen       = label.size();
+    h.m              = params.m;
+    h.p              = params.p;
+    h.r              = params.r;
+    h.L              = params.L;
+    h.c              = params.c;
+    h.nslots         = params.nslots;
+    h.keyFingerprint = ctxt_keyFingerprint(pubkey);
+    h.rows           = rows;
+    h.cols           = cols;
+    return h;
+}
+
+bool ctxt_writeFile (
+    const string &path,
+    const CtxtFileParams &params,
+    const FHEPubKey &pubkey,
+    const string &label,
+    const vector<vector<Ctxt>> &rows
+)
+{
+    size_t cols = rows.empty() ? 0 : rows[0].size();
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (rows[i].size() != cols) return false;
+    }
+    CtxtFileHeader h = makeHeader(params, pubkey, label, rows.size(), cols);
+    // write next to the target and rename, so readers never see half a file
+    string tmp = path + ".tmp";
+    ofstream f (tmp.c_str(), ios::binary);
+    f.write((const char*) &h, sizeof h);
+    f.write(label.data(), label.size());
+    ostringstream rec;
+    for (size_t i = 0; i < rows.size() && f; i++) {
+        for (size_t j = 0; j < cols; j++) ctxt_writeRecord(f, rows[i][j], rec);
+    }
+    f.close();
+    if (!f || rename(tmp.c_str(), path.c_str())) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ctxt_readFile (
+    const string &path,
+    const CtxtFileParams &params,
+    const FHEPubKey &pubkey,
+    const string &label,
+    vector<vector<Ctxt>> &rows,
+    string &err
+)
+{
+    rows.clear();
+    ifstream f (path.c_str(), ios::binary);
+    if (!f) {
+        err = "cannot open " + path;
+        return false;
+    }
+    CtxtFileHeader h;
+    f.read((char*) &h, sizeof h);
+    if (!f || memcmp(h.magic, MAGIC, sizeof MAGIC) || h.version != VERSION) {
+        err = path + " is not a ciphertext file";
+        return false;
+    }
+    if (h.labelLen > remaining(f)) {
+        err = path + " is truncated or corrupt";
+        return false;
+    }
+    string fileLabel (h.labelLen, '\0');
+    f.read(&fileLabel[0], h.labelLen);
+    if (!f || fileLabel != label) {
+        err = path + " holds \"" + fileLabel + "\", not \"" + label + "\"";
+        return false;
+    }
+    if (h.m != params.m || h.p != params.p || h.r != params.r || h.L != params.L
+            || h.c != params.c || h.nslots != params.nslots) {
+        err = path + " was written for other context parameters";
+        return false;
+    }
+    if (h.keyFingerprint != ctxt_keyFingerprint(pubkey)) {
+        err = path + " was written under another public key";
+        return false;
+    }
+    // every record takes at least its length
+    uint64_t left = remaining(f) / sizeof(uint64_t);
+    if (h.cols && h.rows > left / h.cols) {
+        err = path + " is truncated or corrupt";
+        return false;
+    }
+    rows.resize(h.rows);
+    string s;
+    for (uint64_t i = 0; i < h.rows; i++) {
+        rows[i].reserve(h.cols);
+        for (uint64_t j = 0; j < h.cols; j++) {
+            if (!ctxt_readRecord(f, pubkey, rows[i], s)) break;
+        }
+        if (rows[i].size() != h.cols) {
+            rows.clear();
+            err = path + " is truncated or corrupt";
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Files of ciphertexts, such as an encrypted SIMON key schedule, so they can
+// be encrypted once and reloaded by later runs.
+//
+// A file is a fixed binary header followed by rows x cols records, row by
+// row. Each record is a 64-bit length and then the Ctxt as HElib writes it.
+// The header names the context parameters, a fingerprint of the public key
+// and a label saying what the ciphertexts are; a file only loads when all of
+// them match the caller's, since ciphertexts are useless under another key.
+
+#ifndef CTXTFILE_H
+#define CTXTFILE_H
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef STUB
+#include "helib-stub.h"
+#else
+#include "FHE.h"
+#endif
+
+using namespace std;
+
+struct CtxtFileParams {
+    long m, p, r, L, c;
+    long nslots;
+};
+
+// FNV-1a of the public key as HElib writes it
+uint64_t ctxt_keyFingerprint (const FHEPubKey &pubkey);
+
+// FNV-1a of ciphertexts as HElib writes them, to tell one set from another
+uint64_t ctxt_fingerprint (const vector<Ctxt> &cs);
+
+// One record, for streams other than files such as sockets. tmp is scratch
+// that is reused from call to call.
+void ctxt_writeRecord (ostream &os, const Ctxt &c, ostringstream &tmp);
+
+// appends the record to cs
+bool ctxt_readRecord (istream &is, const FHEPubKey &pubkey, vector<Ctxt> &cs, string &tmp);
+
+// Writes rows of equal length. Returns false if the file could not be written.
+bool ctxt_writeFile (
+    const string &path,
+    const CtxtFileParams &params,
+    const FHEPubKey &pubkey,
+    const string &label,
+    const vector<vector<Ctxt>> &rows
+);
+
+// Reads a file written by ctxt_writeFile with the same params, key and label,
+// streaming one record at a time. On failure rows is empty and err says why.
+bool ctxt_readFile (
+    const string &path,
+    const CtxtFileParams &params,
+    const FHEPubKey &pubkey,
+    const string &label,
+    vector<vector<Ctxt>> &rows,
+    string &err
+);
+
+#endif
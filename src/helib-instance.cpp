@@ -0,0 +1,181 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Encapsulation of HElib's extensive boilerplate, with a cache of the
+// context and keys.
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include "helib-instance.h"
+#include "metrics.h"
+
+static const HEParams presets[] = {
+    //  name            p  r   L  c   w  d  security  s  m
+    { "multest",        2, 1, 17, 3, 16, 0, 128,      0, 0 },
+    { "simon-blocks",   2, 1, 45, 3, 64, 0, 128,      0, 0 },
+    { "simon-simd",     2, 1, 23, 3, 64, 0, 128,      0, 0 },
+    { "aes",            2, 1, 21, 1, 64, 0, 128,      0, 0 },
+    { "aes-bytes",      2, 1, 55, 3, 64, 8, 128,      0, 0 },
+};
+
+const HEParams* he_preset (const string &name) {
+    for (size_t i = 0; i < sizeof presets / sizeof presets[0]; i++) {
+        if (presets[i].name == name) return &presets[i];
+    }
+    return NULL;
+}
+
+HEParams he_presetFromEnv (const string &dflt) {
+    const char *name = getenv("HE_PRESET");
+    const HEParams *p = name && *name ? he_preset(name) : NULL;
+    if (name && *name && !p) cerr << "unknown HE_PRESET " << name << ", using " << dflt << endl;
+    return *(p ? p : he_preset(dflt));
+}
+
+// mkdir -p
+static bool makeDirs (const string &dir) {
+    for (size_t i = 1; i <= dir.size(); i++) {
+        if (i < dir.size() && dir[i] != '/') continue;
+        string part = dir.substr(0, i);
+        if (mkdir(part.c_str(), 0755) && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+static string tunedFile (const string &cacheDir, long depth, long s) {
+    ostringstream f;
+    f << cacheDir << "/tuned-depth" << depth << "-s" << s << ".params";
+    return f.str();
+}
+
+// one line: name p r L c w d security s m
+bool he_readTuned (const string &cacheDir, long depth, long s, HEParams &ps) {
+    ifstream f (tunedFile(cacheDir, depth, s).c_str());
+    f >> ps.name >> ps.p >> ps.r >> ps.L >> ps.c >> ps.w >> ps.d >> ps.security >> ps.s >> ps.m;
+    return (bool) f;
+}
+
+bool he_writeTuned (const string &cacheDir, long depth, long s, const HEParams &ps) {
+    if (!makeDirs(cacheDir)) return false;
+    ofstream f (tunedFile(cacheDir, depth, s).c_str());
+    f << ps.name << " " << ps.p << " " << ps.r << " " << ps.L << " " << ps.c << " " << ps.w << " "
+      << ps.d << " " << ps.security << " " << ps.s << " " << ps.m << endl;
+    return (bool) f;
+}
+
+// Each prime in the chain holds about two products, which is where the logs
+// in logs/ run out (and the stub's noise budget).
+static long minL (long depth) {
+    return (depth + 1) / 2 + 1;
+}
+
+HEParams he_paramsFor (const string &dflt, long depth, long s) {
+    const char *preset = getenv("HE_PRESET");
+    const char *cache  = getenv("HE_CACHE");
+    HEParams ps;
+    if ((!preset || !*preset) && cache && *cache && he_readTuned(cache, depth, s, ps)) {
+        cout << "Using parameters tuned for depth " << depth << " from " << cache << endl;
+        return ps;
+    }
+    ps = he_presetFromEnv(dflt);
+    if (ps.L < minL(depth)) {
+        if (preset && *preset) {
+            cerr << "warning: preset " << ps.name << " has L=" << ps.L << ", too few for depth "
+                 << depth << "; run helib-tune " << depth << endl;
+        } else {
+            cout << "Raising L from " << ps.L << " to " << minL(depth) << " for depth " << depth
+                 << endl;
+            ps.L = minL(depth);
+        }
+    }
+    return ps;
+}
+
+string HElibInstance::cacheFile (const string &cacheDir, const HEParams &ps) {
+    ostringstream s;
+    s << cacheDir << "/" << ps.name << "-p" << ps.p << "-r" << ps.r << "-L" << ps.L << "-c" << ps.c
+      << "-w" << ps.w << "-d" << ps.d << "-k" << ps.security << "-s" << ps.s << "-m" << ps.m
+      << ".keys";
+    return s.str();
+}
+
+HElibInstance::HElibInstance (const HEParams &params, string cacheDir, bool verbose)
+    : _params(params), _m(0), _cached(false)
+{
+    if (cacheDir.empty() && getenv("HE_CACHE")) cacheDir = getenv("HE_CACHE");
+    string path = cacheDir.empty() ? "" : cacheFile(cacheDir, params);
+    if (verbose) cout << "L=" << params.L << endl;
+    if (!path.empty()) {
+        MetricScope scope ("load");
+        _cached = load(path);
+        if (verbose && _cached) cout << "Loaded context and keys from " << path << endl;
+    }
+    if (!_cached) {
+        generate(verbose);
+        if (!path.empty()) {
+            if (!makeDirs(cacheDir) || !save(path)) cerr << "cannot write " << path << endl;
+            else if (verbose) cout << "Saved context and keys to " << path << endl;
+        }
+    }
+    ZZX G = _context->alMod.getFactorsOverZZ()[0];
+    _ea.reset(new EncryptedArray(*_context, G));
+    if (verbose) cout << "nslots = " << _ea->size() << endl;
+}
+
+void HElibInstance::generate (bool verbose) {
+    const HEParams &ps = _params;
+    if (verbose) cout << "Finding m..." << endl;
+    _m = FindM(ps.security, ps.L, ps.c, ps.p, ps.d, ps.s, ps.m);
+    MetricScope ctx ("context");
+    if (verbose) cout << "Generating context..." << endl;
+    _context.reset(new FHEcontext(_m, ps.p, ps.r));
+    if (verbose) cout << "Building mod-chain..." << endl;
+    buildModChain(*_context, ps.L, ps.c);
+    ctx.stop();
+    MetricScope keygen ("keygen");
+    if (verbose) cout << "Generating keys..." << endl;
+    _seckey.reset(new FHESecKey(*_context));
+    _seckey->GenSecKey(ps.w);
+    addSome1DMatrices(*_seckey);
+    // slots in an extension field are worked on with Frobenius maps
+    if (ps.d > 1) addFrbMatrices(*_seckey);
+}
+
+// The format is HElib's own: the context base, the context, then the secret
+// key, which carries the public key and the key-switching matrices.
+bool HElibInstance::load (const string &path) {
+    ifstream f (path.c_str());
+    if (!f) return false;
+    unsigned long m, p, r;
+    readContextBase(f, m, p, r);
+    if (!f || (long) p != _params.p || (long) r != _params.r) return false;
+    _m = m;
+    _context.reset(new FHEcontext(m, p, r));
+    f >> *_context;
+    _seckey.reset(new FHESecKey(*_context));
+    f >> *_seckey;
+    if (!f) {
+        _seckey.reset();
+        _context.reset();
+        return false;
+    }
+    return true;
+}
+
+// written to a temporary name and renamed, so a crash never leaves half a file
+bool HElibInstance::save (const string &path) const {
+    string tmp = path + ".tmp";
+    {
+        ofstream f (tmp.c_str());
+        writeContextBase(f, *_context);
+        f << *_context << endl;
+        f << *_seckey << endl;
+        if (!f) return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Encapsulation of HElib's extensive boilerplate: finding m, building the
+// context and mod chain, generating keys and key-switching matrices, and
+// setting up the EncryptedArray, from one of a few named parameter presets.
+//
+// Generating the mod chain and the key-switching matrices takes minutes, so
+// an instance can keep them in a cache directory and reload them on later
+// runs with the same parameters.
+
+#ifndef HELIBINSTANCE_H
+#define HELIBINSTANCE_H
+
+#include <memory>
+#include <string>
+
+#ifdef STUB
+#include "helib-stub.h"
+#else
+#include "FHE.h"
+#include "EncryptedArray.h"
+#endif
+
+using namespace std;
+
+struct HEParams {
+    string name;
+    long p, r;
+    long L;         // primes in the mod chain
+    long c;         // columns in the key-switching matrices
+    long w;         // Hamming weight of the secret key
+    long d;         // degree of the slot field, 0 for any
+    long security;
+    long s;         // least number of slots, 0 for any
+    long m;         // 0 to let FindM choose
+};
+
+// "multest", "simon-blocks", "simon-simd", "aes" and "aes-bytes", the
+// default parameters of each demo. NULL for an unknown name.
+const HEParams* he_preset (const string &name);
+
+// the preset named by HE_PRESET, else the one named dflt
+HEParams he_presetFromEnv (const string &dflt);
+
+// What helib-tune found fastest for a circuit of the given multiplicative
+// depth on at least s slots, kept in HE_CACHE.
+bool he_readTuned (const string &cacheDir, long depth, long s, HEParams &ps);
+bool he_writeTuned (const string &cacheDir, long depth, long s, const HEParams &ps);
+
+// The parameters a demo should run with: the HE_PRESET preset when that is
+// set, else the tuned set for depth and s when HE_CACHE has one, else the
+// preset named dflt with L raised if it is too short for depth. An
+// HE_PRESET too short for depth is kept, with a warning.
+HEParams he_paramsFor (const string &dflt, long depth, long s);
+
+class HElibInstance {
+public:
+    // Builds the context and keys for params. With a cache directory, they
+    // are loaded from it when a previous run with the same params left
+    // them there, and written to it otherwise. HE_CACHE names the
+    // directory when cacheDir is empty.
+    explicit HElibInstance (const HEParams &params, string cacheDir = "", bool verbose = true);
+
+    HElibInstance (const HElibInstance&) = delete;
+    HElibInstance& operator= (const HElibInstance&) = delete;
+
+    const HEParams& params () const { return _params; }
+    long m () const { return _m; }               // as FindM chose it
+    FHEcontext& context () { return *_context; }
+    FHESecKey& seckey () { return *_seckey; }
+    const FHEPubKey& pubkey () const { return *_seckey; }
+    EncryptedArray& ea () { return *_ea; }
+    size_t nslots () const { return _ea->size(); }
+
+    // whether the context and keys came from the cache
+    bool cached () const { return _cached; }
+
+    // the file in cacheDir for params
+    static string cacheFile (const string &cacheDir, const HEParams &params);
+
+private:
+    void generate (bool verbose);
+    bool load (const string &path);
+    bool save (const string &path) const;
+
+    HEParams _params;
+    long _m;
+    unique_ptr<FHEcontext> _context;
+    unique_ptr<FHESecKey> _seckey;
+    unique_ptr<EncryptedArray> _ea;
+    bool _cached;
+};
+
+#endif
@@ -5,10 +5,320 @@
 //
 // This file creates a fake HElib environment for use with symbolic simulation.
 
+#include <cmath>
+#include <cstdio>
+#include <mutex>
 #include "helib-stub.h"
-#include "simon-util.h" // TODO remove me!
 
-Ctxt::Ctxt (const FHEPubKey& pubkey) : _vec() {};
+////////////////////////////////////////////////////////////////////////////////
+// cost profile
+//
+// The noise model counts in multiplications: a product sits one above the
+// noisier of its inputs, a constant product costs the same, and the key
+// switching behind a shift or Frobenius map costs half. A rotation is
+// priced as EncryptedArray::rotate along a dimension that is not native to
+// the hypercube, which is what FindM usually gives: two automorphisms and
+// a mask product. L primes give a budget of 2(L-1), which matches where
+// the logs in logs/ run out: multest dies at its 31st product with L=16,
+// and simon-simd's depth-44 circuit just fits in L=23.
+//
+// Seconds per op are from the same logs (L=23, 1800 slots) and scale with
+// the square of L, since both the chain and the ring dimension grow with it.
+// Within one context an op costs in proportion to the level it runs at.
+// Ciphertexts stay at the top level until modDownToLevel switches them
+// down; like HElib, the stub works at the lower level when two operands
+// differ, switching the other one (or a copy of it) down first.
+
+static StubStats stats;
+static mutex statsMtx;            // ops may run on several threads
+
+static const double opNoise[STUB_NOPS] = {
+    0,      // STUB_ADD
+    1,      // STUB_MUL
+    0,      // STUB_ADDCONST
+    1,      // STUB_MULCONST
+    0.5,    // STUB_SHIFT
+    1.5,    // STUB_ROTATE, a mask product behind the key switching
+    0.5,    // STUB_FROBENIUS
+    0,      // STUB_MODSWITCH
+    0,      // STUB_ENCRYPT
+    0,      // STUB_DECRYPT
+};
+
+static const double opSeconds[STUB_NOPS] = {
+    0.02,   // STUB_ADD
+    3.6,    // STUB_MUL
+    0.02,   // STUB_ADDCONST
+    0.1,    // STUB_MULCONST
+    16,     // STUB_SHIFT
+    32.1,   // STUB_ROTATE, two key switches and a mask product
+    16,     // STUB_FROBENIUS, one key switch like a shift
+    0.3,    // STUB_MODSWITCH
+    0.5,    // STUB_ENCRYPT
+    0.9,    // STUB_DECRYPT
+};
+
+static const char *opNames[STUB_NOPS] = {
+    "addCtxt", "multiplyBy", "addConstant", "multByConstant", "shift", "rotate",
+    "frobenius", "modDownToLevel", "encrypt", "decrypt"
+};
+
+const StubStats& stub_stats () { return stats; }
+
+void stub_resetStats () {
+    long L = stats.L;
+    stats = StubStats();
+    stats.L = L;
+}
+
+double stub_budget (long L) { return L > 0 ? 2.0 * (L - 1) : HUGE_VAL; }
+
+double stub_opSeconds (StubOp op, long L, long level) {
+    double scale = L > 0 ? L / 23.0 : 1;
+    double frac  = L > 0 && level >= 0 ? (double) min(level, L) / L : 1;
+    return opSeconds[op] * scale * scale * frac;
+}
+
+void stub_printStats (ostream &os) {
+    char line[128];
+    double total = 0;
+    snprintf(line, sizeof line, "helib-stub: cost profile, L=%ld, noise budget %g multiplications\n",
+             stats.L, stub_budget(stats.L));
+    os << line;
+    snprintf(line, sizeof line, "  %-16s %12s %14s\n", "op", "count", "est. seconds");
+    os << line;
+    for (int op = 0; op < STUB_NOPS; op++) {
+        if (!stats.ops[op]) continue;
+        double t = stats.seconds[op];
+        total += t;
+        snprintf(line, sizeof line, "  %-16s %12lu %14.1f\n", opNames[op], stats.ops[op], t);
+        os << line;
+    }
+    snprintf(line, sizeof line, "  %-16s %12s %14.1f  (%.1f hours)\n", "total", "", total,
+             total / 3600);
+    os << line;
+    snprintf(line, sizeof line, "  max depth %ld, max noise %g, %lu ops past the budget\n",
+             stats.maxDepth, stats.maxNoise, stats.overBudget);
+    os << line;
+}
+
+static void printAtExit () { stub_printStats(cerr); }
+
+static long topLevel () { return stats.L > 0 ? stats.L : 1000; }
+
+// counts op, run at level, without a result to check
+static void countOp (StubOp op, long level) {
+    lock_guard<mutex> lock (statsMtx);
+    stats.ops[op]++;
+    stats.seconds[op] += stub_opSeconds(op, stats.L, level);
+}
+
+// counts op, whose result is c
+static void tally (StubOp op, const Ctxt &c) {
+    countOp(op, c.level());
+    lock_guard<mutex> lock (statsMtx);
+    stats.maxDepth = max(stats.maxDepth, c.depth());
+    stats.maxNoise = max(stats.maxNoise, c.noise());
+    if (c.noise() > stub_budget(stats.L)) {
+        if (!stats.overBudget) {
+            cerr << "helib-stub: " << opNames[op] << " result has noise " << c.noise()
+                 << ", past the budget of " << stub_budget(stats.L) << " for L=" << stats.L
+                 << "; real HElib would fail to decrypt" << endl;
+        }
+        stats.overBudget++;
+        const char *strict = getenv("HE_STUB_STRICT");
+        if (strict && *strict && *strict != '0') abort();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// packed slots
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STUB_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*wordOp)(uint64_t *dst, const uint64_t *src, size_t n);
+
+static void xorPortable (uint64_t *dst, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] ^= src[i];
+}
+
+static void andPortable (uint64_t *dst, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] &= src[i];
+}
+
+#ifdef STUB_X86
+__attribute__((target("avx2")))
+static void xorAVX2 (uint64_t *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) &dst[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*) &src[i]);
+        _mm256_storeu_si256((__m256i*) &dst[i], _mm256_xor_si256(a, b));
+    }
+    xorPortable(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void andAVX2 (uint64_t *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) &dst[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*) &src[i]);
+        _mm256_storeu_si256((__m256i*) &dst[i], _mm256_and_si256(a, b));
+    }
+    andPortable(dst + i, src + i, n - i);
+}
+
+static bool haveAVX2 () { return __builtin_cpu_supports("avx2"); }
+static const wordOp xorWords = haveAVX2() ? xorAVX2 : xorPortable;
+static const wordOp andWords = haveAVX2() ? andAVX2 : andPortable;
+#else
+static const wordOp xorWords = xorPortable;
+static const wordOp andWords = andPortable;
+#endif
+
+long StubSlots::get (size_t i) const {
+    size_t pw = planeWords();
+    long v = 0;
+    for (long p = 0; p < d; p++) v |= (long) ((words[p*pw + i/64] >> (i%64)) & 1) << p;
+    return v;
+}
+
+void StubSlots::set (const vector<long> &v) {
+    std::fill(words.begin(), words.end(), 0);
+    size_t pw = planeWords(), n = min(v.size(), nslots);
+    for (size_t i = 0; i < n; i++) {
+        for (long p = 0; p < d; p++) {
+            words[p*pw + i/64] |= (uint64_t) ((v[i] >> p) & 1) << (i%64);
+        }
+    }
+}
+
+void StubSlots::get (vector<long> &v) const {
+    v.resize(nslots);
+    for (size_t i = 0; i < nslots; i++) v[i] = get(i);
+}
+
+void StubSlots::fill (long v) {
+    size_t pw = planeWords();
+    for (long p = 0; p < d; p++) {
+        uint64_t *w = &words[p*pw];
+        std::fill(w, w + pw, ((v >> p) & 1) ? ~(uint64_t) 0 : 0);
+        if (nslots % 64) w[pw-1] &= ((uint64_t) 1 << (nslots % 64)) - 1;
+    }
+}
+
+void StubSlots::xorWith (const StubSlots &other) {
+    xorWords(words.data(), other.words.data(), min(words.size(), other.words.size()));
+}
+
+void StubSlots::andWith (const StubSlots &other) {
+    andWords(words.data(), other.words.data(), min(words.size(), other.words.size()));
+}
+
+// Schoolbook over the planes, 64 slots at a time, then reduced with
+// X^d = g from the top down.
+void StubSlots::mulWith (const StubSlots &other) {
+    if (d == 1 || other.d != d) {
+        andWith(other);
+        return;
+    }
+    size_t pw = planeWords();
+    uint64_t t[128];
+    for (size_t w = 0; w < pw; w++) {
+        std::fill(t, t + 2*d - 1, 0);
+        for (long i = 0; i < d; i++) {
+            uint64_t a = words[i*pw + w];
+            if (!a) continue;
+            for (long j = 0; j < d; j++) t[i+j] ^= a & other.words[j*pw + w];
+        }
+        for (long k = 2*d - 2; k >= d; k--) {
+            for (long b = 0; b < d; b++) {
+                if ((g >> b) & 1) t[k-d+b] ^= t[k];
+            }
+        }
+        for (long i = 0; i < d; i++) words[i*pw + w] = t[i];
+    }
+}
+
+void StubSlots::frobenius (long j) {
+    if (d == 1) return;
+    j %= d;
+    if (j < 0) j += d;
+    for (long i = 0; i < j; i++) {
+        StubSlots self (*this);
+        mulWith(self);
+    }
+}
+
+// one plane of n words
+static void shiftPlane (uint64_t *words, long n, size_t nslots, long k) {
+    size_t m = k > 0 ? k : -k;
+    if (m >= nslots) {
+        std::fill(words, words + n, 0);
+        return;
+    }
+    long q = m / 64, r = m % 64;
+    if (k > 0) {
+        for (long i = n - 1; i >= 0; i--) {
+            uint64_t w = i >= q ? words[i-q] << r : 0;
+            if (r && i >= q + 1) w |= words[i-q-1] >> (64 - r);
+            words[i] = w;
+        }
+        if (nslots % 64) words[n-1] &= ((uint64_t) 1 << (nslots % 64)) - 1;
+    } else {
+        for (long i = 0; i < n; i++) {
+            uint64_t w = i + q < n ? words[i+q] >> r : 0;
+            if (r && i + q + 1 < n) w |= words[i+q+1] << (64 - r);
+            words[i] = w;
+        }
+    }
+}
+
+void StubSlots::shift (long k) {
+    long pw = planeWords();
+    if (k == 0 || pw == 0) return;
+    for (long p = 0; p < d; p++) shiftPlane(&words[p*pw], pw, nslots, k);
+}
+
+void StubSlots::rotate (long k) {
+    if (nslots == 0) return;
+    k %= (long) nslots;
+    if (k < 0) k += nslots;
+    if (k == 0) return;
+    StubSlots wrap (*this);
+    shift(k);
+    wrap.shift(k - (long) nslots);
+    for (size_t i = 0; i < words.size(); i++) words[i] |= wrap.words[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ctxt
+//
+// A Ctxt built from a key alone is an encryption of zero with no slots yet.
+
+Ctxt::Ctxt (const FHEPubKey& pubkey) : _slots(), _depth(0), _noise(0), _level(topLevel()) {};
+
+long Ctxt::findBaseLevel () const {
+    return max(1L, min(_level, topLevel() - (long) ceil(_noise / 2)));
+}
+
+void Ctxt::modDownToLevel (long lvl) {
+    if (lvl >= _level) return;
+    _level = lvl;
+    tally(STUB_MODSWITCH, *this);
+}
+
+// Before an op with other: when this is higher, it is switched down; when
+// other is, HElib switches a copy of it, which costs the same.
+void Ctxt::matchLevel (const Ctxt &other) {
+    long a = _level, b = other._level;
+    if (a > b) modDownToLevel(b);
+    else if (b > a) countOp(STUB_MODSWITCH, a);
+}
 
 Ctxt& Ctxt::operator+= (const Ctxt& rhs) 
 {
@@ -17,9 +327,15 @@ Ctxt& Ctxt::operator+= (const Ctxt& rhs)
 
 Ctxt& Ctxt::addCtxt (const Ctxt& rhs) 
 {
-    for (size_t i = 0; i < _vec.size(); i++) {
-        _vec[i] ^= rhs._vec[i];
+    if (_slots.nslots == 0) {
+        _slots = StubSlots(rhs._slots.nslots, rhs._slots.d, rhs._slots.g);
+        _level = rhs._level;
     }
+    matchLevel(rhs);
+    _slots.xorWith(rhs._slots);
+    _depth = max(_depth, rhs._depth);
+    _noise = max(_noise, rhs._noise);
+    tally(STUB_ADD, *this);
     return *this;
 }
 
@@ -30,48 +346,223 @@ Ctxt& Ctxt::operator*= (const Ctxt& rhs)
 
 Ctxt& Ctxt::multiplyBy (const Ctxt& rhs) 
 {
-    for (size_t i = 0; i < _vec.size(); i++) {
-        _vec[i] &= rhs._vec[i];
-    }
+    if (rhs._slots.nslots == 0) _slots.fill(0);
+    matchLevel(rhs);
+    _slots.mulWith(rhs._slots);
+    _depth = max(_depth, rhs._depth) + 1;
+    _noise = max(_noise, rhs._noise) + opNoise[STUB_MUL];
+    tally(STUB_MUL, *this);
     return *this;
 }
 
+void Ctxt::addConstant (const ZZX& poly)
+{
+    if (_slots.nslots == 0) _slots = StubSlots(poly.slots.nslots, poly.slots.d, poly.slots.g);
+    _slots.xorWith(poly.slots);
+    _noise += opNoise[STUB_ADDCONST];
+    tally(STUB_ADDCONST, *this);
+}
+
+void Ctxt::multByConstant (const ZZX& poly)
+{
+    if (poly.slots.nslots == 0) _slots.fill(0);
+    _slots.mulWith(poly.slots);
+    _noise += opNoise[STUB_MULCONST];
+    tally(STUB_MULCONST, *this);
+}
+
+void Ctxt::frobeniusAutomorph (long j)
+{
+    _slots.frobenius(j);
+    _noise += opNoise[STUB_FROBENIUS];
+    tally(STUB_FROBENIUS, *this);
+}
+
+// GF(2^d) slots add "; d g" after the words
+ostream& operator<< (ostream &os, const Ctxt &c) {
+    os << "[" << c._slots.nslots << " " << c._depth << " " << c._noise << " " << c._level;
+    for (size_t i = 0; i < c._slots.words.size(); i++) os << " " << c._slots.words[i];
+    if (c._slots.d > 1) os << " ; " << c._slots.d << " " << c._slots.g;
+    return os << "]";
+}
+
+istream& operator>> (istream &is, Ctxt &c) {
+    char open, close;
+    size_t n;
+    is >> open >> n >> c._depth >> c._noise >> c._level;
+    if (!is || open != '[') {
+        is.setstate(ios::failbit);
+        return is;
+    }
+    vector<uint64_t> words;
+    uint64_t w;
+    while (is >> ws && is.peek() != ']' && is.peek() != ';' && is >> w) words.push_back(w);
+    long d = 1;
+    unsigned long g = 0;
+    if (is && is.peek() == ';') {
+        is.get();
+        is >> d >> g;
+    }
+    is >> close;
+    if (!is || close != ']' || d < 1 || d > 64) {
+        is.setstate(ios::failbit);
+        return is;
+    }
+    c._slots = StubSlots(n, d, g);
+    if (words.size() != c._slots.words.size()) is.setstate(ios::failbit);
+    else c._slots.words = words;
+    return is;
+}
+
+ostream& operator<< (ostream &os, const FHESecKey &k) {
+    return os << "[stub key]";
+}
+
+istream& operator>> (istream &is, FHESecKey &k) {
+    string a, b;
+    is >> a >> b;
+    if (a != "[stub" || b != "key]") is.setstate(ios::failbit);
+    return is;
+}
+
+void writeContextBase (ostream &os, const FHEcontext &context) {
+    os << "[" << context.m << " " << context.p << " " << context.r << "]\n";
+}
+
+void readContextBase (istream &is, unsigned long &m, unsigned long &p, unsigned long &r) {
+    char open, close;
+    is >> open >> m >> p >> r >> close;
+    if (open != '[' || close != ']') is.setstate(ios::failbit);
+}
+
+ostream& operator<< (ostream &os, const FHEcontext &context) {
+    return os << "[" << context.L << "]";
+}
+
+istream& operator>> (istream &is, FHEcontext &context) {
+    char open, close;
+    long L;
+    is >> open >> L >> close;
+    if (!is || open != '[' || close != ']') {
+        is.setstate(ios::failbit);
+        return is;
+    }
+    buildModChain(context, L);
+    return is;
+}
+
+////////////////////////////////////////////////////////////////////////////////
 // EncryptedArray
 
-void EncryptedArray::encrypt (Ctxt& ctxt, const FHEPubKey& pKey, const vector<long>& ptxt)
+static size_t stubSlots () {
+    const char *n = getenv("HE_STUB_SLOTS");
+    return n && atol(n) > 0 ? atol(n) : 500;
+}
+
+void NTL::SetCoeff (ZZX &x, long i, long a) {
+    if (i > deg(x)) x.rep.resize(i + 1, 0);
+    x.rep[i] = a;
+    while (!x.rep.empty() && !x.rep.back()) x.rep.pop_back();
+}
+
+// a slot value as the bits of its coefficients
+static long polyBits (const ZZX &p) {
+    long v = 0;
+    for (long i = 0; i <= deg(p) && i < 64; i++) v |= (p.rep[i] & 1) << i;
+    return v;
+}
+
+static vector<long> polysBits (const vector<ZZX> &ps) {
+    vector<long> v (ps.size());
+    for (size_t i = 0; i < ps.size(); i++) v[i] = polyBits(ps[i]);
+    return v;
+}
+
+EncryptedArray::EncryptedArray (const FHEcontext& context, const ZZX& G)
+    : _size(stubSlots()), _d(max(1L, deg(G))), _g(_d > 1 ? polyBits(G) & ((1UL << _d) - 1) : 0) {}
+
+void EncryptedArray::encrypt (Ctxt& ctxt, const FHEPubKey& pKey, const vector<long>& ptxt) const
 {
-    ctxt._vec = ptxt;
-    for (size_t i = ptxt.size(); i <= _size; i++) ctxt._vec.push_back(0);
+    ctxt._slots = StubSlots(_size, _d, _g);
+    ctxt._slots.set(ptxt);
+    ctxt._depth = 0;
+    ctxt._noise = 0;
+    ctxt._level = topLevel();
+    tally(STUB_ENCRYPT, ctxt);
 }
 
-void EncryptedArray::decrypt ( const Ctxt& ctxt, const FHESecKey& sKey, vector<long>& ptxt) 
+void EncryptedArray::encrypt (Ctxt& ctxt, const FHEPubKey& pKey, const vector<ZZX>& ptxt) const
 {
-    ptxt = ctxt._vec;
+    encrypt(ctxt, pKey, polysBits(ptxt));
 }
 
-void EncryptedArray::shift (Ctxt& c, long k)
+void EncryptedArray::decrypt (const Ctxt& ctxt, const FHESecKey& sKey, vector<long>& ptxt) const
 {
-    if (k == 0) return;
-    else if (k > 0) {
-        vector<long> shifted (c._vec.begin(), c._vec.end()-k);
-        vector<long> zeroes;
-        for (int i = 0; i < k; i++) zeroes.push_back(0);
-        zeroes.insert(zeroes.end(), shifted.begin(), shifted.end());
-        c._vec = zeroes;
-    } else {
-        vector<long> shifted (c._vec.begin()-k, c._vec.end());
-        vector<long> zeroes;
-        for (int i = 0; i < (-k); i++) zeroes.push_back(0);
-        shifted.insert(shifted.end(), zeroes.begin(), zeroes.end());
-        c._vec = shifted;
+    if (ctxt._slots.nslots) ctxt._slots.get(ptxt);
+    else ptxt.assign(_size, 0);
+    countOp(STUB_DECRYPT, ctxt.level());
+}
+
+void EncryptedArray::decrypt (const Ctxt& ctxt, const FHESecKey& sKey, vector<ZZX>& ptxt) const
+{
+    vector<long> v;
+    decrypt(ctxt, sKey, v);
+    ptxt.assign(v.size(), ZZX());
+    for (size_t i = 0; i < v.size(); i++) {
+        for (long j = 0; j < _d; j++) {
+            if ((v[i] >> j) & 1) SetCoeff(ptxt[i], j);
+        }
     }
 }
 
+void EncryptedArray::encode (ZZX& ptxt, const vector<long>& array) const
+{
+    ptxt.slots = StubSlots(_size, _d, _g);
+    ptxt.slots.set(array);
+}
+
+void EncryptedArray::encode (ZZX& ptxt, const vector<ZZX>& array) const
+{
+    encode(ptxt, polysBits(array));
+}
+
+void EncryptedArray::encode (ZZX& ptxt, const PlaintextArray& array) const
+{
+    ptxt.slots = array._slots;
+}
+
+void EncryptedArray::decode (vector<long>& array, const ZZX& ptxt) const
+{
+    if (ptxt.slots.nslots) ptxt.slots.get(array);
+    else array.assign(_size, 0);
+}
+
+void EncryptedArray::shift (Ctxt& c, long k) const
+{
+    c._slots.shift(k);
+    c._noise += opNoise[STUB_SHIFT];
+    tally(STUB_SHIFT, c);
+}
+
+void EncryptedArray::rotate (Ctxt& c, long k) const
+{
+    c._slots.rotate(k);
+    c._noise += opNoise[STUB_ROTATE];
+    tally(STUB_ROTATE, c);
+}
+
 long FindM (long k, long L, long c, long p, long d, long s, long chosen_m, bool verbose)
 {
     return 1;
 }
 
-void buildModChain (FHEcontext &context, long nPrimes, long c) {}
+void buildModChain (FHEcontext &context, long nPrimes, long c)
+{
+    if (stats.L == 0) atexit(printAtExit);
+    stats.L = nPrimes;
+    context.L = nPrimes;
+}
 
 void addSome1DMatrices(FHESecKey& sKey, long bound, long keyID) {}
+
+void addFrbMatrices(FHESecKey& sKey, long keyID) {}
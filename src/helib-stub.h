@@ -4,18 +4,85 @@
 // Author: Brent Carmer
 //
 // This file creates a fake HElib environment for use with symbolic simulation.
+//
+// Slots hold bits, packed 64 to a word, so adds, products and shifts work on
+// whole words at a time. It covers the part of the HElib API the demos use:
+// Ctxt arithmetic with ciphertexts and constants, EncryptedArray
+// encrypt/decrypt/encode/shift/rotate, and PlaintextArray. There are 500
+// slots unless HE_STUB_SLOTS says otherwise.
+//
+// An EncryptedArray built from a factor G of degree d > 1 has slots in
+// GF(2^d) = GF(2)[X]/G instead, kept as d planes of packed bits, so the
+// products and Frobenius maps are bitsliced too. Those slots are read and
+// written as vector<ZZX>, as in HElib, or as vector<long> with bit i the
+// coefficient of X^i.
+//
+// The stub also keeps a cost profile of the circuit it runs: a tally of
+// every homomorphic operation, the multiplicative depth and level of each
+// Ctxt, and a simulated noise budget derived from the L given to
+// buildModChain. The profile, with an estimate of what the same run would
+// take in real HElib, is printed to stderr at exit. Set HE_STUB_STRICT=1
+// to abort as soon as a ciphertext runs past its budget, as real HElib
+// would.
 
 #ifndef HELIBSTUB_H
 #define HELIBSTUB_H
 
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <string>
 #include <vector>
 
 using namespace std;
 
-struct ZZX {};
+// Packed slot bits: bit p of slot i is bit i%64 of words[p*planeWords() +
+// i/64]. Bits past the last slot are always zero.
+struct StubSlots {
+    vector<uint64_t> words;
+    size_t nslots;
+    long d;                 // bits per slot
+    unsigned long g;        // for d > 1 the field modulus, less its X^d
+
+    StubSlots () : nslots(0), d(1), g(0) {}
+    explicit StubSlots (size_t n, long d = 1, unsigned long g = 0)
+        : words(d * ((n + 63) / 64)), nslots(n), d(d), g(g) {}
+
+    size_t planeWords () const { return (nslots + 63) / 64; }
+    long get (size_t i) const;
+    void set (const vector<long> &v);           // zero past v.size()
+    void get (vector<long> &v) const;           // resizes v to nslots
+    void fill (long v);
+
+    void xorWith (const StubSlots &other);
+    void andWith (const StubSlots &other);      // d = 1 only
+    void mulWith (const StubSlots &other);      // AND, or the product in GF(2^d)
+    void frobenius (long j);                    // each slot to its 2^j-th power
+    void shift (long k);                        // slot i to i+k, zero fill
+    void rotate (long k);                       // slot i to (i+k) mod nslots
+};
+
+namespace NTL {
+// An encoded plaintext. Real HElib holds a polynomial; here it is the slots.
+// A ZZX used as a polynomial, such as a slot value or the factor G, keeps
+// its coefficients in rep, as NTL does.
+struct ZZX {
+    StubSlots slots;
+    vector<long> rep;
+};
+
+inline long deg (const ZZX &a) { return (long) a.rep.size() - 1; }
+inline long coeff (const ZZX &a, long i) { return i >= 0 && i <= deg(a) ? a.rep[i] : 0; }
+void SetCoeff (ZZX &x, long i, long a = 1);
+inline bool IsOne (long a) { return a == 1; }
+}
+using NTL::ZZX;
+using NTL::deg;
+using NTL::coeff;
+using NTL::SetCoeff;
+using NTL::IsOne;
 
 class PAlgebraMod {
 public:
@@ -25,7 +92,9 @@ public:
 class FHEcontext {
 public:
     PAlgebraMod alMod;
-    FHEcontext (long m, long p, long r) {}
+    long m, p, r;
+    long L;                     // primes, once buildModChain has run
+    FHEcontext (long m, long p, long r) : m(m), p(p), r(r), L(0) {}
 };
 
 class FHESecKey {
@@ -44,19 +113,76 @@ public:
     Ctxt& operator*= (const Ctxt& rhs);
     Ctxt& addCtxt (const Ctxt& rhs);
     Ctxt& multiplyBy (const Ctxt& rhs);
+    void addConstant (const ZZX& poly);
+    void multByConstant (const ZZX& poly);
+    void frobeniusAutomorph (long j);           // each slot to its 2^j-th power
+
+    // The lowest level this ciphertext can be switched down to, given the
+    // budget its noise has used. modDownToLevel switches it there (or to
+    // any level in between), which makes every later op on it cheaper.
+    long findBaseLevel () const;
+    void modDownToLevel (long lvl);
+
+    // stub only: multiplications on the longest path into this ciphertext,
+    // the noise budget it has used up, in multiplications, and the primes
+    // it lives on, which only drop when it is switched down
+    long depth () const { return _depth; }
+    double noise () const { return _noise; }
+    long level () const { return _level; }
+
     friend class EncryptedArray;
+    friend ostream& operator<< (ostream &os, const Ctxt &c);
+    friend istream& operator>> (istream &is, Ctxt &c);
 private:
-    std::vector<long> _vec;
+    StubSlots _slots;
+    long _depth;
+    double _noise;
+    long _level;
+
+    void matchLevel (const Ctxt &other);
 };
 
+// Serialization. The stub keys hold nothing, so they write a placeholder.
+ostream& operator<< (ostream &os, const Ctxt &c);
+istream& operator>> (istream &is, Ctxt &c);
+ostream& operator<< (ostream &os, const FHESecKey &k);
+istream& operator>> (istream &is, FHESecKey &k);
+void writeContextBase (ostream &os, const FHEcontext &context);
+void readContextBase (istream &is, unsigned long &m, unsigned long &p, unsigned long &r);
+ostream& operator<< (ostream &os, const FHEcontext &context);
+istream& operator>> (istream &is, FHEcontext &context);
+
+class PlaintextArray;
+
 class EncryptedArray {
-    size_t _size;
+    long _size;
+    long _d;                // degree of the slot field
+    unsigned long _g;       // its modulus, less X^d
 public:
-    EncryptedArray (const FHEcontext& context, const ZZX& G) : _size(500) {}
-    size_t size () { return _size; }
-    void shift (Ctxt& c, long k); 
-    void encrypt (Ctxt& ctxt, const FHEPubKey& pKey, const vector<long>& ptxt);
-    void decrypt (const Ctxt& ctxt, const FHESecKey& sKey, vector<long>& ptxt);
+    EncryptedArray (const FHEcontext& context, const ZZX& G);
+    long size () const { return _size; }
+    long getDegree () const { return _d; }
+    void shift (Ctxt& c, long k) const;
+    void rotate (Ctxt& c, long k) const;
+    void encrypt (Ctxt& ctxt, const FHEPubKey& pKey, const vector<long>& ptxt) const;
+    void encrypt (Ctxt& ctxt, const FHEPubKey& pKey, const vector<ZZX>& ptxt) const;
+    void decrypt (const Ctxt& ctxt, const FHESecKey& sKey, vector<long>& ptxt) const;
+    void decrypt (const Ctxt& ctxt, const FHESecKey& sKey, vector<ZZX>& ptxt) const;
+    void encode (ZZX& ptxt, const vector<long>& array) const;
+    void encode (ZZX& ptxt, const vector<ZZX>& array) const;
+    void encode (ZZX& ptxt, const PlaintextArray& array) const;
+    void decode (vector<long>& array, const ZZX& ptxt) const;
+};
+
+class PlaintextArray {
+    StubSlots _slots;
+public:
+    PlaintextArray (const EncryptedArray& ea) : _slots(ea.size()) {}
+    size_t size () const { return _slots.nslots; }
+    void encode (const vector<long>& array) { _slots.set(array); }
+    void decode (vector<long>& array) const { _slots.get(array); }
+    void replicate (long val) { _slots.fill(val); }
+    friend class EncryptedArray;
 };
 
 long FindM (long k, long L, long c, long p, long d, long s, long chosen_m, bool verbose=false);
@@ -65,4 +191,36 @@ void buildModChain (FHEcontext &context, long nPrimes, long c=3);
 
 void addSome1DMatrices(FHESecKey& sKey, long bound = 100, long keyID = 0);
 
+void addFrbMatrices(FHESecKey& sKey, long keyID = 0);
+
+////////////////////////////////////////////////////////////////////////////////
+// cost profile
+
+enum StubOp {
+    STUB_ADD, STUB_MUL, STUB_ADDCONST, STUB_MULCONST, STUB_SHIFT, STUB_ROTATE,
+    STUB_FROBENIUS, STUB_MODSWITCH, STUB_ENCRYPT, STUB_DECRYPT, STUB_NOPS
+};
+
+struct StubStats {
+    long L;                     // from buildModChain, 0 if it was not called
+    unsigned long ops[STUB_NOPS];
+    double seconds[STUB_NOPS];  // estimated, each op at the level it ran at
+    long maxDepth;
+    double maxNoise;
+    unsigned long overBudget;   // ops whose result is past the budget
+};
+
+const StubStats& stub_stats ();
+
+void stub_resetStats ();
+
+// noise budget for L primes, in multiplications
+double stub_budget (long L);
+
+// estimated seconds for one op in real HElib with L primes, on a
+// ciphertext at the given level (L when it is not given)
+double stub_opSeconds (StubOp op, long L, long level = -1);
+
+void stub_printStats (ostream &os);
+
 #endif
@@ -0,0 +1,156 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Finds HElib parameters for a circuit instead of guessing them:
+//
+//   helib-tune DEPTH [SLOTS]
+//
+// For each c it searches for the smallest L whose context, with m from
+// FindM for at least SLOTS slots, still decrypts a chain of DEPTH squarings
+// correctly. Each probe runs in a child process, since HElib aborts when
+// the noise runs out. The set with the fastest multiplication wins and is
+// written to HE_CACHE (default "he-cache"), where the demos pick it up.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "helib-instance.h"
+#include "metrics.h"
+
+struct Probe {
+    bool ok;
+    long m;
+    long nslots;
+    double mulSeconds;          // mean over the chain
+};
+
+// Squares random bits depth times (x*x = x mod 2) and checks they come back.
+static Probe runProbe (const HEParams &ps, long depth) {
+    HElibInstance he (ps, "", false);
+    EncryptedArray &ea = he.ea();
+    vector<long> bits (he.nslots());
+    for (size_t i = 0; i < bits.size(); i++) bits[i] = rand() & 1;
+    Ctxt c (he.pubkey());
+    ea.encrypt(c, he.pubkey(), bits);
+    uint64_t t0 = metrics_now();
+    for (long i = 0; i < depth; i++) c.multiplyBy(c);
+    double secs = (metrics_now() - t0) * 1e-9;
+    vector<long> out;
+    ea.decrypt(c, he.seckey(), out);
+    bool ok = out == bits;
+#ifdef STUB
+    // the stub's slots never go wrong, so use its noise budget instead
+    ok = ok && c.noise() <= stub_budget(ps.L);
+#endif
+    return { ok, he.m(), (long) he.nslots(), depth ? secs / depth : 0 };
+}
+
+// runProbe in a child; a crash is a failed probe
+static Probe probe (const HEParams &ps, long depth) {
+    int fds[2];
+    Probe res = { false, 0, 0, 0 };
+    if (pipe(fds)) return res;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Probe p = runProbe(ps, depth);
+        if (write(fds[1], &p, sizeof p) != sizeof p) _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid > 0) {
+        if (read(fds[0], &res, sizeof res) != sizeof res) res.ok = false;
+        waitpid(pid, NULL, 0);
+    }
+    close(fds[0]);
+    return res;
+}
+
+static void report (const HEParams &ps, const Probe &p) {
+    printf("  L=%-3ld c=%ld  m=%-6ld slots=%-5ld %s", ps.L, ps.c, p.m, p.nslots,
+           p.ok ? "ok  " : "FAIL");
+    if (p.ok) printf("  %.3f s/mul", p.mulSeconds);
+    printf("\n");
+    fflush(stdout);
+}
+
+// a whole decimal number, or -1
+static long parseCount (const char *arg) {
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    return !*arg || *end || errno ? -1 : n;
+}
+
+static void usage () {
+    cerr << "usage: helib-tune DEPTH [SLOTS]" << endl;
+    exit(1);
+}
+
+int main (int argc, char **argv) {
+    if (argc < 2 || argc > 3) usage();
+    long depth = parseCount(argv[1]);
+    long s     = argc > 2 ? parseCount(argv[2]) : 0;
+    if (depth <= 0 || s < 0) usage();
+    string cache = getenv("HE_CACHE") ? getenv("HE_CACHE") : "he-cache";
+    unsetenv("HE_CACHE");               // probe keys are thrown away
+
+    HEParams ps = { "tuned", 2, 1, 0, 0, 64, 0, 128, s, 0 };
+    HEParams best = ps;
+    Probe bestProbe = { false, 0, 0, 0 };
+    // Each product costs around half a prime. Start below that, step up
+    // in growing strides until a probe passes, then bisect back down to
+    // the last failure.
+    for (long c = 2; c <= 3; c++) {
+        ps.c = c;
+        cout << "c=" << c << endl;
+        long lo = 1, hi = 0;
+        Probe pass = bestProbe;
+        for (long step = 1, L = max(2L, depth / 4); L <= 4 * depth + 8; L += step, step *= 2) {
+            ps.L = L;
+            Probe p = probe(ps, depth);
+            report(ps, p);
+            if (p.ok) {
+                hi = L;
+                pass = p;
+                break;
+            }
+            lo = L;
+        }
+        if (!hi) continue;
+        while (hi - lo > 1) {
+            ps.L = (lo + hi) / 2;
+            Probe p = probe(ps, depth);
+            report(ps, p);
+            if (p.ok) {
+                hi = ps.L;
+                pass = p;
+            } else {
+                lo = ps.L;
+            }
+        }
+        if (!bestProbe.ok || pass.mulSeconds < bestProbe.mulSeconds) {
+            best = ps;
+            best.L = hi;
+            best.m = pass.m;
+            bestProbe = pass;
+        }
+    }
+    if (!bestProbe.ok) {
+        cerr << "no parameters found for depth " << depth << endl;
+        return 1;
+    }
+    printf("best: L=%ld c=%ld m=%ld, %ld slots, %.3f s/mul\n", best.L, best.c, best.m,
+           bestProbe.nslots, bestProbe.mulSeconds);
+    if (!he_writeTuned(cache, depth, s, best)) {
+        cerr << "cannot write to " << cache << endl;
+        return 1;
+    }
+    cout << "saved to " << cache << endl;
+    return 0;
+}
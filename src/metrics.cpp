@@ -0,0 +1,248 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Instrumentation for the drivers: nested steady-clock scopes with counters
+// and histograms, exported as JSON or CSV.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/resource.h>
+#include "metrics.h"
+
+// Power-of-two buckets: bucket i counts values in [2^(i-1), 2^i), and
+// bucket 0 everything below 1.
+struct Histogram {
+    uint64_t n;
+    double sum, min, max;
+    uint64_t buckets[65];
+
+    Histogram () : n(0), sum(0), min(0), max(0) { fill(buckets, buckets + 65, 0); }
+
+    void add (double v) {
+        min = n ? std::min(min, v) : v;
+        max = n ? std::max(max, v) : v;
+        n++;
+        sum += v;
+        int b = v < 1 ? 0 : std::min(64, 1 + (int) floor(log2(v)));
+        buckets[b]++;
+    }
+
+    // upper bound of the bucket holding the p-th percentile, clamped to max
+    double percentile (double p) const {
+        uint64_t want = (uint64_t) ceil(p / 100 * n), seen = 0;
+        for (int b = 0; b < 65; b++) {
+            seen += buckets[b];
+            if (seen >= want && seen) return std::min(max, ldexp(1.0, b));
+        }
+        return max;
+    }
+};
+
+struct MetricNode {
+    string name;
+    MetricNode *parent;
+    vector<unique_ptr<MetricNode>> children;
+    Histogram time;                     // nanoseconds per entry
+    map<string, double> counters;
+    map<string, Histogram> hists;
+    size_t peakRSS;                     // at the latest exit
+
+    MetricNode (const string &n, MetricNode *p) : name(n), parent(p), peakRSS(0) {}
+
+    MetricNode* child (const string &n) {
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i]->name == n) return children[i].get();
+        }
+        children.push_back(unique_ptr<MetricNode>(new MetricNode(n, this)));
+        return children.back().get();
+    }
+};
+
+static mutex mtx;
+static thread_local MetricNode *current = NULL;
+static uint64_t rootStart;
+
+static void writeAtExit () {
+    const char *path = getenv("HE_METRICS");
+    if (path && *path && !metrics_write(path)) perror(path);
+}
+
+static MetricNode* root () {
+    static MetricNode *r = NULL;
+    if (!r) {
+        r = new MetricNode("main", NULL);   // leaked, so it outlives atexit
+        rootStart = metrics_now();
+        atexit(writeAtExit);
+    }
+    return r;
+}
+
+// start the clock for the root with the program
+static MetricNode *rootAtStartup = root();
+
+static MetricNode* top () { return current ? current : root(); }
+
+uint64_t metrics_now () {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t metrics_peakRSS () {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru)) return 0;
+    return (size_t) ru.ru_maxrss * 1024;    // kilobytes on Linux
+}
+
+MetricScope::MetricScope (const string &name, bool p) : print(p), open(true) {
+    lock_guard<mutex> lock (mtx);
+    parent = top();
+    node = parent->child(name);
+    current = node;
+    start = metrics_now();
+}
+
+MetricScope::~MetricScope () {
+    if (open) stop();
+}
+
+double MetricScope::stop () {
+    uint64_t ns = metrics_now() - start;
+    if (!open) return 0;
+    open = false;
+    {
+        lock_guard<mutex> lock (mtx);
+        node->time.add(ns);
+        node->peakRSS = metrics_peakRSS();
+        current = parent;
+    }
+    double s = ns * 1e-9;
+    if (print) {
+        char buf[32];
+        snprintf(buf, sizeof buf, "%.3fs", s);
+        cout << buf << endl;
+    }
+    return s;
+}
+
+void metrics_count (const string &name, double n) {
+    lock_guard<mutex> lock (mtx);
+    top()->counters[name] += n;
+}
+
+void metrics_observe (const string &name, double value) {
+    lock_guard<mutex> lock (mtx);
+    top()->hists[name].add(value);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// export
+
+static string quote (const string &s) {
+    string r = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') r += '\\';
+        r += s[i];
+    }
+    return r + "\"";
+}
+
+static void histJSON (ostream &os, const Histogram &h) {
+    os << "{ \"count\": " << h.n << ", \"sum\": " << h.sum << ", \"min\": " << h.min
+       << ", \"max\": " << h.max << ", \"mean\": " << (h.n ? h.sum / h.n : 0)
+       << ", \"p50\": " << h.percentile(50) << ", \"p99\": " << h.percentile(99)
+       << ", \"buckets\": {";
+    bool first = true;
+    for (int b = 0; b < 65; b++) {
+        if (!h.buckets[b]) continue;
+        os << (first ? " " : ", ") << "\"" << ldexp(1.0, b) << "\": " << h.buckets[b];
+        first = false;
+    }
+    os << " } }";
+}
+
+static void nodeJSON (ostream &os, const MetricNode &n, const string &indent) {
+    os << "{\n" << indent << "  \"name\": " << quote(n.name) << ",\n"
+       << indent << "  \"peak_rss_bytes\": " << n.peakRSS << ",\n"
+       << indent << "  \"time_ns\": ";
+    histJSON(os, n.time);
+    os << ",\n" << indent << "  \"counters\": {";
+    for (map<string, double>::const_iterator i = n.counters.begin(); i != n.counters.end(); ++i) {
+        os << (i == n.counters.begin() ? " " : ", ") << quote(i->first) << ": " << i->second;
+    }
+    os << " },\n" << indent << "  \"histograms\": {";
+    for (map<string, Histogram>::const_iterator i = n.hists.begin(); i != n.hists.end(); ++i) {
+        os << (i == n.hists.begin() ? "\n" : ",\n") << indent << "    " << quote(i->first) << ": ";
+        histJSON(os, i->second);
+    }
+    os << (n.hists.empty() ? " },\n" : "\n" + indent + "  },\n")
+       << indent << "  \"children\": [";
+    for (size_t i = 0; i < n.children.size(); i++) {
+        os << (i ? ", " : "");
+        nodeJSON(os, *n.children[i], indent + "  ");
+    }
+    os << "]\n" << indent << "}";
+}
+
+// the root covers the whole run so far
+static void closeRoot (MetricNode *r) {
+    r->time = Histogram();
+    r->time.add(metrics_now() - rootStart);
+    r->peakRSS = metrics_peakRSS();
+}
+
+void metrics_writeJSON (ostream &os) {
+    lock_guard<mutex> lock (mtx);
+    MetricNode *r = root();
+    closeRoot(r);
+    os << setprecision(15);
+    nodeJSON(os, *r, "");
+    os << "\n";
+}
+
+static void histCSV (ostream &os, const char *kind, const string &path, const string &name,
+                     const Histogram &h) {
+    os << kind << "," << quote(path) << "," << quote(name) << "," << h.n << "," << h.sum << ","
+       << h.min << "," << h.max << "," << (h.n ? h.sum / h.n : 0) << ","
+       << h.percentile(50) << "," << h.percentile(99) << "\n";
+}
+
+static void nodeCSV (ostream &os, const MetricNode &n, const string &prefix) {
+    string path = prefix.empty() ? n.name : prefix + "/" + n.name;
+    histCSV(os, "scope", path, "time_ns", n.time);
+    os << "rss," << quote(path) << ",\"peak_rss_bytes\",1," << n.peakRSS << ",,,,,\n";
+    for (map<string, double>::const_iterator i = n.counters.begin(); i != n.counters.end(); ++i) {
+        os << "counter," << quote(path) << "," << quote(i->first) << ",1," << i->second << ",,,,,\n";
+    }
+    for (map<string, Histogram>::const_iterator i = n.hists.begin(); i != n.hists.end(); ++i) {
+        histCSV(os, "histogram", path, i->first, i->second);
+    }
+    for (size_t i = 0; i < n.children.size(); i++) nodeCSV(os, *n.children[i], path);
+}
+
+void metrics_writeCSV (ostream &os) {
+    lock_guard<mutex> lock (mtx);
+    MetricNode *r = root();
+    closeRoot(r);
+    os << setprecision(15);
+    os << "kind,path,name,count,sum,min,max,mean,p50,p99\n";
+    nodeCSV(os, *r, "");
+}
+
+bool metrics_write (const string &path) {
+    ofstream f (path.c_str());
+    bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    if (csv) metrics_writeCSV(f);
+    else     metrics_writeJSON(f);
+    return (bool) f;
+}
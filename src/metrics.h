@@ -0,0 +1,65 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Instrumentation for the drivers. Work is timed in nested scopes
+// (setup/keygen/encrypt/round N/decrypt) with a steady clock, and each scope
+// keeps its own counters and histograms. Scopes with the same name under the
+// same parent are merged, so a scope entered many times gets a histogram of
+// its durations.
+//
+// When HE_METRICS names a file, the whole tree is written there at exit, as
+// CSV if the name ends in .csv and as JSON otherwise.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+struct MetricNode;
+
+// Times the code between construction and stop() (or destruction) as a
+// child of the innermost open scope on this thread. Scopes must close in
+// the reverse order they were opened.
+class MetricScope {
+public:
+    // with print, stop() writes the elapsed seconds to stdout
+    explicit MetricScope (const string &name, bool print = false);
+    ~MetricScope ();
+    MetricScope (const MetricScope&) = delete;
+    MetricScope& operator= (const MetricScope&) = delete;
+
+    // closes the scope; returns the elapsed seconds
+    double stop ();
+
+private:
+    MetricNode *node;
+    MetricNode *parent;
+    uint64_t start;
+    bool print;
+    bool open;
+};
+
+uint64_t metrics_now ();            // steady clock, nanoseconds
+
+// adds n to a counter of the innermost open scope
+void metrics_count (const string &name, double n = 1);
+
+// records a value in a histogram of the innermost open scope
+void metrics_observe (const string &name, double value);
+
+size_t metrics_peakRSS ();          // bytes
+
+void metrics_writeJSON (ostream &os);
+
+void metrics_writeCSV (ostream &os);
+
+// CSV when path ends in .csv, JSON otherwise
+bool metrics_write (const string &path);
+
+#endif
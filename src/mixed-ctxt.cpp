@@ -0,0 +1,171 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// A slot vector that is only encrypted once it has to be.
+
+#include "metrics.h"
+#include "mixed-ctxt.h"
+
+void MixedTally::report () const {
+    if (addCtxt)        metrics_count("addCtxt", addCtxt);
+    if (multiplyBy)     metrics_count("multiplyBy", multiplyBy);
+    if (addConstant)    metrics_count("addConstant", addConstant);
+    if (multByConstant) metrics_count("multByConstant", multByConstant);
+    if (folded)         metrics_count("folded", folded);
+}
+
+static void tick (MixedTally *tally, atomic<size_t> MixedTally::*op) {
+    if (tally) (tally->*op)++;
+}
+
+MixedCtxt::MixedCtxt (const EncryptedArray &ea, const SlotBuffer &bits)
+    : ea(&ea), bits(bits) {}
+
+MixedCtxt::MixedCtxt (const EncryptedArray &ea, long bit) : ea(&ea), bits(ea.size()) {
+    bits.fill(bit);
+}
+
+MixedCtxt::MixedCtxt (const EncryptedArray &ea, const ZZX &p) : ea(&ea), poly(new ZZX(p)) {
+    vector<long> slots;
+    ea.decode(slots, p);
+    bits.assign(slots);
+}
+
+MixedCtxt::MixedCtxt (const EncryptedArray &ea, const Ctxt &c) : ea(&ea), ct(new Ctxt(c)) {}
+
+MixedCtxt::MixedCtxt (const EncryptedArray &ea, Ctxt &&c) : ea(&ea), ct(new Ctxt(move(c))) {}
+
+MixedCtxt::MixedCtxt (const MixedCtxt &other)
+    : ea(other.ea), bits(other.bits),
+      poly(other.poly ? new ZZX(*other.poly) : NULL),
+      ct(other.ct ? new Ctxt(*other.ct) : NULL) {}
+
+MixedCtxt& MixedCtxt::operator= (const MixedCtxt &other) {
+    if (this == &other) return *this;
+    ea   = other.ea;
+    bits = other.bits;
+    poly.reset(other.poly ? new ZZX(*other.poly) : NULL);
+    ct.reset(other.ct ? new Ctxt(*other.ct) : NULL);
+    return *this;
+}
+
+void MixedCtxt::encode () {
+    if (ct || poly) return;
+    poly.reset(new ZZX);
+    ea->encode(*poly, bits.slots());
+}
+
+void MixedCtxt::encrypt (const FHEPubKey &pubkey) {
+    if (ct) return;
+    ct.reset(new Ctxt(pubkey));
+    ea->encrypt(*ct, pubkey, bits.slots());
+    poly.reset();
+    bits.reset(0);
+}
+
+const ZZX& MixedCtxt::encoding (ZZX &tmp) const {
+    if (poly) return *poly;
+    ea->encode(tmp, bits.slots());
+    return tmp;
+}
+
+bool MixedCtxt::isZero () const {
+    for (size_t i = 0; i < bits.nwords(); i++) {
+        if (bits.data()[i]) return false;
+    }
+    return true;
+}
+
+bool MixedCtxt::isOnes () const {
+    size_t full = bits.size() / 64;
+    for (size_t i = 0; i < full; i++) {
+        if (~bits.data()[i]) return false;
+    }
+    return bits.size() % 64 == 0 || bits.getWord(64 * full, bits.size() % 64) ==
+                                    ((uint64_t) 1 << bits.size() % 64) - 1;
+}
+
+// takes a copy of other in place of the clear value
+void MixedCtxt::becomeCtxt (const Ctxt &other) {
+    ct.reset(new Ctxt(other));
+    poly.reset();
+    bits.reset(0);
+}
+
+void MixedCtxt::xorWith (const MixedCtxt &other, MixedTally *tally) {
+    ZZX tmp;
+    if (ct && other.ct) {
+        ct->addCtxt(*other.ct);
+        tick(tally, &MixedTally::addCtxt);
+    } else if (ct) {
+        if (other.isZero()) {
+            tick(tally, &MixedTally::folded);
+            return;
+        }
+        ct->addConstant(other.encoding(tmp));
+        tick(tally, &MixedTally::addConstant);
+    } else if (other.ct) {
+        if (isZero()) {
+            becomeCtxt(*other.ct);
+            tick(tally, &MixedTally::folded);
+        } else {
+            ZZX keep = encoding(tmp);
+            becomeCtxt(*other.ct);
+            ct->addConstant(keep);
+            tick(tally, &MixedTally::addConstant);
+        }
+    } else {
+        uint64_t *w = bits.data();
+        const uint64_t *o = other.bits.data();
+        for (size_t i = 0; i < bits.nwords(); i++) w[i] ^= o[i];
+        poly.reset();
+        tick(tally, &MixedTally::folded);
+    }
+}
+
+void MixedCtxt::andWith (const MixedCtxt &other, MixedTally *tally) {
+    ZZX tmp;
+    if (ct && other.ct) {
+        ct->multiplyBy(*other.ct);
+        tick(tally, &MixedTally::multiplyBy);
+    } else if (ct) {
+        if (other.isOnes()) {
+            tick(tally, &MixedTally::folded);
+        } else if (other.isZero()) {
+            ct.reset();
+            bits.reset(ea->size());
+            tick(tally, &MixedTally::folded);
+        } else {
+            ct->multByConstant(other.encoding(tmp));
+            tick(tally, &MixedTally::multByConstant);
+        }
+    } else if (other.ct) {
+        if (isZero()) {
+            tick(tally, &MixedTally::folded);
+        } else if (isOnes()) {
+            becomeCtxt(*other.ct);
+            tick(tally, &MixedTally::folded);
+        } else {
+            ZZX keep = encoding(tmp);
+            becomeCtxt(*other.ct);
+            ct->multByConstant(keep);
+            tick(tally, &MixedTally::multByConstant);
+        }
+    } else {
+        uint64_t *w = bits.data();
+        const uint64_t *o = other.bits.data();
+        for (size_t i = 0; i < bits.nwords(); i++) w[i] &= o[i];
+        poly.reset();
+        tick(tally, &MixedTally::folded);
+    }
+}
+
+void MixedCtxt::decrypt (const FHESecKey &seckey, vector<long> &out) const {
+    if (ct) {
+        ea->decrypt(*ct, seckey, out);
+    } else {
+        out = bits.slots();
+    }
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// A slot vector that is only encrypted once it has to be. Many operands of
+// the demos are public: the counters of CTR mode, the all-ones word, the
+// constants of AES. A MixedCtxt holds such a value in the clear until a
+// secret one is mixed in, so:
+//
+//   clear    op clear     is done on the CPU, for free
+//   clear    op Ctxt      is addConstant or multByConstant
+//   Ctxt     op Ctxt      is addCtxt or multiplyBy
+//
+// and products with all-zero or all-one constants cost nothing at all. A
+// clear value can also be kept encoded, so a constant used many times is
+// only encoded once; otherwise it is encoded each time it meets a Ctxt.
+
+#ifndef MIXEDCTXT_H
+#define MIXEDCTXT_H
+
+#include <atomic>
+#include <memory>
+
+#ifdef STUB
+#include "helib-stub.h"
+#else
+#include "FHE.h"
+#include "EncryptedArray.h"
+#endif
+
+#include "simon-util.h"
+
+// How many of each HElib op a batch of MixedCtxt ops ran, for ops done on
+// pool threads that have no metrics scope of their own. report() adds them
+// to the counters of the calling thread's scope.
+struct MixedTally {
+    atomic<size_t> addCtxt, multiplyBy, addConstant, multByConstant, folded;
+    MixedTally () : addCtxt(0), multiplyBy(0), addConstant(0), multByConstant(0), folded(0) {}
+    void report () const;
+};
+
+class MixedCtxt {
+public:
+    enum Kind { CLEAR, ENCODED, CIPHER };
+
+    // a public value; nslots slots of bit when bits is not given
+    MixedCtxt (const EncryptedArray &ea, const SlotBuffer &bits);
+    MixedCtxt (const EncryptedArray &ea, long bit);
+    // a public value that is already encoded
+    MixedCtxt (const EncryptedArray &ea, const ZZX &poly);
+    // a secret one
+    MixedCtxt (const EncryptedArray &ea, const Ctxt &ct);
+    MixedCtxt (const EncryptedArray &ea, Ctxt &&ct);
+
+    MixedCtxt (const MixedCtxt &other);
+    MixedCtxt& operator= (const MixedCtxt &other);
+    MixedCtxt (MixedCtxt &&other) = default;
+    MixedCtxt& operator= (MixedCtxt &&other) = default;
+
+    Kind kind () const { return ct ? CIPHER : poly ? ENCODED : CLEAR; }
+    bool isClear () const { return !ct; }
+    const SlotBuffer& clear () const { return bits; }       // when isClear
+    const Ctxt& ctxt () const { return *ct; }               // when !isClear
+    Ctxt& ctxt () { return *ct; }
+
+    // clear only: every slot 0, every slot 1
+    bool isZero () const;
+    bool isOnes () const;
+
+    // keeps a clear value's encoding for the ops that follow
+    void encode ();
+    // makes it a Ctxt; only needed where HElib must see one, as in a file
+    void encrypt (const FHEPubKey &pubkey);
+
+    // slot-wise XOR and AND, the cheapest way the kinds allow
+    void xorWith (const MixedCtxt &other, MixedTally *tally = NULL);
+    void andWith (const MixedCtxt &other, MixedTally *tally = NULL);
+    MixedCtxt& operator+= (const MixedCtxt &other) { xorWith(other); return *this; }
+    MixedCtxt& operator*= (const MixedCtxt &other) { andWith(other); return *this; }
+
+    // -1 for a clear value, which has no level; switching one is a no-op
+    long findBaseLevel () const { return ct ? ct->findBaseLevel() : -1; }
+    void modDownToLevel (long lvl) { if (ct) ct->modDownToLevel(lvl); }
+
+    void decrypt (const FHESecKey &seckey, vector<long> &out) const;
+
+private:
+    const EncryptedArray *ea;
+    SlotBuffer bits;            // the value while it is clear
+    unique_ptr<ZZX> poly;       // its encoding, when kept
+    unique_ptr<Ctxt> ct;        // the value once it is secret
+
+    // clear only: the encoding, made into tmp unless it is kept
+    const ZZX& encoding (ZZX &tmp) const;
+    void becomeCtxt (const Ctxt &other);
+};
+
+#endif
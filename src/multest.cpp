@@ -3,82 +3,206 @@
 //
 // Author: Brent Carmer
 //
-// This file homomorphically squares 1 a number of times in an attempt to
-// discover the noise limit in HElib.
+// Benchmarks HElib's primitives over a grid of parameters, to predict what a
+// whole cipher will cost and to choose between the simon-simd and
+// simon-blocks layouts for a workload:
+//
+//   multest [--L 16,23] [--c 3] [--m 0] [--samples N] [--level-step K] [--csv FILE|-]
+//
+// For each (L, c, m) it switches fresh ciphertexts down to every K-th level
+// they have, and at each level times multiplyBy, addCtxt, multByConstant,
+// addConstant, shift, rotate and decrypt, serially for latency and across
+// the shared pool for throughput. Encryption always yields a top-level
+// ciphertext, so it is only timed there. Each row also gives the size of a
+// ciphertext at that level and whether the operand decrypts correctly;
+// switching a fresh ciphertext down adds no noise, so those always do. The
+// "square" rows find where the noise runs out: one ciphertext is squared
+// over and over, one row per product at the level it ends up at, until it
+// no longer decrypts or has no level left. m=0 lets FindM choose. Progress
+// goes to stderr and the CSV table to stdout unless --csv names a file.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+#include "helib-instance.h"
+#include "metrics.h"
+#include "thread-pool.h"
+
+struct BenchConfig {
+    vector<long> Ls, cs, ms;
+    size_t samples;
+    long levelStep;
+};
+
+struct OpTiming {
+    double mean, p50, min;      // seconds per op, serial
+    double throughput;          // ops per second on the shared pool
+};
 
-#include <ctime>
+// times op, which gets a fresh copy of the operand each call
+static OpTiming timeOp (size_t samples, const Ctxt &operand, const function<void(Ctxt&)> &op) {
+    vector<double> ts;
+    for (size_t i = 0; i < samples; i++) {
+        Ctxt c (operand);
+        uint64_t t0 = metrics_now();
+        op(c);
+        ts.push_back((metrics_now() - t0) * 1e-9);
+    }
+    sort(ts.begin(), ts.end());
+    OpTiming t;
+    t.min  = ts[0];
+    t.p50  = ts[ts.size() / 2];
+    t.mean = 0;
+    for (size_t i = 0; i < ts.size(); i++) t.mean += ts[i] / ts.size();
+
+    size_t n = samples * ThreadPool::shared().size();
+    vector<Ctxt> cs (n, operand);
+    uint64_t t0 = metrics_now();
+    ThreadPool::shared().parallelEach(n, [&](size_t i) { op(cs[i]); });
+    double wall = (metrics_now() - t0) * 1e-9;
+    t.throughput = wall > 0 ? n / wall : 0;
+    return t;
+}
 
+static size_t ctxtBytes (const Ctxt &c) {
+    ostringstream s;
+    s << c;
+    return s.str().size();
+}
+
+static void row (ostream &os, const HElibInstance &he, long level, const char *op,
+                 size_t samples, const OpTiming &t, size_t bytes, bool ok) {
+    const HEParams &ps = he.params();
+    os << ps.L << "," << ps.c << "," << he.m() << "," << he.nslots() << "," << level << ","
+       << op << "," << samples << "," << t.mean << "," << t.p50 << "," << t.min << ","
+       << t.throughput << "," << bytes << "," << (ok ? 1 : 0) << endl;
+}
+
+// Squares a = bits (x*x = x mod 2) until it stops decrypting to bits or
+// reaches level 1, past which HElib would abort.
+static void benchChain (ostream &os, HElibInstance &he, const Ctxt &a, const vector<long> &bits) {
+    Ctxt c (a);
+    for (long i = 1; ; i++) {
+        uint64_t t0 = metrics_now();
+        c.multiplyBy(c);
+        double secs = (metrics_now() - t0) * 1e-9;
+        vector<long> out;
+        he.ea().decrypt(c, he.seckey(), out);
+        bool ok = out == bits;
 #ifdef STUB
-#include "helib-stub.h"
-#else
-#include "FHE.h"
-#include "EncryptedArray.h"
+        // the stub's slots never go wrong, so use its noise budget instead
+        ok = ok && c.noise() <= stub_budget(he.params().L);
 #endif
+        long level = c.findBaseLevel();
+        cerr << "  square " << i << ", level " << level << (ok ? "" : ", wrong") << endl;
+        row(os, he, level, "square", 1, { secs, secs, secs, 0 }, ctxtBytes(c), ok);
+        if (!ok || level <= 1) break;
+    }
+}
 
-#include "simon-util.h"
+static void benchInstance (ostream &os, const BenchConfig &cfg, HElibInstance &he) {
+    EncryptedArray &ea = he.ea();
+    const FHEPubKey &pubkey = he.pubkey();
+    vector<long> bits (he.nslots()), other (he.nslots());
+    for (size_t i = 0; i < bits.size(); i++) {
+        bits[i]  = rand() & 1;
+        other[i] = rand() & 1;
+    }
+    ZZX konst;
+    ea.encode(konst, other);
+
+    Ctxt a (pubkey), b (pubkey);
+    OpTiming enc = timeOp(cfg.samples, a, [&](Ctxt &c) { ea.encrypt(c, pubkey, bits); });
+    ea.encrypt(a, pubkey, bits);
+    ea.encrypt(b, pubkey, other);
+    long top = a.findBaseLevel();
+    row(os, he, top, "encrypt", cfg.samples, enc, ctxtBytes(a), true);
+    benchChain(os, he, a, bits);
 
-EncryptedArray* global_ea;
-long global_nslots;
+    for (long level = top; level >= 1; level -= cfg.levelStep) {
+        cerr << "  level " << level << endl;
+        a.modDownToLevel(level);
+        b.modDownToLevel(level);
+        size_t bytes = ctxtBytes(a);
+        vector<long> out;
+        ea.decrypt(a, he.seckey(), out);
+        bool ok = out == bits;
 
-Ctxt heEncrypt(const FHEPubKey& k, uint32_t x) {
-    vector<long> vec = uint32ToBits(x);
-    pad(0, vec, global_nslots);
-    Ctxt c(k);
-    global_ea->encrypt(c, k, vec);
-    return c;
+        const char *names[] = {
+            "multiplyBy", "addCtxt", "multByConstant", "addConstant", "shift", "rotate"
+        };
+        function<void(Ctxt&)> ops[] = {
+            [&](Ctxt &c) { c.multiplyBy(b); },
+            [&](Ctxt &c) { c.addCtxt(b); },
+            [&](Ctxt &c) { c.multByConstant(konst); },
+            [&](Ctxt &c) { c.addConstant(konst); },
+            [&](Ctxt &c) { ea.shift(c, 1); },
+            [&](Ctxt &c) { ea.rotate(c, 1); },
+        };
+        for (size_t i = 0; i < sizeof names / sizeof names[0]; i++) {
+            row(os, he, level, names[i], cfg.samples, timeOp(cfg.samples, a, ops[i]), bytes, ok);
+        }
+        OpTiming dec = timeOp(cfg.samples, a, [&](Ctxt &c) {
+            vector<long> v;
+            ea.decrypt(c, he.seckey(), v);
+        });
+        row(os, he, level, "decrypt", cfg.samples, dec, bytes, ok);
+    }
 }
 
-vector<long> heDecrypt (const FHESecKey& k, Ctxt c) {
-    vector<long> vec;
-    global_ea->decrypt(c, k, vec);
-    return vec;
+static vector<long> parseList (const char *s) {
+    vector<long> v;
+    stringstream ss (s);
+    string item;
+    while (getline(ss, item, ',')) v.push_back(atol(item.c_str()));
+    return v;
+}
+
+static void usage () {
+    cerr << "usage: multest [--L 16,23] [--c 3] [--m 0] [--samples N] [--level-step K] "
+            "[--csv FILE|-]" << endl;
+    exit(2);
 }
 
 int main(int argc, char **argv) {
-    // initialize helib
-    timer(true);
-    long m=0, p=2, r=1;
-    long L=17;
-    long c=3;
-    long w=16;
-    long d=0;
-    long security = 128;
-    cout << "L=" << L << endl;
-    ZZX G;
-    cout << "Finding m..." << endl;
-    m = FindM(security,L,c,p,d,0,0);
-    cout << "Generating context..." << endl;
-    FHEcontext context(m, p, r);
-    cout << "Building mod-chain..." << endl;
-    buildModChain(context, L, c);
-    cout << "Generating keys..." << endl;
-    FHESecKey seckey(context);
-    const FHEPubKey& pubkey = seckey;
-    G = context.alMod.getFactorsOverZZ()[0];
-    seckey.GenSecKey(w);
-    addSome1DMatrices(seckey);
-    EncryptedArray ea(context, G);
-    global_nslots = ea.size();
-    cout << "nslots = " << global_nslots << endl;
-
-    global_ea = &ea;
-
-    // how many multiplications can we do without noise?
-    Ctxt one = heEncrypt(pubkey, 1);
-    Ctxt two = heEncrypt(pubkey, 2);
-    timer();
-    for (int i = 1; i <= 100; i++) {
-        cout << "mul#" << i << "..." << flush;
-        ///////////
-        one.multiplyBy(two);
-        ///////////
-
-        //vector<long> res = heDecrypt(seckey, one);
-        //for (int j = 32; j >= 0; j--) {
-            //if (j > 0 && j%4==0) cout << " ";
-            //cout << res[j];
-        //}
-        //cout << endl;
+    BenchConfig cfg = { { 16 }, { 3 }, { 0 }, 3, 1 };
+    const char *csv = "-";
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) usage();
+        if      (!strcmp(argv[i], "--L"))          cfg.Ls = parseList(argv[++i]);
+        else if (!strcmp(argv[i], "--c"))          cfg.cs = parseList(argv[++i]);
+        else if (!strcmp(argv[i], "--m"))          cfg.ms = parseList(argv[++i]);
+        else if (!strcmp(argv[i], "--samples"))    cfg.samples = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--level-step")) cfg.levelStep = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--csv"))        csv = argv[++i];
+        else usage();
+    }
+    if (cfg.samples == 0 || cfg.levelStep < 1) usage();
+
+    ofstream file;
+    if (strcmp(csv, "-")) file.open(csv);
+    ostream &os = strcmp(csv, "-") ? file : cout;
+    os << "L,c,m,nslots,level,op,samples,mean_s,p50_s,min_s,throughput_per_s,ctxt_bytes,"
+          "decrypt_ok" << endl;
+
+    HEParams ps = he_presetFromEnv("multest");
+    for (size_t i = 0; i < cfg.Ls.size(); i++) {
+        for (size_t j = 0; j < cfg.cs.size(); j++) {
+            for (size_t k = 0; k < cfg.ms.size(); k++) {
+                ps.L = cfg.Ls[i];
+                ps.c = cfg.cs[j];
+                ps.m = cfg.ms[k];
+                cerr << "L=" << ps.L << " c=" << ps.c << " m=" << ps.m << endl;
+                MetricScope scope ("L=" + to_string(ps.L) + " c=" + to_string(ps.c)
+                                   + " m=" + to_string(ps.m));
+                HElibInstance he (ps, "", false);
+                benchInstance(os, cfg, he);
+            }
+        }
     }
-    return 0;
+    return os ? 0 : 1;
 }
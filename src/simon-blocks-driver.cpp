@@ -4,93 +4,124 @@
 // Author: Brent Carmer
 //
 // An implementation of the SIMON block cipher in HElib. Each Ctxt gets packed
-// with 32 bits, representing half of a SIMON block.
+// with 32 bits, representing half of a SIMON block, in each of its lanes.
+// The input is repeated to fill every lane of one heblock, and each round
+// checks all of them against the plaintext cipher.
+//
+// With HE_SCHEDULE=path the encrypted key schedule is loaded from path when
+// the file matches this context and public key, or encrypted and written
+// there. HE_BLOCK_LAYOUT=ring switches to the ring layout, which needs a
+// multiple of 32 slots.
 
 #include "simon-blocks.h"
 
 EncryptedArray* global_ea;
 ZZX* global_maxint;
 size_t global_nslots;
+WordLayout global_layout;
 
 int main(int argc, char **argv)
 {
-    string inp = "secrets!";
+    string inp = "secrets! very secrets!";
     cout << "inp = \"" << inp << "\"" << endl;
-    vector<pt_block> bs = strToBlocks(inp);
-    printf("as block : 0x%08x 0x%08x\n", bs[0].x, bs[0].y);
+    vector<pt_block> inpBlocks = strToBlocks(inp);
+    printf("as block : 0x%08x 0x%08x\n", inpBlocks[0].x, inpBlocks[0].y);
     //key k = genKey();
     vector<pt_key32> k ({0x1b1a1918, 0x13121110, 0x0b0a0908, 0x03020100});
     pt_expandKey(k);
     printKey(k);
 
     // initialize helib
-    long m=0, p=2, r=1;
-    //long L=70;
-    long L=45;
-    long c=3;
-    long w=64;
-    long d=0;
-    long security = 128;
-    cout << "L=" << L << endl;
-    ZZX G;
-    cout << "Finding m..." << endl;
-    m = FindM(security,L,c,p,d,0,0);
-    cout << "Generating context..." << endl;
-    FHEcontext context(m, p, r);
-    cout << "Building mod-chain..." << endl;
-    buildModChain(context, L, c);
-    cout << "Generating keys..." << endl;
-    FHESecKey seckey(context);
-    const FHEPubKey& pubkey = seckey;
-    G = context.alMod.getFactorsOverZZ()[0];
-    seckey.GenSecKey(w);
-    addSome1DMatrices(seckey);
-    EncryptedArray ea(context, G);
-    global_nslots = ea.size();
-    cout << "nslots = " << global_nslots << endl;
+    MetricScope setup ("setup");
+    // Each round multiplies two rotations. With lanes each rotation is a
+    // constant product plus key switching worth half of one, so the noise
+    // grows by 2.5 products a round. On the ring HElib's rotate is itself
+    // automorphisms and mask products unless the hypercube has a single
+    // native dimension, so it gets the same budget.
+    global_layout = layoutFromEnv();
+    long depth = 5 * T / 2;
+    HElibInstance he (he_paramsFor("simon-blocks", depth, 0));
+    EncryptedArray &ea = he.ea();
+    const FHESecKey &seckey = he.seckey();
+    const FHEPubKey &pubkey = he.pubkey();
+    global_nslots = he.nslots();
+    if (global_layout == LAYOUT_RING && global_nslots % 32) {
+        cerr << "the ring layout needs a multiple of 32 slots, not " << global_nslots << endl;
+        return 1;
+    }
 
     // set up globals
     global_ea     = &ea;
 
 
     PlaintextArray mask_p(*global_ea);
-    vector<long> vec = uint32ToBits(0xFFFFFFFF);
-    pad(0, vec, global_nslots);
-    mask_p.encode(vec);
+    mask_p.encode(laneSlots(vector<uint32_t>(heLanes(), 0xFFFFFFFF)).slots());
     ZZX maxint;
     global_ea->encode(maxint, mask_p);
     global_maxint = &maxint;
+    setup.stop();
+    cout << heLanes() << " blocks per Ctxt, "
+         << (global_layout == LAYOUT_RING ? "ring" : "lanes") << " layout" << endl;
+
+    vector<pt_block> bs;
+    for (size_t i = 0; i < heLanes(); i++) bs.push_back(inpBlocks[i % inpBlocks.size()]);
 
     cout << "Encrypting SIMON key..." << flush;
-    timer(true);
-    vector<Ctxt> encryptedKey = heEncrypt(pubkey, k);
-    timer();
+    MetricScope encKey ("encrypt key", true);
+    vector<Ctxt> encryptedKey;
+    const char *schedFile = getenv("HE_SCHEDULE");
+    const HEParams &ps = he.params();
+    CtxtFileParams params = { he.m(), ps.p, ps.r, ps.L, ps.c, (long) global_nslots };
+    string label = "SIMON 64/128 test-vector key schedule, one word per Ctxt in every lane, "
+                   + string(global_layout == LAYOUT_RING ? "ring" : "lanes") + " layout", err;
+    vector<vector<Ctxt>> rows;
+    if (schedFile && ctxt_readFile(schedFile, params, pubkey, label, rows, err)) {
+        cout << "loaded from " << schedFile << "..." << flush;
+        for (size_t i = 0; i < rows.size(); i++) encryptedKey.push_back(rows[i][0]);
+    } else {
+        if (schedFile) cout << err << "..." << flush;
+        encryptedKey = heEncrypt(pubkey, k);
+        for (size_t i = 0; i < encryptedKey.size(); i++) rows.push_back({ encryptedKey[i] });
+        if (schedFile && !ctxt_writeFile(schedFile, params, pubkey, label, rows)) {
+            cerr << "cannot write " << schedFile << endl;
+        }
+    }
+    rows.clear();
+    encKey.stop();
 
     cout << "Encrypting inp..." << flush;
-    vector<heblock> cts = heEncrypt(pubkey, inp);
-    timer();
+    MetricScope encInp ("encrypt input", true);
+    vector<heblock> cts = heEncrypt(pubkey, bs);
+    encInp.stop();
 
     cout << "Running protocol..." << endl;
-    heblock b = cts[0];
+    MetricScope protocol ("protocol");
+    heblock &b = cts[0];
     for (size_t i = 0; i < T; i++) {
-        timer(true);
+        MetricScope round ("round " + to_string(i+1));
         cout << "Round " << i+1 << "/" << T << "..." << flush;
+        long lvl = scheduleLevels(b, encryptedKey[i]);
+        cout << "level " << lvl << "..." << flush;
+        MetricScope enc ("encRound", true);
         encRound(encryptedKey[i], b);
-        timer();
+        enc.stop();
 
         // check intermediate result for noise
         cout << "decrypting..." << flush;
-        pt_block res = heDecrypt(seckey, b);
-        timer();
-
-        printf("result    : 0x%08x 0x%08x\n", res.x, res.y);
+        MetricScope dec ("decrypt", true);
+        vector<pt_block> res = heDecrypt(seckey, cts, bs.size());
+        dec.stop();
 
-        vector<pt_block> bs = strToBlocks(inp);
-        for (size_t j = 0; j <= i; j++) {
-            bs[0] = pt_encRound(k[j], bs[0]);
+        size_t good = 0;
+        for (size_t j = 0; j < bs.size(); j++) {
+            bs[j] = pt_encRound(k[i], bs[j]);
+            good += res[j].x == bs[j].x && res[j].y == bs[j].y;
         }
+        printf("result    : 0x%08x 0x%08x\n", res[0].x, res[0].y);
         printf("should be : 0x%08x 0x%08x\n", bs[0].x, bs[0].y);
-        cout << "decrypted : \"" << pt_simonDec(k, {res}, i+1) << "\" " << endl;
+        cout << good << "/" << bs.size() << " blocks match" << endl;
+        res.resize(inpBlocks.size());
+        cout << "decrypted : \"" << pt_simonDec(k, res, i+1) << "\" " << endl;
     }
     return 0;
 }
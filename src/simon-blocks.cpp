@@ -6,8 +6,64 @@
 // An implementation of the SIMON block cipher in HElib. Each Ctxt gets packed
 // with 32 bits, representing half of a SIMON block.
 
+#include <cstring>
 #include "simon-blocks.h"
 
+size_t heLanes () {
+    return global_nslots / 32;
+}
+
+WordLayout layoutFromEnv () {
+    const char *want = getenv("HE_BLOCK_LAYOUT");
+    return want && !strcmp(want, "ring") ? LAYOUT_RING : LAYOUT_LANES;
+}
+
+SlotBuffer laneSlots (const vector<uint32_t> &ws) {
+    SlotBuffer buf (global_nslots);
+    size_t lanes = heLanes();
+    for (size_t i = 0; i < ws.size() && i < lanes; i++) {
+        if (global_layout == LAYOUT_LANES) {
+            buf.setWord(32 * i, ws[i], 32);
+        } else {
+            for (size_t b = 0; b < 32; b++) buf.set(b * lanes + i, ws[i] >> b);
+        }
+    }
+    return buf;
+}
+
+static uint32_t laneWord (const SlotBuffer &buf, size_t i) {
+    if (global_layout == LAYOUT_LANES) return buf.getWord(32 * i, 32);
+    uint32_t w = 0;
+    for (size_t b = 0; b < 32; b++) w |= (uint32_t) buf.get(b * heLanes() + i) << b;
+    return w;
+}
+
+// For rotating left by n: hi[n] keeps the slots of each lane that a shift by
+// n filled from the same lane, lo[n] the ones a shift by -(32-n) did.
+struct LaneMasks {
+    ZZX hi[32];
+    ZZX lo[32];
+};
+
+static const LaneMasks& laneMasks () {
+    static const LaneMasks masks = [] {
+        LaneMasks m;
+        SlotBuffer hi (global_nslots), lo (global_nslots);
+        for (int n = 1; n < 32; n++) {
+            hi.reset(global_nslots);
+            lo.reset(global_nslots);
+            for (size_t j = 0; j < heLanes(); j++) {
+                hi.setWord(32 * j, 0xFFFFFFFFu << n, 32);
+                lo.setWord(32 * j, (1u << n) - 1, 32);
+            }
+            global_ea->encode(m.hi[n], hi.slots());
+            global_ea->encode(m.lo[n], lo.slots());
+        }
+        return m;
+    }();
+    return masks;
+}
+
 void negate32(Ctxt &x) {
     x.addConstant(*global_maxint);
 }
@@ -29,13 +85,44 @@ void rotateLeft32Old(Ctxt &x, int n) {
     negate32(x);
 }
 
-void rotateLeft32(Ctxt &x, int n) {
-    Ctxt other = x;
-    global_ea->shift(x, n);
-    global_ea->shift(other, -(32-n));
-    x.multByConstant(*global_maxint);
-    other.multByConstant(*global_maxint);
-    x += other;
+void RotateTally::report () const {
+    if (shift)          metrics_count("shift", shift);
+    if (rotate)         metrics_count("rotate", rotate);
+    if (multByConstant) metrics_count("multByConstant", multByConstant);
+}
+
+// In LAYOUT_LANES the shifts carry bits across lanes, which the masks cut
+// off: the bits that left the top of a lane come back into its bottom from
+// the second shift.
+void rotateLeft32(Ctxt &x, int n, RotateTally *tally) {
+    n &= 31;
+    if (!n) return;
+    RotateTally own;
+    RotateTally &t = tally ? *tally : own;
+    if (global_layout == LAYOUT_RING) {
+        t.rotate++;
+        global_ea->rotate(x, n * heLanes());
+    } else {
+        t.shift += 2;
+        t.multByConstant += 2;
+        const LaneMasks &masks = laneMasks();
+        Ctxt other = x;
+        global_ea->shift(x, n);
+        global_ea->shift(other, -(32-n));
+        x.multByConstant(masks.hi[n]);
+        other.multByConstant(masks.lo[n]);
+        x += other;
+    }
+    if (!tally) own.report();
+}
+
+void rotateLeft32Each(const Ctxt &x, const int *ns, Ctxt **out, size_t k) {
+    RotateTally tally;
+    ThreadPool::shared().parallelEach(k, [&](size_t i) {
+        *out[i] = x;
+        rotateLeft32(*out[i], ns[i], &tally);
+    });
+    tally.report();
 }
 
 void encRound(Ctxt &key, heblock& inp) {
@@ -44,9 +131,10 @@ void encRound(Ctxt &key, heblock& inp) {
     Ctxt x1  = inp.x;
     Ctxt x2  = inp.x;
     Ctxt y   = inp.y;
-    rotateLeft32(x0, 1);
-    rotateLeft32(x1, 8);
-    rotateLeft32(x2, 2);
+    Ctxt *xs[3]  = { &x0, &x1, &x2 };
+    const int rs[3] = { 1, 8, 2 };
+    rotateLeft32Each(inp.x, rs, xs, 3);
+    metrics_count("multiplyBy");
     x0.multiplyBy(x1);
     y    += x0;
     y    += x2;
@@ -55,44 +143,78 @@ void encRound(Ctxt &key, heblock& inp) {
     inp.y = tmp;
 }
 
+long scheduleLevels (heblock &inp, Ctxt &key) {
+    long lvl = inp.x.findBaseLevel();
+    inp.x.modDownToLevel(lvl);
+    inp.y.modDownToLevel(lvl);
+    key.modDownToLevel(lvl);
+    metrics_observe("level", lvl);
+    return lvl;
+}
+
 Ctxt heEncrypt(const FHEPubKey& k, uint32_t x) {
-    vector<long> vec = uint32ToBits(x);
-    pad(0, vec, global_nslots);
     Ctxt c(k);
-    global_ea->encrypt(c, k, vec);
+    global_ea->encrypt(c, k, laneSlots({ x }).slots());
     return c;
 }
 
 uint32_t heDecrypt (const FHESecKey& k, Ctxt &c) {
     vector<long> vec;
     global_ea->decrypt(c, k, vec);
-    return vectorTo32(vec);
+    SlotBuffer buf;
+    buf.assign(vec);
+    return laneWord(buf, 0);
 }
 
-vector<heblock> heEncrypt (const FHEPubKey& k, string s) {
-    vector<vector<long>> pt = strToVectors(s);
-    vector<Ctxt> cts;
+vector<uint32_t> heDecryptLanes (const FHESecKey& k, Ctxt &c) {
+    vector<long> vec;
+    global_ea->decrypt(c, k, vec);
+    SlotBuffer buf;
+    buf.assign(vec);
+    vector<uint32_t> ws (heLanes());
+    for (size_t i = 0; i < ws.size(); i++) ws[i] = laneWord(buf, i);
+    return ws;
+}
+
+vector<heblock> heEncrypt (const FHEPubKey& k, const vector<pt_block> &bs) {
     vector<heblock> blocks;
-    for (size_t i = 0; i < pt.size(); i++) {
-        pad(0, pt[i], global_nslots);
-        Ctxt c(k);
-        global_ea->encrypt(c, k, pt[i]);
-        cts.push_back(c);
-    }
-    for (size_t i = 0; i < cts.size()-1; i++) {
-        blocks.push_back({ cts[i], cts[i+1] });
+    size_t lanes = heLanes();
+    for (size_t i = 0; i < bs.size(); i += lanes) {
+        vector<uint32_t> xs, ys;
+        for (size_t j = i; j < bs.size() && j < i + lanes; j++) {
+            xs.push_back(bs[j].x);
+            ys.push_back(bs[j].y);
+        }
+        blocks.push_back({ Ctxt(k), Ctxt(k) });
+        global_ea->encrypt(blocks.back().x, k, laneSlots(xs).slots());
+        global_ea->encrypt(blocks.back().y, k, laneSlots(ys).slots());
     }
     return blocks;
 }
 
+vector<heblock> heEncrypt (const FHEPubKey& k, string s) {
+    return heEncrypt(k, strToBlocks(s));
+}
+
+vector<pt_block> heDecrypt (const FHESecKey& k, vector<heblock> &bs, size_t n) {
+    vector<pt_block> res;
+    for (size_t i = 0; i < bs.size() && res.size() < n; i++) {
+        vector<uint32_t> xs = heDecryptLanes(k, bs[i].x);
+        vector<uint32_t> ys = heDecryptLanes(k, bs[i].y);
+        for (size_t j = 0; j < xs.size() && res.size() < n; j++) {
+            res.push_back({ xs[j], ys[j] });
+        }
+    }
+    return res;
+}
+
 vector<Ctxt> heEncrypt (const FHEPubKey& pubkey, vector<uint32_t> k) {
-    vector<vector<long>> kbits = keyToVectors(k, global_nslots);
     vector<Ctxt> encryptedKey;
-    for (size_t i = 0; i < kbits.size(); i++) {
-        pad(0, kbits[i], global_nslots);
-        Ctxt kct(pubkey);
-        global_ea->encrypt(kct, pubkey, kbits[i]);
-        encryptedKey.push_back(kct);
+    encryptedKey.reserve(k.size());
+    for (size_t i = 0; i < k.size(); i++) {
+        encryptedKey.emplace_back(pubkey);
+        vector<uint32_t> ws (heLanes(), k[i]);
+        global_ea->encrypt(encryptedKey.back(), pubkey, laneSlots(ws).slots());
     }
     return encryptedKey;
 }
@@ -5,38 +5,90 @@
 //
 // An implementation of the SIMON block cipher in HElib. Each Ctxt gets packed
 // with 32 bits, representing half of a SIMON block.
+//
+// Each Ctxt has nslots/32 lanes, and lane j holds the half of block j, so
+// one Ctxt carries as many blocks as there are lanes. Round keys are
+// repeated in every lane.
+
+#include <atomic>
 
-#ifdef STUB
-#include "helib-stub.h"
-#else
-#include "FHE.h"
-#include "EncryptedArray.h"
-#endif
+#include "helib-instance.h"
 
+#include "ctxt-file.h"
+#include "metrics.h"
 #include "simon-pt.h"
 #include "simon-util.h"
+#include "thread-pool.h"
 
 extern EncryptedArray* global_ea;
-extern ZZX* global_maxint;
+extern ZZX* global_maxint;          // 0xFFFFFFFF in every lane
 extern size_t global_nslots;
 
+// Where the lanes are. LAYOUT_LANES: bit b of lane j in slot 32j+b, and a
+// word rotates within its lane with two shifts and two masks. LAYOUT_RING:
+// bit b of lane j in slot b*lanes+j. That needs nslots to be a multiple of
+// 32, but then rotating every word by n is one EncryptedArray::rotate of all
+// the slots by n*lanes. Only on a one-dimensional, native hypercube is that a
+// single automorphism; otherwise HElib masks and combines several of them.
+enum WordLayout { LAYOUT_LANES, LAYOUT_RING };
+extern WordLayout global_layout;
+
 struct heblock {
     Ctxt x;
     Ctxt y;
 };
 
+// number of 32-slot lanes, i.e. blocks per heblock
+size_t heLanes ();
+
+// LAYOUT_RING when HE_BLOCK_LAYOUT is "ring", else LAYOUT_LANES
+WordLayout layoutFromEnv ();
+
+// the slots with word i in lane i, zero past the last word
+SlotBuffer laneSlots (const vector<uint32_t> &ws);
+
 void negate32(Ctxt &x);
 
-void rotateLeft32(Ctxt &x, int n);
+// What word rotations cost, counted on the threads that run them and
+// reported to the metrics of the caller's scope.
+struct RotateTally {
+    atomic<size_t> shift, rotate, multByConstant;
+    RotateTally () : shift(0), rotate(0), multByConstant(0) {}
+    void report () const;
+};
+
+// Counts into tally, or straight into this thread's metrics without one.
+void rotateLeft32(Ctxt &x, int n, RotateTally *tally = NULL);
+
+// out[i] = x rotated left by ns[i], for k amounts. All of them rotate the
+// same ciphertext, which is where a hoisted rotation would decompose x for
+// key switching once; HElib only has whole automorphisms, so for now they
+// are k independent rotations on the shared pool.
+void rotateLeft32Each(const Ctxt &x, const int *ns, Ctxt **out, size_t k);
 
 void encRound(Ctxt &key, heblock& inp);
 
+// As in simon-simd: switches x, y and the round key down to the lowest level
+// x can be at before a round, and returns it.
+long scheduleLevels (heblock &inp, Ctxt &key);
+
 Ctxt heEncrypt(const FHEPubKey& k, uint32_t x);
 
 uint32_t heDecrypt (const FHESecKey& k, Ctxt &c);
 
+// every lane of c
+vector<uint32_t> heDecryptLanes (const FHESecKey& k, Ctxt &c);
+
+// heLanes() blocks per heblock; the lanes of the last one past the end of
+// bs are zero
+vector<heblock> heEncrypt (const FHEPubKey& k, const vector<pt_block> &bs);
+
 vector<heblock> heEncrypt (const FHEPubKey& k, string s);
 
+// the first n blocks held by bs
+vector<pt_block> heDecrypt (const FHESecKey& k, vector<heblock> &bs, size_t n);
+
+// each word of k repeated in every lane
 vector<Ctxt> heEncrypt (const FHEPubKey& pubkey, vector<uint32_t> k);
 
 vector<vector<long>> heDecrypt (const FHESecKey& k, vector<Ctxt> cts);
@@ -0,0 +1,183 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// The whole SIMON family, from 32/64 to 128/256, as one template over the
+// word type W, the word size N (bits of W actually used) and the number of
+// key words M. Round counts and the z sequence come from the specification
+// table. The key schedule and single-block encryption are constexpr, so a
+// constant key is expanded at compile time; the batch routines unroll every
+// round. SIMON 64/128 with the same key words gives the same results as the
+// pt_ functions in simon-pt.h.
+
+#ifndef SIMONFAMILY_H
+#define SIMONFAMILY_H
+
+#include "simon-pt.h"
+
+// rounds and z sequence for each (word size, key words) in the spec
+constexpr unsigned simon_rounds (unsigned n, unsigned m) {
+    return n == 16 ? 32
+         : n == 24 ? 36
+         : n == 32 ? (m == 3 ? 42 : 44)
+         : n == 48 ? (m == 2 ? 52 : 54)
+         : n == 64 ? (m == 2 ? 68 : m == 3 ? 69 : 72)
+         : 0;
+}
+
+constexpr unsigned simon_zseq (unsigned n, unsigned m) {
+    return n == 16 ? 0
+         : n == 24 ? (m == 3 ? 0 : 1)
+         : n == 32 ? (m == 3 ? 2 : 3)
+         : n == 48 ? (m == 2 ? 2 : 3)
+         : n == 64 ? (m == 2 ? 2 : m == 3 ? 3 : 4)
+         : 0;
+}
+
+// compile-time integer sequences, for building the schedule array
+template <unsigned... Is> struct simon_seq {};
+template <unsigned N, unsigned... Is> struct simon_genSeq : simon_genSeq<N-1, N-1, Is...> {};
+template <unsigned... Is> struct simon_genSeq<0, Is...> { typedef simon_seq<Is...> type; };
+
+template <typename C, unsigned I, unsigned R> struct simon_unroll;
+
+template <typename W, unsigned N, unsigned M>
+struct simon_cipher {
+    static_assert(simon_rounds(N, M) != 0, "not a SIMON parameter set");
+    static_assert(N <= 8 * sizeof(W), "word type too small");
+
+    typedef W word;
+    static constexpr unsigned n = N;
+    static constexpr unsigned m = M;
+    static constexpr unsigned T = simon_rounds(N, M);
+    static constexpr unsigned j = simon_zseq(N, M);
+    static constexpr W mask = N == 8 * sizeof(W) ? W(~W(0)) : W((W(1) << N) - 1);
+
+    struct block { W x; W y; };
+    struct key { W k[M]; };         // k[0] is the first round key
+    struct schedule { W k[T]; };
+
+    // 0 < r < N
+    static constexpr W rol (W v, unsigned r) { return W(((v << r) | (v >> (N - r))) & mask); }
+    static constexpr W ror (W v, unsigned r) { return rol(v, N - r); }
+    static constexpr W f (W x) { return W((rol(x,1) & rol(x,8)) ^ rol(x,2)); }
+
+    ////////////////////////////////////////////////////////////////////////
+    // key schedule
+
+    // the last M round keys, oldest first, and the index of the next one
+    struct window { W w0, w1, w2, w3; unsigned i; };
+
+    static constexpr W newest (const window &s) { return M == 2 ? s.w1 : M == 3 ? s.w2 : s.w3; }
+    static constexpr W mix (W t) { return W(t ^ ror(t, 1)); }
+    static constexpr W next (const window &s) {
+        return W((~s.w0 ^ mix(W(ror(newest(s), 3) ^ (M == 4 ? s.w1 : 0)))
+                  ^ W(z[j][(s.i - M) % 62]) ^ 3) & mask);
+    }
+    static constexpr window shift (const window &s) {
+        return window { s.w1,
+                        M == 2 ? next(s) : s.w2,
+                        M == 3 ? next(s) : M == 4 ? s.w3 : W(0),
+                        M == 4 ? next(s) : W(0),
+                        s.i + 1 };
+    }
+    static constexpr W keyWord (const key &k, unsigned i) { return i < M ? k.k[i] : W(0); }
+    static constexpr window start (const key &k) {
+        return window { keyWord(k,0), keyWord(k,1), keyWord(k,2), keyWord(k,3), M };
+    }
+    static constexpr W keyAt (const window &s, unsigned i) {
+        return s.i == i ? next(s) : keyAt(shift(s), i);
+    }
+    static constexpr W roundKey (const key &k, unsigned i) {
+        return i < M ? k.k[i] : keyAt(start(k), i);
+    }
+    template <unsigned... Is>
+    static constexpr schedule expandSeq (const key &k, simon_seq<Is...>) {
+        return schedule { { roundKey(k, Is)... } };
+    }
+    static constexpr schedule expand (const key &k) {
+        return expandSeq(k, typename simon_genSeq<T>::type());
+    }
+
+    ////////////////////////////////////////////////////////////////////////
+    // single blocks, constexpr
+
+    static constexpr block encFrom (const schedule &ks, block b, unsigned i, unsigned nrounds) {
+        return i == nrounds ? b
+             : encFrom(ks, block { W(b.y ^ f(b.x) ^ ks.k[i]), b.x }, i + 1, nrounds);
+    }
+    static constexpr block decFrom (const schedule &ks, block b, unsigned i) {
+        return i == 0 ? b : decFrom(ks, block { b.y, W(b.x ^ f(b.y) ^ ks.k[i-1]) }, i - 1);
+    }
+    static constexpr block encrypt (const schedule &ks, block b, unsigned nrounds = T) {
+        return encFrom(ks, b, 0, nrounds);
+    }
+    static constexpr block decrypt (const schedule &ks, block b, unsigned nrounds = T) {
+        return decFrom(ks, b, nrounds);
+    }
+
+    ////////////////////////////////////////////////////////////////////////
+    // batches, every round unrolled
+
+    static inline void round (W &x, W &y, W k) {
+        W tmp = x;
+        x = W(y ^ f(x) ^ k);
+        y = tmp;
+    }
+    static inline void unround (W &x, W &y, W k) {
+        W tmp = y;
+        y = W(x ^ f(y) ^ k);
+        x = tmp;
+    }
+    static void encrypt (const schedule &ks, block *bs, size_t nb) {
+        for (size_t i = 0; i < nb; i++) {
+            simon_unroll<simon_cipher, 0, T>::enc(bs[i].x, bs[i].y, ks.k);
+        }
+    }
+    static void decrypt (const schedule &ks, block *bs, size_t nb) {
+        for (size_t i = 0; i < nb; i++) {
+            simon_unroll<simon_cipher, 0, T>::dec(bs[i].x, bs[i].y, ks.k);
+        }
+    }
+};
+
+template <typename W, unsigned N, unsigned M> constexpr unsigned simon_cipher<W,N,M>::n;
+template <typename W, unsigned N, unsigned M> constexpr unsigned simon_cipher<W,N,M>::m;
+template <typename W, unsigned N, unsigned M> constexpr unsigned simon_cipher<W,N,M>::T;
+template <typename W, unsigned N, unsigned M> constexpr unsigned simon_cipher<W,N,M>::j;
+template <typename W, unsigned N, unsigned M> constexpr W simon_cipher<W,N,M>::mask;
+
+// rounds I .. I+R-1
+template <typename C, unsigned I, unsigned R>
+struct simon_unroll {
+    typedef typename C::word W;
+    static inline void enc (W &x, W &y, const W *k) {
+        C::round(x, y, k[I]);
+        simon_unroll<C, I+1, R-1>::enc(x, y, k);
+    }
+    static inline void dec (W &x, W &y, const W *k) {
+        C::unround(x, y, k[I+R-1]);
+        simon_unroll<C, I, R-1>::dec(x, y, k);
+    }
+};
+
+template <typename C, unsigned I>
+struct simon_unroll<C, I, 0> {
+    typedef typename C::word W;
+    static inline void enc (W&, W&, const W*) {}
+    static inline void dec (W&, W&, const W*) {}
+};
+
+typedef simon_cipher<uint16_t, 16, 4> simon32_64;
+typedef simon_cipher<uint32_t, 24, 3> simon48_72;
+typedef simon_cipher<uint32_t, 24, 4> simon48_96;
+typedef simon_cipher<uint32_t, 32, 3> simon64_96;
+typedef simon_cipher<uint32_t, 32, 4> simon64_128;
+typedef simon_cipher<uint64_t, 48, 2> simon96_96;
+typedef simon_cipher<uint64_t, 48, 3> simon96_144;
+typedef simon_cipher<uint64_t, 64, 2> simon128_128;
+typedef simon_cipher<uint64_t, 64, 3> simon128_192;
+typedef simon_cipher<uint64_t, 64, 4> simon128_256;
+
+#endif
@@ -0,0 +1,286 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Homomorphic SIMON 64/128 CTR keystream, computed ahead of time.
+
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+#include "simon-keystream.h"
+
+heblock ctrKeystream (EncryptedArray &ea, const FHEPubKey &pubkey, vector<CTvec> &key,
+                      uint64_t iv, uint64_t b) {
+    vector<simon64_128::block> ctrs (global_nslots);
+    for (size_t s = 0; s < ctrs.size(); s++) {
+        uint64_t v = iv + b * global_nslots + s;
+        ctrs[s] = { (uint32_t) (v >> 32), (uint32_t) v };
+    }
+    heblock ct = heEncrypt<simon64_128>(ea, pubkey, ctrs, false);
+    for (size_t i = 0; i < T; i++) {
+        MetricScope round ("round");
+        scheduleLevels(ct, key[i]);
+        encRound(key[i], ct);
+    }
+    return ct;
+}
+
+// Serial: it is the whole online path, and must not queue behind a batch
+// that holds the shared pool.
+void ctrAddBlocks (EncryptedArray &ea, heblock &ks, const vector<pt_block> &blocks, size_t slot) {
+    vector<uint64_t> xs (slot + blocks.size()), ys (slot + blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        xs[slot + i] = blocks[i].x;
+        ys[slot + i] = blocks[i].y;
+    }
+    vector<SlotBuffer> slices;
+    CTvec *halves[2] = { &ks.x, &ks.y };
+    vector<uint64_t> *words[2] = { &xs, &ys };
+    MixedTally tally;
+    for (size_t h = 0; h < 2; h++) {
+        wordsToSlices(*words[h], 32, global_nslots, slices);
+        for (size_t i = 0; i < slices.size(); i++) {
+            halves[h]->get(i).xorWith(MixedCtxt(ea, slices[i]), &tally);
+        }
+    }
+    tally.report();
+}
+
+KeystreamCache::KeystreamCache (EncryptedArray &ea, const FHEPubKey &pubkey,
+                                const vector<CTvec> &key, uint64_t iv, uint64_t first,
+                                size_t ahead, const string &dir, const CtxtFileParams &params)
+    : ea(ea), pubkey(pubkey), key(key), keyPrint(0), iv(iv), ahead(ahead), dir(dir),
+      params(params), tick(1), residentBatch(0), st({ 0, 0, 0, 0, 0 }), stopping(false)
+{
+    vector<Ctxt> cs;
+    for (size_t i = 0; i < key.size(); i++) {
+        vector<Ctxt> row = key[i].ctxts();
+        cs.insert(cs.end(), row.begin(), row.end());
+    }
+    keyPrint = ctxt_fingerprint(cs);
+    heads[first] = tick;
+    worker = thread(&KeystreamCache::precompute, this);
+}
+
+KeystreamCache::~KeystreamCache () {
+    {
+        lock_guard<mutex> lk (mtx);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+string KeystreamCache::file (uint64_t b) const {
+    char name[64];
+    snprintf(name, sizeof name, "/keystream-%016llx-%llu.ctxt", (unsigned long long) iv,
+             (unsigned long long) b);
+    return dir + name;
+}
+
+string KeystreamCache::label (uint64_t b) const {
+    char label[128];
+    snprintf(label, sizeof label,
+             "SIMON 64/128 CTR keystream, schedule %016llx, iv %016llx, batch %llu",
+             (unsigned long long) keyPrint, (unsigned long long) iv, (unsigned long long) b);
+    return label;
+}
+
+// The header checks the context, public key, schedule, iv and batch.
+shared_ptr<const heblock> KeystreamCache::load (uint64_t b) {
+    vector<vector<Ctxt>> rows;
+    string err;
+    if (!ctxt_readFile(file(b), params, pubkey, label(b), rows, err)) return NULL;
+    if (rows.size() != 2) return NULL;
+    return shared_ptr<const heblock> (new heblock {
+        CTvec(ea, pubkey, move(rows[0]), global_nslots),
+        CTvec(ea, pubkey, move(rows[1]), global_nslots)
+    });
+}
+
+// Loads batch b from dir, or computes it and writes it there.
+shared_ptr<const heblock> KeystreamCache::make (uint64_t b, bool &loaded) {
+    loaded = false;
+    if (!dir.empty()) {
+        shared_ptr<const heblock> ct = load(b);
+        if (ct) {
+            loaded = true;
+            return ct;
+        }
+    }
+    shared_ptr<heblock> ct;
+    {
+        lock_guard<mutex> lk (computeMtx);
+        MetricScope scope ("keystream batch");
+        ct.reset(new heblock(ctrKeystream(ea, pubkey, key, iv, b)));
+    }
+    if (!dir.empty()) {
+        vector<vector<Ctxt>> rows = { ct->x.ctxts(), ct->y.ctxts() };
+        if (!ctxt_writeFile(file(b), params, pubkey, label(b), rows)) {
+            cerr << "cannot write " << file(b) << endl;
+        }
+    }
+    return ct;
+}
+
+// A request is on batch b: b becomes the head of its stream, replacing a
+// head just below it, and only the most recent heads are kept.
+void KeystreamCache::touch (uint64_t b) {
+    auto it = heads.lower_bound(b > ahead ? b - ahead : 0);
+    while (it != heads.end() && it->first < b) it = heads.erase(it);
+    heads[b] = ++tick;
+    while (heads.size() > streams) {
+        auto old = heads.begin();
+        for (auto it = heads.begin(); it != heads.end(); ++it)
+            if (it->second < old->second) old = it;
+        heads.erase(old);
+    }
+    for (auto u = usedUp.begin(); u != usedUp.end();) u = wanted(*u) ? ++u : usedUp.erase(u);
+    changed.notify_all();
+}
+
+// whether b is one of the ahead batches from a head
+bool KeystreamCache::wanted (uint64_t b) const {
+    auto it = heads.upper_bound(b);
+    return it != heads.begin() && b - (--it)->first < ahead;
+}
+
+// the first batch a head needs that is neither held nor used up, the most
+// recent head first
+bool KeystreamCache::nextWanted (uint64_t &b) const {
+    vector<pair<uint64_t, uint64_t>> byTick;
+    for (auto &h : heads) byTick.push_back({ h.second, h.first });
+    sort(byTick.rbegin(), byTick.rend());
+    for (auto &h : byTick) {
+        for (b = h.second; b < h.second + ahead; b++) {
+            if (!entries.count(b) && !usedUp.count(b)) return true;
+        }
+    }
+    return false;
+}
+
+// Drops the least recently used ready batch that no head wants, if the
+// store is full. False when it is full of wanted ones.
+bool KeystreamCache::makeRoom () {
+    if (entries.size() < streams * ahead) return true;
+    auto victim = entries.end();
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (!it->second.ready || wanted(it->first)) continue;
+        if (victim == entries.end() || it->second.lastUse < victim->second.lastUse) victim = it;
+    }
+    if (victim == entries.end()) return false;
+    retire(victim->first);
+    return true;
+}
+
+// Stores a batch that was being made; false when it was retired meanwhile.
+bool KeystreamCache::finish (uint64_t b, const shared_ptr<const heblock> &ct, bool loaded) {
+    if (loaded) st.loaded++;
+    else st.computed++;
+    changed.notify_all();
+    auto it = entries.find(b);
+    if (it == entries.end()) {
+        if (!dir.empty()) unlink(file(b).c_str());
+        return false;
+    }
+    it->second.ready = true;
+    // with a directory it waits there, and get() loads it
+    it->second.mem   = dir.empty() ? ct : NULL;
+    return true;
+}
+
+void KeystreamCache::precompute () {
+    unique_lock<mutex> lk (mtx);
+    while (!stopping) {
+        uint64_t b;
+        if (!nextWanted(b) || !makeRoom()) {
+            changed.wait(lk);
+            continue;
+        }
+        entries[b] = { false, NULL, 0, 0 };
+        lk.unlock();
+        bool loaded;
+        shared_ptr<const heblock> ct = make(b, loaded);
+        lk.lock();
+        finish(b, ct, loaded);
+    }
+}
+
+shared_ptr<const heblock> KeystreamCache::get (uint64_t b) {
+    unique_lock<mutex> lk (mtx);
+    touch(b);
+    auto it = entries.find(b);
+    if (it == entries.end()) {
+        // not started: compute it here, and keep it if there is room
+        st.misses++;
+        bool keep = makeRoom();
+        if (keep) entries[b] = { false, NULL, 0, tick };
+        lk.unlock();
+        bool loaded;
+        shared_ptr<const heblock> ct = make(b, loaded);
+        lk.lock();
+        if (keep && finish(b, ct, loaded) && !dir.empty()) {
+            resident      = ct;
+            residentBatch = b;
+        } else if (!keep) {
+            if (loaded) st.loaded++;
+            else st.computed++;
+            if (!dir.empty()) unlink(file(b).c_str());
+        }
+        return ct;
+    }
+    it->second.lastUse = tick;
+    if (it->second.ready) st.hits++;
+    else st.waits++;
+    changed.wait(lk, [&] { return entries.count(b) == 0 || entries[b].ready; });
+    it = entries.find(b);
+    if (it == entries.end()) {
+        lk.unlock();                            // retired while we waited
+        return get(b);
+    }
+    if (it->second.mem) return it->second.mem;
+    if (resident && residentBatch == b) return resident;
+    lk.unlock();
+    shared_ptr<const heblock> ct = load(b);
+    lk.lock();
+    if (!ct) {
+        entries.erase(b);                       // bad file: compute it again
+        lk.unlock();
+        return get(b);
+    }
+    resident      = ct;
+    residentBatch = b;
+    return ct;
+}
+
+void KeystreamCache::retire (uint64_t b) {
+    auto it = entries.find(b);
+    if (it == entries.end()) return;
+    // one still being made is unlinked when it is done
+    if (it->second.ready && !dir.empty()) unlink(file(b).c_str());
+    entries.erase(it);
+    if (resident && residentBatch == b) resident.reset();
+}
+
+// A used-up batch is not made again while a head is below it, and its
+// stream moves on to the next one.
+void KeystreamCache::used (uint64_t b, size_t n) {
+    lock_guard<mutex> lk (mtx);
+    auto it = entries.find(b);
+    if (it == entries.end() || (it->second.used += n) < global_nslots) return;
+    retire(b);
+    usedUp.insert(b);
+    auto h = heads.find(b);
+    if (h != heads.end()) {
+        uint64_t t = h->second;
+        heads.erase(h);
+        if (!heads.count(b + 1)) heads[b + 1] = t;
+    }
+    changed.notify_all();
+}
+
+KeystreamCache::Stats KeystreamCache::stats () {
+    lock_guard<mutex> lk (mtx);
+    return st;
+}
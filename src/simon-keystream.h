@@ -0,0 +1,120 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Homomorphic SIMON 64/128 CTR keystream, computed ahead of time.
+//
+// In CTR mode the 44 homomorphic rounds only see public counters and the
+// encrypted key, never the data, so they can run before any data arrives.
+// Keystream batch b holds E(iv + b*nslots + s) in slot s, the same counter
+// blocks as simon-stream's CTR mode. Given a batch, turning CTR ciphertext
+// into HElib ciphertext of the plaintext is one addConstant per bit.
+
+#ifndef SIMONKEYSTREAM_H
+#define SIMONKEYSTREAM_H
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "simon-simd.h"
+
+// Batch b of the keystream for iv, with the rounds of simon-simd. key is
+// switched down to the levels the rounds need, as by scheduleLevels. The
+// counters are public, so the first round folds and the batch comes out
+// one multiplication shallower than the blocks of ECB requests.
+heblock ctrKeystream (EncryptedArray &ea, const FHEPubKey &pubkey, vector<CTvec> &key,
+                      uint64_t iv, uint64_t b);
+
+// In place: the bits of blocks[i] are added to slot slot+i of ks, so a
+// keystream batch becomes the encryption of the CTR plaintext.
+void ctrAddBlocks (EncryptedArray &ea, heblock &ks, const vector<pt_block> &blocks, size_t slot);
+
+// A bounded store of keystream batches. Requests are taken to come from
+// streams that move up through the counters, so the batch of each request
+// becomes the head of a stream, and a background thread keeps the ahead
+// batches from each of the last few heads ready. A request for those only
+// waits for the final additions. Batches are kept in memory, or with a
+// directory as ctxt files there, which survive restarts; the directory is
+// for one key and iv. A batch is dropped once all of its slots have been
+// used, and when the store is full, the least recently used batch that no
+// head is about to need makes room.
+class KeystreamCache {
+public:
+    // Precomputing starts at batch first. key is copied, since computing a
+    // batch switches its levels. Batches in dir are labelled with a
+    // fingerprint of key, so only those made under the same encrypted
+    // schedule load.
+    KeystreamCache (EncryptedArray &ea, const FHEPubKey &pubkey, const vector<CTvec> &key,
+                    uint64_t iv, uint64_t first, size_t ahead, const string &dir,
+                    const CtxtFileParams &params);
+    ~KeystreamCache ();
+    KeystreamCache (const KeystreamCache&) = delete;
+    KeystreamCache& operator= (const KeystreamCache&) = delete;
+
+    // Batch b, computed here if nobody has started on it.
+    shared_ptr<const heblock> get (uint64_t b);
+
+    // n more slots of batch b have been used
+    void used (uint64_t b, size_t n);
+
+    struct Stats {
+        size_t hits;            // ready when asked for
+        size_t waits;           // being computed when asked for
+        size_t misses;          // computed on demand
+        size_t computed, loaded;
+    };
+    Stats stats ();
+
+private:
+    struct Entry {
+        bool ready;
+        shared_ptr<const heblock> mem;  // empty when it is only on disk
+        size_t used;
+        uint64_t lastUse;               // tick of the last get
+    };
+
+    // the heads followed at once; the store holds streams * ahead batches
+    static const size_t streams = 4;
+
+    void precompute ();
+    void touch (uint64_t b);
+    bool wanted (uint64_t b) const;
+    bool nextWanted (uint64_t &b) const;
+    bool makeRoom ();
+    bool finish (uint64_t b, const shared_ptr<const heblock> &ct, bool loaded);
+    void retire (uint64_t b);
+    shared_ptr<const heblock> make (uint64_t b, bool &loaded);
+    shared_ptr<const heblock> load (uint64_t b);
+    string file (uint64_t b) const;
+
+    string label (uint64_t b) const;
+
+    EncryptedArray &ea;
+    const FHEPubKey &pubkey;
+    vector<CTvec> key;
+    uint64_t keyPrint;                  // ctxt_fingerprint of the schedule
+    uint64_t iv;
+    size_t ahead;
+    string dir;
+    CtxtFileParams params;
+
+    mutex computeMtx;                   // one batch at a time uses key
+    mutex mtx;
+    condition_variable changed;
+    map<uint64_t, Entry> entries;       // being computed or ready
+    map<uint64_t, uint64_t> heads;      // batch -> tick it became a head
+    set<uint64_t> usedUp;               // that a head still wants
+    uint64_t tick;
+    shared_ptr<const heblock> resident; // the last batch loaded from dir
+    uint64_t residentBatch;
+    Stats st;
+    bool stopping;
+    thread worker;
+};
+
+#endif
@@ -0,0 +1,326 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Batch versions of the plaintext SIMON block cipher. Several kernels are
+// compiled in and one is picked at runtime: a scalar reference, a portable
+// bitsliced kernel running 64 blocks per stream, and SSE2/AVX2 kernels
+// running 16/32 blocks per stream with one 32-bit lane per block.
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include "simon-pt.h"
+#include "simon-util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PT_X86 1
+#include <immintrin.h>
+#endif
+
+pt_schedule::pt_schedule (const vector<pt_key32> &key, size_t n) : nrounds(n)
+{
+    assert(n <= T);
+    vector<pt_key32> tmp (key);
+    pt_expandKey(tmp, n);
+    for (size_t i = 0; i < n; i++) {
+        k[i] = tmp[i];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// scalar
+
+// pt_rotateLeft lives in another translation unit; keep this one inlinable
+static inline uint32_t rol (uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void scalarEnc (const pt_schedule &ks, pt_block *bs, size_t n) {
+    for (size_t b = 0; b < n; b++) {
+        uint32_t x = bs[b].x;
+        uint32_t y = bs[b].y;
+        for (size_t i = 0; i < ks.nrounds; i++) {
+            uint32_t tmp = x;
+            x = y ^ (rol(x,1) & rol(x,8)) ^ rol(x,2) ^ ks.k[i];
+            y = tmp;
+        }
+        bs[b] = { x, y };
+    }
+}
+
+static void scalarDec (const pt_schedule &ks, pt_block *bs, size_t n) {
+    for (size_t b = 0; b < n; b++) {
+        uint32_t x = bs[b].x;
+        uint32_t y = bs[b].y;
+        for (size_t i = ks.nrounds; i-- > 0;) {
+            uint32_t tmp = y;
+            y = x ^ (rol(y,1) & rol(y,8)) ^ rol(y,2) ^ ks.k[i];
+            x = tmp;
+        }
+        bs[b] = { x, y };
+    }
+}
+
+static bool always () { return true; }
+
+////////////////////////////////////////////////////////////////////////////////
+// bitsliced: 64 blocks, one uint64_t per bit position. Rotations become
+// index arithmetic, so a round is 32 ANDs and 96 XORs for all 64 blocks.
+
+// a[0..31] holds the y bits and a[32..63] the x bits of 64 blocks
+static void bitsliceLoad (const pt_block *bs, uint64_t a[64]) {
+    for (int b = 0; b < 64; b++) {
+        a[b] = (uint64_t) bs[b].x << 32 | bs[b].y;
+    }
+    transpose64(a);
+}
+
+static void bitsliceStore (uint64_t a[64], pt_block *bs) {
+    transpose64(a);
+    for (int b = 0; b < 64; b++) {
+        bs[b] = { (uint32_t) (a[b] >> 32), (uint32_t) a[b] };
+    }
+}
+
+// lhs ^= f(rhs) ^ k, where f(v) = (v <<< 1 & v <<< 8) ^ v <<< 2
+static inline void bitsliceRound (uint64_t *lhs, const uint64_t *rhs, uint32_t k) {
+    for (int i = 0; i < 32; i++) {
+        uint64_t kbit = -(uint64_t) ((k >> i) & 1);
+        lhs[i] ^= (rhs[(i+31)&31] & rhs[(i+24)&31]) ^ rhs[(i+30)&31] ^ kbit;
+    }
+}
+
+static void bitsliceEnc (const pt_schedule &ks, pt_block *bs, size_t n) {
+    uint64_t a[64];
+    size_t b = 0;
+    for (; b + 64 <= n; b += 64) {
+        bitsliceLoad(&bs[b], a);
+        uint64_t *x = a + 32, *y = a;
+        for (size_t i = 0; i < ks.nrounds; i++) {
+            bitsliceRound(y, x, ks.k[i]);
+            swap(x, y);
+        }
+        if (x != a + 32) {
+            uint64_t tmp[32];
+            memcpy(tmp, a, sizeof tmp);
+            memcpy(a, a + 32, sizeof tmp);
+            memcpy(a + 32, tmp, sizeof tmp);
+        }
+        bitsliceStore(a, &bs[b]);
+    }
+    scalarEnc(ks, &bs[b], n - b);
+}
+
+static void bitsliceDec (const pt_schedule &ks, pt_block *bs, size_t n) {
+    uint64_t a[64];
+    size_t b = 0;
+    for (; b + 64 <= n; b += 64) {
+        bitsliceLoad(&bs[b], a);
+        uint64_t *x = a + 32, *y = a;
+        for (size_t i = ks.nrounds; i-- > 0;) {
+            bitsliceRound(x, y, ks.k[i]);
+            swap(x, y);
+        }
+        if (x != a + 32) {
+            uint64_t tmp[32];
+            memcpy(tmp, a, sizeof tmp);
+            memcpy(a, a + 32, sizeof tmp);
+            memcpy(a + 32, tmp, sizeof tmp);
+        }
+        bitsliceStore(a, &bs[b]);
+    }
+    scalarDec(ks, &bs[b], n - b);
+}
+
+#ifdef PT_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE2: 4 blocks per register, 4 registers per stream
+
+#define SSE_ROL(v,n) _mm_or_si128(_mm_slli_epi32(v,n), _mm_srli_epi32(v,32-n))
+#define SSE_F(v) _mm_xor_si128(_mm_and_si128(SSE_ROL(v,1), SSE_ROL(v,8)), SSE_ROL(v,2))
+
+// split 4 interleaved blocks into an x register and a y register
+static inline void sseLoad (const pt_block *bs, __m128i &x, __m128i &y) {
+    __m128 lo = _mm_loadu_ps((const float*) &bs[0]);
+    __m128 hi = _mm_loadu_ps((const float*) &bs[2]);
+    x = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2,0,2,0)));
+    y = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3,1,3,1)));
+}
+
+static inline void sseStore (pt_block *bs, __m128i x, __m128i y) {
+    __m128 xs = _mm_castsi128_ps(x);
+    __m128 ys = _mm_castsi128_ps(y);
+    _mm_storeu_ps((float*) &bs[0], _mm_unpacklo_ps(xs, ys));
+    _mm_storeu_ps((float*) &bs[2], _mm_unpackhi_ps(xs, ys));
+}
+
+__attribute__((target("sse2")))
+static void sse2Enc (const pt_schedule &ks, pt_block *bs, size_t n) {
+    size_t b = 0;
+    for (; b + 16 <= n; b += 16) {
+        __m128i x[4], y[4];
+        for (int r = 0; r < 4; r++) sseLoad(&bs[b+4*r], x[r], y[r]);
+        for (size_t i = 0; i < ks.nrounds; i++) {
+            __m128i k = _mm_set1_epi32(ks.k[i]);
+            for (int r = 0; r < 4; r++) {
+                __m128i tmp = x[r];
+                x[r] = _mm_xor_si128(_mm_xor_si128(y[r], SSE_F(x[r])), k);
+                y[r] = tmp;
+            }
+        }
+        for (int r = 0; r < 4; r++) sseStore(&bs[b+4*r], x[r], y[r]);
+    }
+    scalarEnc(ks, &bs[b], n - b);
+}
+
+__attribute__((target("sse2")))
+static void sse2Dec (const pt_schedule &ks, pt_block *bs, size_t n) {
+    size_t b = 0;
+    for (; b + 16 <= n; b += 16) {
+        __m128i x[4], y[4];
+        for (int r = 0; r < 4; r++) sseLoad(&bs[b+4*r], x[r], y[r]);
+        for (size_t i = ks.nrounds; i-- > 0;) {
+            __m128i k = _mm_set1_epi32(ks.k[i]);
+            for (int r = 0; r < 4; r++) {
+                __m128i tmp = y[r];
+                y[r] = _mm_xor_si128(_mm_xor_si128(x[r], SSE_F(y[r])), k);
+                x[r] = tmp;
+            }
+        }
+        for (int r = 0; r < 4; r++) sseStore(&bs[b+4*r], x[r], y[r]);
+    }
+    scalarDec(ks, &bs[b], n - b);
+}
+
+static bool haveSSE2 () { return __builtin_cpu_supports("sse2"); }
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2: 8 blocks per register, 8 registers per stream. The rotation by 8
+// is a byte shuffle.
+
+#define AVX_ROL(v,n) _mm256_or_si256(_mm256_slli_epi32(v,n), _mm256_srli_epi32(v,32-n))
+
+__attribute__((target("avx2")))
+static inline __m256i avxF (__m256i v, __m256i rol8) {
+    // v << 1 as v + v keeps one of the three shifts off the shift ports
+    __m256i r1 = _mm256_or_si256(_mm256_add_epi32(v, v), _mm256_srli_epi32(v, 31));
+    __m256i r8 = _mm256_shuffle_epi8(v, rol8);
+    return _mm256_xor_si256(_mm256_and_si256(r1, r8), AVX_ROL(v,2));
+}
+
+// The shuffles work within 128-bit lanes, so the blocks end up in the order
+// 0 1 4 5 2 3 6 7. avxStore undoes that exactly.
+__attribute__((target("avx2")))
+static inline void avxLoad (const pt_block *bs, __m256i &x, __m256i &y) {
+    __m256 lo = _mm256_loadu_ps((const float*) &bs[0]);
+    __m256 hi = _mm256_loadu_ps((const float*) &bs[4]);
+    x = _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2,0,2,0)));
+    y = _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3,1,3,1)));
+}
+
+__attribute__((target("avx2")))
+static inline void avxStore (pt_block *bs, __m256i x, __m256i y) {
+    __m256 xs = _mm256_castsi256_ps(x);
+    __m256 ys = _mm256_castsi256_ps(y);
+    _mm256_storeu_ps((float*) &bs[0], _mm256_unpacklo_ps(xs, ys));
+    _mm256_storeu_ps((float*) &bs[4], _mm256_unpackhi_ps(xs, ys));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avxRol8Mask () {
+    return _mm256_setr_epi8(3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14,
+                            3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14);
+}
+
+__attribute__((target("avx2")))
+static void avx2Enc (const pt_schedule &ks, pt_block *bs, size_t n) {
+    __m256i rol8 = avxRol8Mask();
+    size_t b = 0;
+    for (; b + 64 <= n; b += 64) {
+        __m256i x[8], y[8];
+        for (int r = 0; r < 8; r++) avxLoad(&bs[b+8*r], x[r], y[r]);
+        for (size_t i = 0; i < ks.nrounds; i++) {
+            __m256i k = _mm256_set1_epi32(ks.k[i]);
+            for (int r = 0; r < 8; r++) {
+                __m256i tmp = x[r];
+                x[r] = _mm256_xor_si256(_mm256_xor_si256(y[r], avxF(x[r], rol8)), k);
+                y[r] = tmp;
+            }
+        }
+        for (int r = 0; r < 8; r++) avxStore(&bs[b+8*r], x[r], y[r]);
+    }
+    sse2Enc(ks, &bs[b], n - b);
+}
+
+__attribute__((target("avx2")))
+static void avx2Dec (const pt_schedule &ks, pt_block *bs, size_t n) {
+    __m256i rol8 = avxRol8Mask();
+    size_t b = 0;
+    for (; b + 64 <= n; b += 64) {
+        __m256i x[8], y[8];
+        for (int r = 0; r < 8; r++) avxLoad(&bs[b+8*r], x[r], y[r]);
+        for (size_t i = ks.nrounds; i-- > 0;) {
+            __m256i k = _mm256_set1_epi32(ks.k[i]);
+            for (int r = 0; r < 8; r++) {
+                __m256i tmp = y[r];
+                y[r] = _mm256_xor_si256(_mm256_xor_si256(x[r], avxF(y[r], rol8)), k);
+                x[r] = tmp;
+            }
+        }
+        for (int r = 0; r < 8; r++) avxStore(&bs[b+8*r], x[r], y[r]);
+    }
+    sse2Dec(ks, &bs[b], n - b);
+}
+
+static bool haveAVX2 () { return __builtin_cpu_supports("avx2"); }
+
+#endif // PT_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// dispatch
+
+const vector<pt_batchKernel>& pt_batchKernels () {
+    static const vector<pt_batchKernel> kernels ({
+        { "scalar",    1, always,   scalarEnc,   scalarDec   },
+        { "bitslice", 64, always,   bitsliceEnc, bitsliceDec },
+#ifdef PT_X86
+        { "sse2",     16, haveSSE2, sse2Enc,     sse2Dec     },
+        { "avx2",     64, haveAVX2, avx2Enc,     avx2Dec     },
+#endif
+    });
+    return kernels;
+}
+
+static const pt_batchKernel& chooseKernel () {
+    const vector<pt_batchKernel> &ks = pt_batchKernels();
+    const char *want = getenv("SIMON_PT_KERNEL");
+    if (want) {
+        for (size_t i = 0; i < ks.size(); i++) {
+            if (!strcmp(ks[i].name, want) && ks[i].supported()) return ks[i];
+        }
+        cerr << "SIMON_PT_KERNEL=" << want << " unavailable, ignoring" << endl;
+    }
+    // the SIMD kernels beat the bitsliced one here since they need no
+    // transpose; prefer them when the CPU has them
+#ifdef PT_X86
+    if (haveAVX2()) return ks[3];
+    if (haveSSE2()) return ks[2];
+#endif
+    return ks[1];
+}
+
+const pt_batchKernel& pt_selectKernel () {
+    static const pt_batchKernel &k = chooseKernel();
+    return k;
+}
+
+void pt_encBlocks (const pt_schedule &ks, pt_block *bs, size_t n) {
+    pt_selectKernel().enc(ks, bs, n);
+}
+
+void pt_decBlocks (const pt_schedule &ks, pt_block *bs, size_t n) {
+    pt_selectKernel().dec(ks, bs, n);
+}
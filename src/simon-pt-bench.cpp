@@ -0,0 +1,229 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Benchmarks for the plaintext SIMON cipher: key expansion, single blocks,
+// batches through every kernel, and CTR mode across threads. Each workload
+// is warmed up, then timed sample by sample, and reported as blocks/sec,
+// cycles/byte and p50/p99 latency. --json writes the same numbers in a
+// machine-readable form for comparing runs across releases.
+//
+//   simon-pt-bench [--samples N] [--warmup N] [--threads N] [--json FILE|-]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "simon-pt.h"
+#include "thread-pool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t cycles () { return __rdtsc(); }
+#else
+static inline uint64_t cycles () { return 0; }
+#endif
+
+struct BenchResult {
+    string name;
+    string kernel;
+    size_t threads;
+    size_t blocks;          // blocks per sample
+    size_t samples;
+    double mean_ns;
+    double stddev_ns;
+    double p50_ns;
+    double p99_ns;
+    double min_ns;
+    double blocks_per_sec;
+    double cycles_per_byte;
+    double cycles_per_op;
+};
+
+struct BenchConfig {
+    size_t samples;
+    size_t warmup;
+    size_t threads;
+};
+
+static double percentile (vector<double> &xs, double p) {
+    sort(xs.begin(), xs.end());
+    size_t i = (size_t) ceil(p / 100 * xs.size());
+    return xs[min(xs.size() - 1, i ? i - 1 : 0)];
+}
+
+// Times f() cfg.samples times after cfg.warmup untimed calls. f processes
+// `blocks` blocks per call; blocks = 0 means it is not a block workload.
+template <typename F>
+BenchResult bench (const BenchConfig &cfg, string name, string kernel, size_t threads,
+                   size_t blocks, F f)
+{
+    for (size_t i = 0; i < cfg.warmup; i++) f();
+    vector<double> ns (cfg.samples);
+    uint64_t totalCycles = 0;
+    for (size_t i = 0; i < cfg.samples; i++) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        uint64_t c0 = cycles();
+        f();
+        totalCycles += cycles() - c0;
+        ns[i] = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+    }
+    double sum = 0, sq = 0;
+    for (size_t i = 0; i < ns.size(); i++) sum += ns[i];
+    double mean = sum / ns.size();
+    for (size_t i = 0; i < ns.size(); i++) sq += (ns[i] - mean) * (ns[i] - mean);
+
+    BenchResult r;
+    r.name      = name;
+    r.kernel    = kernel;
+    r.threads   = threads;
+    r.blocks    = blocks;
+    r.samples   = cfg.samples;
+    r.mean_ns   = mean;
+    r.stddev_ns = ns.size() > 1 ? sqrt(sq / (ns.size() - 1)) : 0;
+    r.min_ns    = *min_element(ns.begin(), ns.end());
+    r.p50_ns    = percentile(ns, 50);
+    r.p99_ns    = percentile(ns, 99);
+    r.cycles_per_op   = totalCycles / (double) cfg.samples;
+    r.blocks_per_sec  = blocks ? blocks / (mean * 1e-9) : 0;
+    r.cycles_per_byte = blocks ? r.cycles_per_op / (8.0 * blocks) : 0;
+    return r;
+}
+
+// the table goes to stderr when the JSON goes to stdout
+static FILE *table = stdout;
+
+// keeps results the optimizer would otherwise throw away
+static volatile uint32_t sink;
+
+static void printHeader () {
+    fprintf(table, "%-16s %-8s %4s %7s %14s %9s %12s %12s %9s\n", "workload", "kernel", "thr",
+           "blocks", "blocks/s", "cyc/byte", "p50 ns", "p99 ns", "stddev%");
+}
+
+static void printResult (const BenchResult &r) {
+    fprintf(table, "%-16s %-8s %4zu %7zu %14.0f %9.2f %12.0f %12.0f %8.1f%%\n", r.name.c_str(),
+           r.kernel.c_str(), r.threads, r.blocks, r.blocks_per_sec, r.cycles_per_byte,
+           r.p50_ns, r.p99_ns, 100 * r.stddev_ns / r.mean_ns);
+}
+
+static string toJSON (const BenchConfig &cfg, const vector<BenchResult> &rs) {
+    ostringstream os;
+    os << "{\n  \"benchmark\": \"simon-pt\",\n"
+       << "  \"rounds\": " << T << ",\n"
+       << "  \"selected_kernel\": \"" << pt_selectKernel().name << "\",\n"
+       << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n"
+       << "  \"samples\": " << cfg.samples << ",\n"
+       << "  \"warmup\": " << cfg.warmup << ",\n"
+       << "  \"results\": [\n";
+    for (size_t i = 0; i < rs.size(); i++) {
+        const BenchResult &r = rs[i];
+        os << "    { \"workload\": \"" << r.name << "\", \"kernel\": \"" << r.kernel << "\""
+           << ", \"threads\": " << r.threads
+           << ", \"blocks\": " << r.blocks
+           << ", \"samples\": " << r.samples
+           << ", \"mean_ns\": " << r.mean_ns
+           << ", \"stddev_ns\": " << r.stddev_ns
+           << ", \"min_ns\": " << r.min_ns
+           << ", \"p50_ns\": " << r.p50_ns
+           << ", \"p99_ns\": " << r.p99_ns
+           << ", \"blocks_per_sec\": " << r.blocks_per_sec
+           << ", \"cycles_per_byte\": " << r.cycles_per_byte
+           << ", \"cycles_per_op\": " << r.cycles_per_op << " }"
+           << (i + 1 < rs.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+    return os.str();
+}
+
+static void usage () {
+    cerr << "usage: simon-pt-bench [--samples N] [--warmup N] [--threads N] [--json FILE|-]" << endl;
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig cfg = { 200, 20, thread::hardware_concurrency() };
+    const char *json = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) usage();
+        if      (!strcmp(argv[i], "--samples")) cfg.samples = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--warmup"))  cfg.warmup  = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--threads")) cfg.threads = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--json"))    json = argv[++i];
+        else usage();
+    }
+    if (cfg.samples == 0) usage();
+    if (cfg.threads == 0) cfg.threads = 1;
+
+    vector<pt_key32> key ({0x1b1a1918, 0x13121110, 0x0b0a0908, 0x03020100});
+    pt_schedule ks (key);
+    vector<pt_key32> expanded (ks.k, ks.k + T);
+    vector<BenchResult> rs;
+    if (json && !strcmp(json, "-")) table = stderr;
+    printHeader();
+
+    // key expansion
+    rs.push_back(bench(cfg, "keyexp", "-", 1, 0, [&]{
+        pt_schedule tmp (key);
+        sink = tmp.k[T-1];
+    }));
+    printResult(rs.back());
+
+    // one block at a time through pt_encBlock
+    const size_t nsingle = 1024;
+    vector<pt_block> single (nsingle);
+    rs.push_back(bench(cfg, "single", "encBlock", 1, nsingle, [&]{
+        for (size_t i = 0; i < nsingle; i++) single[i] = pt_encBlock(expanded, single[i]);
+    }));
+    printResult(rs.back());
+
+    // batches through every kernel
+    const size_t sizes[] = { 64, 1024, 16384 };
+    const vector<pt_batchKernel> &kernels = pt_batchKernels();
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        vector<pt_block> bs (sizes[s]);
+        for (size_t i = 0; i < bs.size(); i++) bs[i] = { (uint32_t) rand(), (uint32_t) rand() };
+        for (size_t k = 0; k < kernels.size(); k++) {
+            if (!kernels[k].supported()) continue;
+            pt_kernel enc = kernels[k].enc;
+            rs.push_back(bench(cfg, "batch-enc", kernels[k].name, 1, bs.size(), [&]{
+                enc(ks, bs.data(), bs.size());
+            }));
+            printResult(rs.back());
+        }
+        pt_kernel dec = pt_selectKernel().dec;
+        rs.push_back(bench(cfg, "batch-dec", pt_selectKernel().name, 1, bs.size(), [&]{
+            dec(ks, bs.data(), bs.size());
+        }));
+        printResult(rs.back());
+    }
+
+    // CTR over 1 MiB at 1, 2, 4, ... threads
+    vector<unsigned char> buf (1 << 20);
+    for (size_t nthreads = 1;; nthreads = min(2 * nthreads, cfg.threads)) {
+        ThreadPool pool (nthreads);
+        rs.push_back(bench(cfg, "ctr", pt_selectKernel().name, nthreads, buf.size() / 8, [&]{
+            pt_ctrCryptParallel(pool, ks, 0x0123456789abcdefULL, 0, buf.data(), buf.data(), buf.size());
+        }));
+        printResult(rs.back());
+        if (nthreads == cfg.threads) break;
+    }
+
+    if (json) {
+        string out = toJSON(cfg, rs);
+        if (!strcmp(json, "-")) {
+            cout << out;
+        } else {
+            ofstream f (json);
+            f << out;
+            if (!f) { perror(json); return 1; }
+        }
+    }
+    return 0;
+}
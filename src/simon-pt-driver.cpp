@@ -3,11 +3,88 @@
 //
 // Author: Brent Carmer
 //
-// A test that the plaintext implementation of SIMON is correct.
+// A test that the plaintext implementation of SIMON is correct. Timings here
+// are a quick sanity check; simon-pt-bench has the real measurements.
 
-#include <math.h>
+#include <chrono>
 #include "simon-pt.h"
+#include "simon-family.h"
 #include "simon-util.h"
+#include "thread-pool.h"
+
+// The test vectors from the SIMON specification, checked at compile time.
+// The spec lists key words last first; key::k[0] is the first round key.
+template <typename C>
+constexpr bool vectorOK (typename C::key k, typename C::block pt, typename C::block ct) {
+    return C::encrypt(C::expand(k), pt).x == ct.x && C::encrypt(C::expand(k), pt).y == ct.y
+        && C::decrypt(C::expand(k), ct).x == pt.x && C::decrypt(C::expand(k), ct).y == pt.y;
+}
+static_assert(vectorOK<simon32_64>({{ 0x0100, 0x0908, 0x1110, 0x1918 }},
+                                   { 0x6565, 0x6877 }, { 0xc69b, 0xe9bb }), "SIMON 32/64");
+static_assert(vectorOK<simon48_72>({{ 0x020100, 0x0a0908, 0x121110 }},
+                                   { 0x612067, 0x6e696c }, { 0xdae5ac, 0x292cac }), "SIMON 48/72");
+static_assert(vectorOK<simon48_96>({{ 0x020100, 0x0a0908, 0x121110, 0x1a1918 }},
+                                   { 0x726963, 0x20646e }, { 0x6e06a5, 0xacf156 }), "SIMON 48/96");
+static_assert(vectorOK<simon64_96>({{ 0x03020100, 0x0b0a0908, 0x13121110 }},
+                                   { 0x6f722067, 0x6e696c63 }, { 0x5ca2e27f, 0x111a8fc8 }), "SIMON 64/96");
+static_assert(vectorOK<simon64_128>({{ 0x03020100, 0x0b0a0908, 0x13121110, 0x1b1a1918 }},
+                                    { 0x656b696c, 0x20646e75 }, { 0x44c8fc20, 0xb9dfa07a }), "SIMON 64/128");
+static_assert(vectorOK<simon96_96>({{ 0x050403020100, 0x0d0c0b0a0908 }},
+                                   { 0x2072616c6c69, 0x702065687420 },
+                                   { 0x602807a462b4, 0x69063d8ff082 }), "SIMON 96/96");
+static_assert(vectorOK<simon96_144>({{ 0x050403020100, 0x0d0c0b0a0908, 0x151413121110 }},
+                                    { 0x746168742074, 0x73756420666f },
+                                    { 0xecad1c6c451e, 0x3f59c5db1ae9 }), "SIMON 96/144");
+static_assert(vectorOK<simon128_128>({{ 0x0706050403020100, 0x0f0e0d0c0b0a0908 }},
+                                     { 0x6373656420737265, 0x6c6c657661727420 },
+                                     { 0x49681b1e1e54fe3f, 0x65aa832af84e0bbc }), "SIMON 128/128");
+static_assert(vectorOK<simon128_192>({{ 0x0706050403020100, 0x0f0e0d0c0b0a0908, 0x1716151413121110 }},
+                                     { 0x206572656874206e, 0x6568772065626972 },
+                                     { 0xc4ac61effcdc0d4f, 0x6c9c8d6e2597b85b }), "SIMON 128/192");
+static_assert(vectorOK<simon128_256>({{ 0x0706050403020100, 0x0f0e0d0c0b0a0908,
+                                        0x1716151413121110, 0x1f1e1d1c1b1a1918 }},
+                                     { 0x74206e69206d6f6f, 0x6d69732061207369 },
+                                     { 0x8d2b5579afc8a3a0, 0x3bf72a87efe7b868 }), "SIMON 128/256");
+
+// the unrolled batch path agrees with the constexpr one
+template <typename C>
+bool familyOK () {
+    typename C::key k;
+    for (unsigned i = 0; i < C::m; i++) k.k[i] = (typename C::word) rand() & C::mask;
+    typename C::schedule ks = C::expand(k);
+    vector<typename C::block> bs (100), orig;
+    for (size_t i = 0; i < bs.size(); i++) {
+        bs[i] = { (typename C::word) (rand() & C::mask), (typename C::word) (rand() & C::mask) };
+    }
+    orig = bs;
+    C::encrypt(ks, bs.data(), bs.size());
+    bool ok = true;
+    for (size_t i = 0; i < bs.size(); i++) {
+        typename C::block c = C::encrypt(ks, orig[i]);
+        ok = ok && c.x == bs[i].x && c.y == bs[i].y;
+    }
+    C::decrypt(ks, bs.data(), bs.size());
+    for (size_t i = 0; i < bs.size(); i++) {
+        ok = ok && orig[i].x == bs[i].x && orig[i].y == bs[i].y;
+    }
+    printf("SIMON %u/%u: %u rounds %s\n", 2 * C::n, C::n * C::m, C::T, ok ? "ok" : "MISMATCH");
+    return ok;
+}
+
+// blocks/sec for n blocks through f, best of a few runs. Wall clock, since
+// clock() would add up the CPU time of every thread.
+template <typename F>
+double blocksPerSec (size_t n, F f) {
+    double best = 0;
+    for (int rep = 0; rep < 5; rep++) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        f();
+        chrono::duration<double> t = chrono::steady_clock::now() - t0;
+        double bps = n / max(t.count(), 1e-9);
+        if (bps > best) best = bps;
+    }
+    return best;
+}
 
 int main(int argc, char **argv)
 {
@@ -20,20 +97,66 @@ int main(int argc, char **argv)
     vector<pt_key32> k ({0x1b1a1918, 0x13121110, 0x0b0a0908, 0x03020100});
     pt_expandKey(k);
     printKey(k);
-    
-    vector<clock_t> times;
-    for (size_t i = 0; i < 1000; i++) {
-        clock_t t = clock();
-        for (size_t j = 0; j < T; j++) {
-            bs[0] = pt_encRound(k[j], bs[0]);
-        }
-        t = clock() - t;
-        times.push_back(t);
+
+    // the template family, and SIMON 64/128 from it against pt_encBlock
+    bool famOK = familyOK<simon32_64>() && familyOK<simon48_72>() && familyOK<simon48_96>()
+              && familyOK<simon64_96>() && familyOK<simon64_128>() && familyOK<simon96_96>()
+              && familyOK<simon96_144>() && familyOK<simon128_128>()
+              && familyOK<simon128_192>() && familyOK<simon128_256>();
+    simon64_128::schedule fks = simon64_128::expand({{ k[0], k[1], k[2], k[3] }});
+    pt_block fb = pt_encBlock(k, bs[0]);
+    simon64_128::block gb = simon64_128::encrypt(fks, { bs[0].x, bs[0].y });
+    famOK = famOK && vector<pt_key32>(fks.k, fks.k + T) == k && fb.x == gb.x && fb.y == gb.y;
+    if (!famOK) return 1;
+
+    // batch kernels: check each against pt_encBlock, then compare speed
+    const size_t n = 1 << 16;
+    vector<pt_block> pt (n), ref (n), ct (n);
+    for (size_t i = 0; i < n; i++) {
+        pt[i] = { (uint32_t) rand(), (uint32_t) rand() };
+        ref[i] = pt_encBlock(k, pt[i]);
     }
-    clock_t sum = 0;
-    for (clock_t x : times){
-        sum += x;
+    pt_schedule ks (k);
+
+    double base = blocksPerSec(n, [&]{
+        for (size_t i = 0; i < n; i++) ct[i] = pt_encBlock(k, pt[i]);
+    });
+    printf("%-10s %12.0f blocks/s\n", "encBlock", base);
+
+    const vector<pt_batchKernel> &kernels = pt_batchKernels();
+    for (size_t i = 0; i < kernels.size(); i++) {
+        const pt_batchKernel &kern = kernels[i];
+        if (!kern.supported()) continue;
+        ct = pt;
+        kern.enc(ks, ct.data(), n - 3); // odd length exercises the tail
+        ct[n-3] = pt_encBlock(k, pt[n-3]);
+        ct[n-2] = pt_encBlock(k, pt[n-2]);
+        ct[n-1] = pt_encBlock(k, pt[n-1]);
+        bool ok = ct == ref;
+        kern.dec(ks, ct.data(), n);
+        ok = ok && ct == pt;
+        double bps = blocksPerSec(n, [&]{ kern.enc(ks, ct.data(), n); });
+        printf("%-10s %12.0f blocks/s  %5.1fx  %s%s\n", kern.name, bps, bps / base,
+               ok ? "ok" : "MISMATCH",
+               &kern == &pt_selectKernel() ? "  (selected)" : "");
+        if (!ok) return 1;
+    }
+
+    // CTR mode across 1, 2, 4, ... threads, up to one per core
+    vector<unsigned char> buf (8 * n), ref_buf (8 * n);
+    pt_ctrCrypt(ks, 0x0123456789abcdefULL, 0, buf.data(), ref_buf.data(), buf.size());
+    size_t ncores = max(1u, thread::hardware_concurrency());
+    for (size_t nthreads = 1;; nthreads = min(2 * nthreads, ncores)) {
+        ThreadPool pool (nthreads);
+        vector<unsigned char> out (buf.size());
+        pt_ctrCryptParallel(pool, ks, 0x0123456789abcdefULL, 0, buf.data(), out.data(), buf.size());
+        bool ok = out == ref_buf;
+        double bps = blocksPerSec(n, [&]{
+            pt_ctrCryptParallel(pool, ks, 0x0123456789abcdefULL, 0, buf.data(), out.data(), buf.size());
+        });
+        printf("ctr x%-4zu %12.0f blocks/s  %s\n", nthreads, bps, ok ? "ok" : "MISMATCH");
+        if (!ok) return 1;
+        if (nthreads == ncores) break;
     }
-    sum /= times.size();
-    printf("%.0fns/round\n", sum / (double)CLOCKS_PER_SEC * pow(10,9) / T);
+    return 0;
 }
@@ -6,10 +6,15 @@
 // This file includes functions implementing the SIMON block cipher in
 // plaintext (without using homomorphic encryption).
 
+#include <algorithm>
+#include <ctime>
 #include "simon-pt.h"
+#include "thread-pool.h"
 
+// n is taken mod 32, so pt_rotateLeft(x, -3) rotates right by 3
 uint32_t pt_rotateLeft (uint32_t x, uint32_t n) {
-    return (x << n) | (x >> (32 - n));
+    n &= 31;
+    return (x << n) | (x >> ((32 - n) & 31));
 }
 
 void pt_expandKey(vector<pt_key32> &k, size_t nrounds){
@@ -40,7 +45,7 @@ pt_block pt_decRound(pt_key32 k, pt_block inp) {
     return { y, x };
 }
 
-pt_block pt_encBlock(vector<pt_key32> k, pt_block inp, size_t nrounds) {
+pt_block pt_encBlock(const vector<pt_key32> &k, pt_block inp, size_t nrounds) {
     pt_block res = inp;
     for (size_t i = 0; i < nrounds; i++) {
         res = pt_encRound(k[i], res);
@@ -57,16 +62,14 @@ vector<pt_key32> pt_genKey() {
     return ks;
 }
 
-vector<pt_block> pt_simonEnc (vector<pt_key32> k, string inp, size_t nrounds) {
+vector<pt_block> pt_simonEnc (const vector<pt_key32> &k, string inp, size_t nrounds) {
     vector<pt_block> blocks = strToBlocks(inp);
-    for (size_t i = 0; i < blocks.size(); i++) {
-        pt_block b = blocks[i];
-        blocks[i] = pt_encBlock(k, b, nrounds);
-    }
+    pt_schedule ks(k, nrounds);
+    pt_encBlocks(ks, blocks.data(), blocks.size());
     return blocks;
 }
 
-pt_block pt_decBlock(vector<pt_key32> k, pt_block inp, size_t nrounds) {
+pt_block pt_decBlock(const vector<pt_key32> &k, pt_block inp, size_t nrounds) {
     pt_block res = inp;
     for (int i = nrounds-1; i >= 0; i--) {
         res = pt_decRound(k[i], res);
@@ -74,15 +77,52 @@ pt_block pt_decBlock(vector<pt_key32> k, pt_block inp, size_t nrounds) {
     return res;
 }
 
-string pt_simonDec(vector<pt_key32> k, vector<pt_block> c, size_t nrounds) {
-    vector<pt_block> bs;
-    for (size_t i = 0; i < c.size(); i++) {
-        pt_block b = pt_decBlock(k, c[i], nrounds);
-        bs.push_back(b);
-    }
+string pt_simonDec(const vector<pt_key32> &k, const vector<pt_block> &c, size_t nrounds) {
+    vector<pt_block> bs (c);
+    pt_schedule ks(k, nrounds);
+    pt_decBlocks(ks, bs.data(), bs.size());
     return blocksToStr(bs);
 }
 
+void pt_ctrCrypt (const pt_schedule &ks, uint64_t iv, uint64_t ctr,
+                  const unsigned char *inp, unsigned char *out, size_t len)
+{
+    const size_t nblocks = 256;
+    pt_block stream[nblocks];
+    unsigned char bytes[8];
+    while (len) {
+        size_t n = min(nblocks, (len + 7) / 8);
+        for (size_t i = 0; i < n; i++) {
+            uint64_t c = iv + ctr + i;
+            stream[i] = { (uint32_t) (c >> 32), (uint32_t) c };
+        }
+        pt_encBlocks(ks, stream, n);
+        for (size_t i = 0; i < n; i++) {
+            pt_storeBlock(stream[i], bytes);
+            size_t m = min((size_t) 8, len);
+            for (size_t b = 0; b < m; b++) {
+                out[b] = inp[b] ^ bytes[b];
+            }
+            inp += m;
+            out += m;
+            len -= m;
+        }
+        ctr += n;
+    }
+}
+
+void pt_ctrCryptParallel (ThreadPool &pool, const pt_schedule &ks, uint64_t iv, uint64_t ctr,
+                          const unsigned char *inp, unsigned char *out, size_t len)
+{
+    // every counter block is independent, so hand each thread a contiguous
+    // run of them; only the last run can end in a partial block
+    size_t nblocks = (len + 7) / 8;
+    pool.parallelFor(nblocks, 4096, [&](size_t begin, size_t end) {
+        size_t off = 8 * begin;
+        pt_ctrCrypt(ks, iv, ctr + begin, inp + off, out + off, min(8 * end, len) - off);
+    });
+}
+
 string blocksToStr (vector<pt_block> bs) {
     string ret;
     for (size_t i = 0; i < bs.size(); i++) {
@@ -23,12 +23,26 @@ struct pt_block {
     uint32_t y;
 };
 
+inline bool operator== (pt_block a, pt_block b) { return a.x == b.x && a.y == b.y; }
+
+// big-endian byte order, matching strToBlocks and blocksToStr
+inline pt_block pt_loadBlock (const unsigned char *p) {
+    uint32_t x = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    uint32_t y = (uint32_t) p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+    return { x, y };
+}
+
+inline void pt_storeBlock (pt_block b, unsigned char *p) {
+    p[0] = b.x >> 24; p[1] = b.x >> 16; p[2] = b.x >> 8; p[3] = b.x;
+    p[4] = b.y >> 24; p[5] = b.y >> 16; p[6] = b.y >> 8; p[7] = b.y;
+}
+
 // SIMON parameters
 const size_t m = 4;
 const size_t j = 3;
 const size_t T = 44;             // SIMON specifications call for 44 rounds
 
-const uint32_t z[5][62] = 
+constexpr uint32_t z[5][62] =
     { { 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 1, 0, 0, 1, 0, 1, 0, 1, 1, 0,
         0, 0, 0, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 1,
         0, 0, 1, 0, 1, 0, 1, 1, 0, 0, 0, 0, 1, 1, 1, 0, 0, 1, 1, 0 },
@@ -55,16 +69,61 @@ pt_block pt_encRound(pt_key32 k, pt_block inp);
 
 pt_block pt_decRound(pt_key32 k, pt_block inp);
 
-pt_block pt_encBlock(vector<pt_key32> k, pt_block inp, size_t nrounds = T);
+pt_block pt_encBlock(const vector<pt_key32> &k, pt_block inp, size_t nrounds = T);
 
 vector<pt_block> strToBlocks (string inp);
 
-vector<pt_block> pt_simonEnc (vector<pt_key32> k, string inp, size_t nrounds = T);
+vector<pt_block> pt_simonEnc (const vector<pt_key32> &k, string inp, size_t nrounds = T);
 
-pt_block pt_decBlock(vector<pt_key32> k, pt_block inp, size_t nrounds = T);
+pt_block pt_decBlock(const vector<pt_key32> &k, pt_block inp, size_t nrounds = T);
 
-string pt_simonDec(vector<pt_key32> k, vector<pt_block> c, size_t nrounds = T);
+string pt_simonDec(const vector<pt_key32> &k, const vector<pt_block> &c, size_t nrounds = T);
 
 string blocksToStr (vector<pt_block> bs);
 
+// Batch interface (simon-pt-batch.cpp)
+//
+// A pt_schedule is an expanded key, built once and passed by reference to
+// the batch routines. Copying is disabled so it is never passed by value.
+
+struct pt_schedule {
+    pt_key32 k[T];
+    size_t nrounds;
+    explicit pt_schedule (const vector<pt_key32> &key, size_t nrounds = T);
+    pt_schedule (const pt_schedule&) = delete;
+    pt_schedule& operator= (const pt_schedule&) = delete;
+};
+
+typedef void (*pt_kernel)(const pt_schedule &ks, pt_block *bs, size_t n);
+
+struct pt_batchKernel {
+    const char *name;
+    size_t width;               // blocks per instruction stream
+    bool (*supported)();
+    pt_kernel enc;
+    pt_kernel dec;
+};
+
+// every kernel compiled into this binary, scalar first
+const vector<pt_batchKernel>& pt_batchKernels ();
+
+// the widest supported kernel, or the one named by $SIMON_PT_KERNEL
+const pt_batchKernel& pt_selectKernel ();
+
+void pt_encBlocks (const pt_schedule &ks, pt_block *bs, size_t n);
+
+void pt_decBlocks (const pt_schedule &ks, pt_block *bs, size_t n);
+
+// CTR mode: XORs len bytes of inp with the keystream E(iv+ctr), E(iv+ctr+1),
+// ... and writes them to out, which may alias inp. The counter block is the
+// 64-bit sum with x as its high word.
+void pt_ctrCrypt (const pt_schedule &ks, uint64_t iv, uint64_t ctr,
+                  const unsigned char *inp, unsigned char *out, size_t len);
+
+class ThreadPool;
+
+// pt_ctrCrypt with the counter space split across the threads of pool
+void pt_ctrCryptParallel (ThreadPool &pool, const pt_schedule &ks, uint64_t iv, uint64_t ctr,
+                          const unsigned char *inp, unsigned char *out, size_t len);
+
 #endif
@@ -7,78 +7,197 @@
 // with a single bit, and two vectors of Ctxt represent a SIMON block. It uses
 // bit slicing to parallelize SIMON by packing the corresponding bits of blocks
 // into the same Ctxt.
+//
+//   simon-simd [32/64 | 48/72 | 48/96 | 64/96 | 64/128]
+//
+// picks the SIMON variant; the default is 64/128.
+//
+// With HE_SCHEDULE=path the demo uses the SIMON test-vector key instead of
+// a random one, and loads its encrypted key schedule from path when the file
+// matches this context and public key, or encrypts it and writes it there.
+//
+// With HE_CIRCUIT set, all rounds are recorded as one circuit, optimized and
+// evaluated at once (see circuit.h), and only the result is checked;
+// HE_CIRCUIT=N bounds the ciphertexts held at once to about N.
 
+#include <cstring>
 #include "simon-simd.h"
 
 size_t global_nslots;
 CTvec* global_maxint;
 
-int main(int argc, char **argv)
-{
-    string inp = "secrets! very secrets!";
-    cout << "inp = \"" << inp << "\"" << endl;
-    vector<pt_key32> k = pt_genKey();
-    pt_expandKey(k);
-    printKey(k);
+// big-endian words of C::n bits, zero padded to whole blocks
+template <typename C>
+vector<typename C::block> strToBlocks (const string &s) {
+    const size_t wbytes = C::n / 8;
+    vector<typename C::block> bs;
+    for (size_t i = 0; i < s.size(); i += 2 * wbytes) {
+        typename C::word w[2] = { 0, 0 };
+        for (size_t b = 0; b < 2 * wbytes; b++) {
+            unsigned char c = i + b < s.size() ? s[i+b] : 0;
+            w[b / wbytes] = (typename C::word) (w[b / wbytes] << 8 | c);
+        }
+        bs.push_back({ w[0], w[1] });
+    }
+    return bs;
+}
 
-    // initialize helib
-    long m=0, p=2, r=1;
-    long L=23;
-    long c=3;
-    long w=64;
-    long d=0;
-    long security = 128;
-    cout << "L=" << L << endl;
-    ZZX G;
-    cout << "Finding m..." << endl;
-    m = FindM(security,L,c,p,d,0,0);
-    cout << "Generating context..." << endl;
-    FHEcontext context(m, p, r);
-    cout << "Building mod-chain..." << endl;
-    buildModChain(context, L, c);
-    cout << "Generating keys..." << endl;
-    FHESecKey seckey(context);
-    const FHEPubKey& pubkey = seckey;
-    G = context.alMod.getFactorsOverZZ()[0];
-    seckey.GenSecKey(w);
-    addSome1DMatrices(seckey);
-    EncryptedArray ea(context, G);
-    global_nslots = ea.size();
-    cout << "nslots = " << global_nslots << endl;
+template <typename C>
+string blocksToStr (const vector<typename C::block> &bs) {
+    const size_t wbytes = C::n / 8;
+    string s;
+    for (size_t i = 0; i < bs.size(); i++) {
+        typename C::word w[2] = { bs[i].x, bs[i].y };
+        for (size_t b = 0; b < 2 * wbytes; b++) {
+            s.push_back((char) (w[b / wbytes] >> (8 * (wbytes - 1 - b % wbytes))));
+        }
+    }
+    return s;
+}
 
-    // set up globals
-    CTvec maxint (ea, pubkey, transpose(uint32ToBits(0xFFFFFFFF)));
-    global_maxint = &maxint;
+static void printCircuit (const char *what, const Circuit &c) {
+    Circuit::Stats st = c.stats();
+    printf("%s: %zu gates (%zu AND, %zu XOR), AND depth %zu, XOR depth %zu\n", what, st.gates,
+           st.ands, st.xors, st.depth, st.xorDepth);
+}
+
+template <typename C>
+int runCircuit (EncryptedArray &ea, const FHEPubKey &pubkey, const FHESecKey &seckey,
+                const vector<CTvec> &key, heblock &ct, const typename C::schedule &ks,
+                const vector<typename C::block> &pt, size_t maxLive) {
+    MetricScope build ("circuit", true);
+    cout << "Recording " << C::T << " rounds as a circuit..." << flush;
+    Circuit circ = simonCircuit<C>(ea, C::T);
+    build.stop();
+    printCircuit("recorded ", circ);
+    circ.optimize();
+    printCircuit("optimized", circ);
+
+    cout << "Evaluating..." << flush;
+    MetricScope eval ("evaluate", true);
+    evalRounds(circ, ea, pubkey, key, 0, ct, maxLive);
+    eval.stop();
+
+    vector<typename C::block> bs = heDecrypt<C>(seckey, ct);
+    size_t good = 0;
+    for (size_t b = 0; b < pt.size(); b++) {
+        typename C::block want = C::encrypt(ks, pt[b], C::T);
+        good += bs[b].x == want.x && bs[b].y == want.y;
+    }
+    printf("%zu/%zu blocks match\n", good, pt.size());
+    return good == pt.size() ? 0 : 1;
+}
+
+template <typename C>
+int run (EncryptedArray &ea, const FHEPubKey &pubkey, const FHESecKey &seckey, const string &inp,
+         const CtxtFileParams &params, const string &variant) {
+    const char *schedFile = getenv("HE_SCHEDULE");
+    typename C::key key;
+    vector<pt_key32> k = schedFile ? vector<pt_key32>({0x1b1a1918, 0x13121110, 0x0b0a0908, 0x03020100})
+                                   : pt_genKey();
+    for (size_t i = 0; i < C::m; i++) key.k[i] = (typename C::word) (k[i] & C::mask);
+    typename C::schedule ks = C::expand(key);
+    cout << "key = ";
+    for (size_t i = 0; i < C::T; i++) {
+        if (!(i%5)) printf("\n");
+        printf("0x%0*llx ", (int) C::n / 4, (unsigned long long) ks.k[i]);
+    }
+    cout << endl;
+    vector<typename C::block> pt = strToBlocks<C>(inp);
 
     // HEencrypt key
-    timer(true);
     cout << "Encrypting SIMON key..." << flush;
-    vector<CTvec> encryptedKey = heEncrypt(ea, pubkey, k);
-    timer();
+    MetricScope encKey ("encrypt key", true);
+    vector<CTvec> encryptedKey;
+    string label = "SIMON " + variant + " test-vector key schedule", err;
+    if (schedFile && readSchedule(schedFile, params, ea, pubkey, label, encryptedKey, err)) {
+        cout << "loaded from " << schedFile << "..." << flush;
+    } else {
+        if (schedFile) cout << err << "..." << flush;
+        encryptedKey = heEncrypt<C>(ea, pubkey, ks);
+        if (schedFile && !writeSchedule(schedFile, params, pubkey, label, encryptedKey)) {
+            cerr << "cannot write " << schedFile << endl;
+        }
+    }
+    encKey.stop();
 
     // HEencrypt input
     cout << "Encrypting inp..." << flush;
-    heblock ct = heEncrypt(ea, pubkey, inp);
-    timer();
+    MetricScope encInp ("encrypt input", true);
+    heblock ct = heEncrypt<C>(ea, pubkey, pt);
+    encInp.stop();
 
     cout << "Running protocol..." << endl;
-    for (size_t i = 0; i < T; i++) {
-        cout << "Round " << i+1 << "/" << T << "..." << flush;
+    MetricScope protocol ("protocol");
+    if (const char *circ = getenv("HE_CIRCUIT")) {
+        return runCircuit<C>(ea, pubkey, seckey, encryptedKey, ct, ks, pt, atol(circ));
+    }
+    for (size_t i = 0; i < C::T; i++) {
+        MetricScope round ("round " + to_string(i+1));
+        cout << "Round " << i+1 << "/" << C::T << "..." << flush;
+        long lvl = scheduleLevels(ct, encryptedKey[i]);
+        cout << "level " << lvl << "..." << flush;
+        MetricScope enc ("encRound", true);
         encRound(encryptedKey[i], ct);
-        timer();
+        enc.stop();
 
         // check intermediate result for noise
         cout << "decrypting..." << flush;
-        vector<pt_block> bs = heblockToBlocks(seckey, ct);
-        timer();
-
-        printf("block0    : 0x%08x 0x%08x\n", bs[0].x, bs[0].y);
+        MetricScope dec ("decrypt", true);
+        vector<typename C::block> bs = heDecrypt<C>(seckey, ct);
+        dec.stop();
 
-        vector<pt_block> pt_bs = pt_simonEnc(k, inp, i+1);
-        printf("should be : 0x%08x 0x%08x\n", pt_bs[0].x, pt_bs[0].y);
+        typename C::block want = C::encrypt(ks, pt[0], i+1);
+        printf("block0    : 0x%0*llx 0x%0*llx\n", (int) C::n / 4, (unsigned long long) bs[0].x,
+               (int) C::n / 4, (unsigned long long) bs[0].y);
+        printf("should be : 0x%0*llx 0x%0*llx\n", (int) C::n / 4, (unsigned long long) want.x,
+               (int) C::n / 4, (unsigned long long) want.y);
 
-        cout << "decrypted : \"" << pt_simonDec(k, bs, i+1) << "\" " << endl;
+        for (size_t b = 0; b < bs.size(); b++) bs[b] = C::decrypt(ks, bs[b], i+1);
+        cout << "decrypted : \"" << blocksToStr<C>(bs) << "\" " << endl;
     }
-
     return 0;
 }
+
+// the multiplicative depth of each variant, one AND per round
+static long variantDepth (const string &v) {
+    if (v == "32/64") return simon32_64::T;
+    if (v == "48/72") return simon48_72::T;
+    if (v == "48/96") return simon48_96::T;
+    if (v == "64/96") return simon64_96::T;
+    return simon64_128::T;
+}
+
+int main(int argc, char **argv)
+{
+    const char *variant = argc > 1 ? argv[1] : "64/128";
+    string inp = "secrets! very secrets!";
+    cout << "inp = \"" << inp << "\"" << endl;
+    cout << "SIMON " << variant << endl;
+
+    // initialize helib
+    MetricScope setup ("setup");
+    HElibInstance he (he_paramsFor("simon-simd", variantDepth(variant), 0));
+    EncryptedArray &ea = he.ea();
+    const FHESecKey &seckey = he.seckey();
+    const FHEPubKey &pubkey = he.pubkey();
+    global_nslots = he.nslots();
+
+    // set up globals
+    // public, so it costs nothing until it meets a ciphertext
+    vector<SlotBuffer> ones (32, SlotBuffer(global_nslots));
+    for (size_t b = 0; b < ones.size(); b++) ones[b].set(0, 1);
+    CTvec maxint (ea, pubkey, ones, 1, false);
+    global_maxint = &maxint;
+    setup.stop();
+    const HEParams &ps = he.params();
+    CtxtFileParams params = { he.m(), ps.p, ps.r, ps.L, ps.c, (long) global_nslots };
+
+    if (!strcmp(variant, "32/64"))  return run<simon32_64> (ea, pubkey, seckey, inp, params, variant);
+    if (!strcmp(variant, "48/72"))  return run<simon48_72> (ea, pubkey, seckey, inp, params, variant);
+    if (!strcmp(variant, "48/96"))  return run<simon48_96> (ea, pubkey, seckey, inp, params, variant);
+    if (!strcmp(variant, "64/96"))  return run<simon64_96> (ea, pubkey, seckey, inp, params, variant);
+    if (!strcmp(variant, "64/128")) return run<simon64_128>(ea, pubkey, seckey, inp, params, variant);
+    cerr << "unknown SIMON variant " << variant << endl;
+    return 1;
+}
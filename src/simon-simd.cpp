@@ -8,6 +8,7 @@
 // bit slicing to parallelize SIMON by packing the corresponding bits of blocks
 // into the same Ctxt.
 
+#include <iterator>
 #include "simon-simd.h"
 
 CTvec::CTvec
@@ -18,6 +19,7 @@ CTvec::CTvec
     bool fill
 )
 {
+    rot = 0;
     ea = &inp_ea;
     pubkey = &inp_pubkey;
     nelems = inp[0].size();
@@ -27,114 +29,228 @@ CTvec::CTvec
         } else {
             pad(0, inp[i], global_nslots);
         }
-        Ctxt c(*pubkey);
-        ea->encrypt(c, *pubkey, inp[i]);
-        cts.push_back(c);
+        Ctxt ct (*pubkey);
+        ea->encrypt(ct, *pubkey, inp[i]);
+        cts.emplace_back(*ea, move(ct));
     }
 }
 
-Ctxt CTvec::get (int i) { return cts[i]; }
+CTvec::CTvec
+(
+    EncryptedArray &inp_ea,
+    const FHEPubKey &inp_pubkey,
+    const vector<SlotBuffer> &inp,
+    int n,
+    bool secret
+)
+{
+    rot = 0;
+    ea = &inp_ea;
+    pubkey = &inp_pubkey;
+    nelems = n;
+    cts.reserve(inp.size());
+    for (size_t i = 0; i < inp.size(); i++) {
+        cts.emplace_back(*ea, inp[i]);
+        if (secret) cts.back().encrypt(*pubkey);
+    }
+}
 
-void CTvec::xorWith (CTvec &other) {
-    for (uint32_t i = 0; i < cts.size(); i++) {
-        cts[i].addCtxt(other.get(i));
+CTvec::CTvec (EncryptedArray &inp_ea, const FHEPubKey &inp_pubkey, vector<Ctxt> &&inp, int n)
+    : rot(0), ea(&inp_ea), pubkey(&inp_pubkey), nelems(n)
+{
+    cts.reserve(inp.size());
+    for (size_t i = 0; i < inp.size(); i++) cts.emplace_back(*ea, move(inp[i]));
+    inp.clear();
+}
+
+CTvec::CTvec (EncryptedArray &inp_ea, const FHEPubKey &inp_pubkey, vector<MixedCtxt> &&inp, int n)
+    : cts(move(inp)), rot(0), ea(&inp_ea), pubkey(&inp_pubkey), nelems(n) {}
+
+vector<Ctxt> CTvec::ctxts () const {
+    vector<Ctxt> res;
+    res.reserve(cts.size());
+    for (size_t i = 0; i < cts.size(); i++) {
+        if (get(i).isClear()) {
+            MixedCtxt bit = get(i);
+            bit.encrypt(*pubkey);
+            res.push_back(bit.ctxt());
+        } else {
+            res.push_back(get(i).ctxt());
+        }
     }
+    return res;
 }
 
-void CTvec::andWith (CTvec &other) {
-    for (uint32_t i = 0; i < cts.size(); i++) {
-        cts[i].multiplyBy(other.get(i));
+void CTvec::xorWith (const CTvec &other) {
+    MixedTally tally;
+    ThreadPool::shared().parallelEach(cts.size(), [&](size_t i) {
+        get(i).xorWith(other.get(i), &tally);
+    });
+    tally.report();
+}
+
+void CTvec::andWith (const CTvec &other) {
+    MixedTally tally;
+    ThreadPool::shared().parallelEach(cts.size(), [&](size_t i) {
+        get(i).andWith(other.get(i), &tally);
+    });
+    tally.report();
+}
+
+long CTvec::findBaseLevel () const {
+    long lvl = -1;
+    for (size_t i = 0; i < cts.size(); i++) {
+        long l = cts[i].findBaseLevel();
+        if (l >= 0 && (lvl < 0 || l < lvl)) lvl = l;
     }
+    return lvl;
 }
 
-void CTvec::rotateLeft (int n) {
-    rotate(cts.begin(), cts.end()-n, cts.end());
+void CTvec::modDownToLevel (long lvl) {
+    ThreadPool::shared().parallelEach(cts.size(), [&](size_t i) { cts[i].modDownToLevel(lvl); });
 }
 
-vector<vector<long>> CTvec::decrypt (const FHESecKey& seckey) {
+vector<vector<long>> CTvec::decrypt (const FHESecKey& seckey) const {
     vector<vector<long>> res;
     for (uint32_t i = 0; i < cts.size(); i++) {
         vector<long> decrypted (global_nslots);
-        ea->decrypt(cts[i], seckey, decrypted);
+        get(i).decrypt(seckey, decrypted);
         vector<long> bits (decrypted.begin(), decrypted.begin() + nelems);
         res.push_back(bits);
     }
     return res;
 }
 
-vector<pt_block> preblockToBlocks (pt_preblock b) {
-    vector<pt_block> bs;
-    for (size_t j = 0; j < b.xs[0].size(); j++) {
-        vector<long> xbits;
-        vector<long> ybits;
-        for (int i = 0; i < 32; i++) {
-            xbits.push_back(b.xs[i][j]);
-            ybits.push_back(b.ys[i][j]);
-        }
-        uint32_t x = vectorTo32(xbits);
-        uint32_t y = vectorTo32(ybits);
-        bs.push_back({ x, y });
+// Both conversions pack each block as x << 32 | y and slice all 64 bits in
+// one pass, so rows 0..31 are the y bits and rows 32..63 the x bits.
+
+void CTvec::decrypt (const FHESecKey& seckey, vector<SlotBuffer> &out) const {
+    out.resize(cts.size());
+    vector<long> decrypted (global_nslots);
+    for (size_t i = 0; i < cts.size(); i++) {
+        get(i).decrypt(seckey, decrypted);
+        out[i].assign(decrypted);
+    }
+}
+
+vector<pt_block> preblockToBlocks (const pt_preblock &b) {
+    vector<vector<long>> rows (b.ys);
+    rows.insert(rows.end(), b.xs.begin(), b.xs.end());
+    vector<uint64_t> ws = slicesToWords(rows);
+    vector<pt_block> bs (ws.size());
+    for (size_t j = 0; j < ws.size(); j++) {
+        bs[j] = { (uint32_t) (ws[j] >> 32), (uint32_t) ws[j] };
     }
     return bs;
 }
 
-pt_preblock blocksToPreblock (vector<pt_block> bs) {
-    vector<vector<long>> xs;
-    vector<vector<long>> ys;
-    for (int i = 0; i < 32; i++) {
-        vector<long> nextx;
-        vector<long> nexty;
-        for (size_t j = 0; j < bs.size(); j++) {
-            vector<long> x = uint32ToBits(bs[j].x);
-            vector<long> y = uint32ToBits(bs[j].y);
-            nextx.push_back(x[i]);
-            nexty.push_back(y[i]);
-        }
-        xs.push_back(nextx);
-        ys.push_back(nexty);
+pt_preblock blocksToPreblock (const vector<pt_block> &bs) {
+    vector<uint64_t> ws (bs.size());
+    for (size_t j = 0; j < bs.size(); j++) {
+        ws[j] = (uint64_t) bs[j].x << 32 | bs[j].y;
     }
-    return { xs, ys };
+    vector<vector<long>> rows = wordsToSlices(ws, 64);
+    pt_preblock b;
+    b.ys.assign(make_move_iterator(rows.begin()), make_move_iterator(rows.begin() + 32));
+    b.xs.assign(make_move_iterator(rows.begin() + 32), make_move_iterator(rows.end()));
+    return b;
 }
 
-vector<pt_block> heblockToBlocks (const FHESecKey& k, heblock ct) {
-    vector<pt_block> res;
-    vector<vector<long>> xs = ct.x.decrypt(k);
-    vector<vector<long>> ys = ct.y.decrypt(k);
-    return preblockToBlocks({ xs, ys });
+vector<pt_block> heblockToBlocks (const FHESecKey& k, const heblock &ct) {
+    vector<simon64_128::block> bs = heDecrypt<simon64_128>(k, ct);
+    vector<pt_block> res (bs.size());
+    for (size_t i = 0; i < bs.size(); i++) res[i] = { bs[i].x, bs[i].y };
+    return res;
 }
 
 heblock heEncrypt (EncryptedArray &ea, const FHEPubKey &pubkey, string s) {
     vector<pt_block> pt = strToBlocks(s);
-    pt_preblock b = blocksToPreblock(pt);
-    CTvec c0 (ea, pubkey, b.xs);
-    CTvec c1 (ea, pubkey, b.ys);
-    return { c0, c1 };
+    vector<simon64_128::block> bs (pt.size());
+    for (size_t i = 0; i < pt.size(); i++) bs[i] = { pt[i].x, pt[i].y };
+    return heEncrypt<simon64_128>(ea, pubkey, bs);
 }
 
 vector<CTvec> heEncrypt (EncryptedArray &ea, const FHEPubKey &pubkey, vector<uint32_t> &k) {
     vector<CTvec> encryptedKey;
+    encryptedKey.reserve(k.size());
+    vector<SlotBuffer> bits (32, SlotBuffer(global_nslots));
     for (size_t i = 0; i < k.size(); i++) {
-        vector<long> bits = uint32ToBits(k[i]);
-        vector<vector<long>> trans = transpose(bits);
-        CTvec kct (ea, pubkey, trans, true);
-        encryptedKey.push_back(kct);
+        for (size_t b = 0; b < 32; b++) bits[b].fill(k[i] >> b);
+        encryptedKey.push_back(CTvec(ea, pubkey, bits, 1));
     }
     return encryptedKey;
 }
 
-void encRound(CTvec key, heblock &inp) {
-    CTvec tmp = inp.x;
-    CTvec x0 = inp.x;
-    CTvec x1 = inp.x;
-    CTvec x2 = inp.x;
-    CTvec y = inp.y;
-    x0.rotateLeft(1);
-    x1.rotateLeft(8);
-    x2.rotateLeft(2);
-    x0.andWith(x1);
-    y.xorWith(x0);
-    y.xorWith(x2);
-    y.xorWith(key);
-    inp.x = y;
-    inp.y = tmp;
+bool writeSchedule (const string &path, const CtxtFileParams &params, const FHEPubKey &pubkey,
+                    const string &label, const vector<CTvec> &key) {
+    vector<vector<Ctxt>> rows;
+    rows.reserve(key.size());
+    for (size_t i = 0; i < key.size(); i++) rows.push_back(key[i].ctxts());
+    return ctxt_writeFile(path, params, pubkey, label, rows);
+}
+
+bool readSchedule (const string &path, const CtxtFileParams &params, EncryptedArray &ea,
+                   const FHEPubKey &pubkey, const string &label, vector<CTvec> &key, string &err) {
+    vector<vector<Ctxt>> rows;
+    if (!ctxt_readFile(path, params, pubkey, label, rows, err)) return false;
+    key.clear();
+    key.reserve(rows.size());
+    for (size_t i = 0; i < rows.size(); i++) key.push_back(CTvec(ea, pubkey, move(rows[i]), 1));
+    return true;
+}
+
+// y ^= (x<<<1 & x<<<8) ^ x<<<2 ^ k, one bit at a time through rotated views
+// of x, so the only new ciphertext is the product for the current bit. The
+// bits are independent and go to the shared pool. Ops on public bits fold.
+void encRound(const CTvec &key, heblock &inp) {
+    const CTvec &x = inp.x;
+    CTvec &y = inp.y;
+    MixedTally tally;
+    ThreadPool::shared().parallelEach(x.bits(), [&](size_t i) {
+        MixedCtxt t = x.get(i, 1);
+        t.andWith(x.get(i, 8), &tally);
+        MixedCtxt &yi = y.get(i);
+        yi.xorWith(t, &tally);
+        yi.xorWith(x.get(i, 2), &tally);
+        yi.xorWith(key.get(i), &tally);
+    });
+    tally.report();
+    swap(inp.x, inp.y);
+}
+
+// x ^= (y<<<1 & y<<<8) ^ y<<<2 ^ k, the same circuit as encRound on the
+// other half
+void decRound(const CTvec &key, heblock &inp) {
+    swap(inp.x, inp.y);
+    encRound(key, inp);
+    swap(inp.x, inp.y);
+}
+
+long scheduleLevels (heblock &inp, CTvec &key) {
+    long lx = inp.x.findBaseLevel(), ly = inp.y.findBaseLevel();
+    long lvl = lx < 0 ? ly : ly < 0 ? lx : min(lx, ly);
+    if (lvl < 0) lvl = key.findBaseLevel();
+    inp.x.modDownToLevel(lvl);
+    inp.y.modDownToLevel(lvl);
+    key.modDownToLevel(lvl);
+    metrics_observe("level", lvl);
+    return lvl;
+}
+
+void evalRounds (const Circuit &circ, EncryptedArray &ea, const FHEPubKey &pubkey,
+                 const vector<CTvec> &key, size_t first, heblock &ct, size_t maxLive) {
+    const int n = ct.x.bits();
+    vector<const MixedCtxt*> in;
+    in.reserve(circ.ninputs());
+    for (int i = 0; i < n; i++) in.push_back(&ct.x.get(i));
+    for (int i = 0; i < n; i++) in.push_back(&ct.y.get(i));
+    for (size_t k = first; in.size() < circ.ninputs(); k++) {
+        for (int i = 0; i < n; i++) in.push_back(&key[k].get(i));
+    }
+    vector<MixedCtxt> out = circ.evaluate(in, maxLive);
+    vector<MixedCtxt> ys (make_move_iterator(out.begin() + n), make_move_iterator(out.end()));
+    out.erase(out.begin() + n, out.end());
+    int nelems = ct.x.size();
+    ct.x = CTvec(ea, pubkey, move(out), nelems);
+    ct.y = CTvec(ea, pubkey, move(ys), nelems);
 }
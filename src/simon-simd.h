@@ -10,18 +10,24 @@
 
 #include <algorithm>
 
-#ifdef STUB
-#include "helib-stub.h"
-#else
-#include "FHE.h"
-#include "EncryptedArray.h"
-#endif
+#include "helib-instance.h"
 
+#include "circuit.h"
+#include "ctxt-file.h"
+#include "metrics.h"
+#include "mixed-ctxt.h"
 #include "simon-pt.h"
+#include "simon-family.h"
 #include "simon-util.h"
+#include "thread-pool.h"
 
+// Rotations are views: rotateLeft only moves the index offset, and get(i)
+// finds bit i through it, so no Ctxt is copied or moved. Bits are
+// MixedCtxts, so a vector of public bits costs nothing until it meets a
+// secret one.
 class CTvec {
-    vector<Ctxt> cts;
+    vector<MixedCtxt> cts;
+    int rot;                            // bit i lives in cts[(i - rot) mod size]
     EncryptedArray* ea;
     const FHEPubKey* pubkey;
     int nelems;
@@ -32,11 +38,33 @@ public:
       vector<vector<long>> inp,
       bool fill = false
     );
-    Ctxt get (int i);
-    void xorWith (CTvec &other);
-    void andWith (CTvec &other);
-    void rotateLeft (int n);
-    vector<vector<long>> decrypt (const FHESecKey& seckey);
+    // nelems is how many leading slots decrypt() returns. Without secret
+    // the bits stay clear, for public values such as counters.
+    CTvec (EncryptedArray &inp_ea, const FHEPubKey &inp_pubkey, const vector<SlotBuffer> &inp,
+           int nelems, bool secret = true);
+    // takes ciphertexts that are already encrypted, bit 0 first
+    CTvec (EncryptedArray &inp_ea, const FHEPubKey &inp_pubkey, vector<Ctxt> &&inp, int nelems);
+    CTvec (EncryptedArray &inp_ea, const FHEPubKey &inp_pubkey, vector<MixedCtxt> &&inp,
+           int nelems);
+    // bit i, rotated left by n more
+    const MixedCtxt& get (int i, int n = 0) const {
+        int k = cts.size();
+        return cts[((i - rot - n) % k + k) % k];
+    }
+    MixedCtxt& get (int i) {
+        int k = cts.size();
+        return cts[((i - rot) % k + k) % k];
+    }
+    void xorWith (const CTvec &other);
+    void andWith (const CTvec &other);
+    void rotateLeft (int n) { rot = (rot + n) % (int) cts.size(); }
+    long findBaseLevel () const;        // the lowest over the bits, -1 if all are clear
+    void modDownToLevel (long lvl);
+    vector<vector<long>> decrypt (const FHESecKey& seckey) const;
+    void decrypt (const FHESecKey& seckey, vector<SlotBuffer> &out) const;
+    int size () const { return nelems; }
+    int bits () const { return cts.size(); }
+    vector<Ctxt> ctxts () const;        // bit 0 first, clear ones encrypted
 };
 
 extern size_t global_nslots;
@@ -52,14 +80,119 @@ struct heblock {
     CTvec y;
 };
 
-vector<pt_block> preblockToBlocks (pt_preblock b);
+vector<pt_block> preblockToBlocks (const pt_preblock &b);
 
-pt_preblock blocksToPreblock (vector<pt_block> bs);
+pt_preblock blocksToPreblock (const vector<pt_block> &bs);
 
-vector<pt_block> heblockToBlocks (const FHESecKey& k, heblock ct);
+vector<pt_block> heblockToBlocks (const FHESecKey& k, const heblock &ct);
 
 heblock heEncrypt (EncryptedArray &ea, const FHEPubKey &pubkey, string s);
 
 vector<CTvec> heEncrypt (EncryptedArray &ea, const FHEPubKey &pubkey, vector<uint32_t> &k);
 
-void encRound(CTvec key, heblock &inp);
+// In place: inp.x gets the new x built from inp.y, then x and y swap.
+void encRound(const CTvec &key, heblock &inp);
+
+// The inverse of encRound with the same round key: y gets the old x back
+// from x, then x and y swap. Run with the round keys in reverse, it
+// decrypts SIMON under an encrypted key, which is how blocks encrypted
+// with plain SIMON are turned into HElib ciphertexts.
+void decRound(const CTvec &key, heblock &inp);
+
+// Call before each round. Switches x, y and the round key down to the
+// lowest level either half can be at, or to the key's while both halves
+// are still clear. The lower half is the one that gets multiplied (x for
+// encRound, y for decRound), so the others never need more, and having
+// them there already saves HElib switching a copy of each full-level one
+// inside every addition. Returns the level the round will run at.
+long scheduleLevels (heblock &inp, CTvec &key);
+
+// An encrypted key schedule on disk, one row of bit ciphertexts per round
+// key; see ctxt-file.h. label says which cipher and key it is.
+bool writeSchedule (const string &path, const CtxtFileParams &params, const FHEPubKey &pubkey,
+                    const string &label, const vector<CTvec> &key);
+
+bool readSchedule (const string &path, const CtxtFileParams &params, EncryptedArray &ea,
+                   const FHEPubKey &pubkey, const string &label, vector<CTvec> &key, string &err);
+
+// Word-size-generic versions for any simon_cipher C from simon-family.h; the
+// 32-bit functions above are the SIMON 64/128 case. A CTvec holds one Ctxt
+// per bit of the word, so smaller words mean fewer ciphertexts per round,
+// and fewer rounds mean less depth.
+
+// Without secret the blocks are public values, such as CTR counters, and
+// nothing is encrypted: the first round folds on the CPU up to the key
+// addition, which is an addConstant on the key bits, so the whole cipher
+// is one multiplication shallower.
+template <typename C>
+heblock heEncrypt (EncryptedArray &ea, const FHEPubKey &pubkey, const vector<typename C::block> &bs,
+                   bool secret = true) {
+    vector<uint64_t> xs (bs.size()), ys (bs.size());
+    for (size_t i = 0; i < bs.size(); i++) {
+        xs[i] = bs[i].x;
+        ys[i] = bs[i].y;
+    }
+    vector<SlotBuffer> slices;
+    wordsToSlices(xs, C::n, global_nslots, slices);
+    CTvec c0 (ea, pubkey, slices, bs.size(), secret);
+    wordsToSlices(ys, C::n, global_nslots, slices);
+    CTvec c1 (ea, pubkey, slices, bs.size(), secret);
+    return { move(c0), move(c1) };
+}
+
+template <typename C>
+vector<CTvec> heEncrypt (EncryptedArray &ea, const FHEPubKey &pubkey, const typename C::schedule &ks) {
+    vector<CTvec> encryptedKey;
+    encryptedKey.reserve(C::T);
+    vector<SlotBuffer> bits (C::n, SlotBuffer(global_nslots));
+    for (size_t i = 0; i < C::T; i++) {
+        for (size_t b = 0; b < C::n; b++) bits[b].fill(ks.k[i] >> b);
+        encryptedKey.push_back(CTvec(ea, pubkey, bits, 1));
+    }
+    return encryptedKey;
+}
+
+template <typename C>
+vector<typename C::block> heDecrypt (const FHESecKey& k, const heblock &ct) {
+    vector<SlotBuffer> slices;
+    ct.x.decrypt(k, slices);
+    vector<uint64_t> xs = slicesToWords(slices, ct.x.size());
+    ct.y.decrypt(k, slices);
+    vector<uint64_t> ys = slicesToWords(slices, ct.y.size());
+    vector<typename C::block> res (xs.size());
+    for (size_t i = 0; i < xs.size(); i++) {
+        res[i] = { (typename C::word) xs[i], (typename C::word) ys[i] };
+    }
+    return res;
+}
+
+// Rounds of C as a circuit. The inputs are the bits of x, then of y, then
+// of each round key in turn, bit 0 first; the outputs the bits of x and y
+// after the rounds.
+template <typename C>
+Circuit simonCircuit (const EncryptedArray &ea, size_t rounds) {
+    const int n = C::n;
+    Circuit c (ea);
+    vector<Wire> x (n), y (n);
+    for (int i = 0; i < n; i++) x[i] = c.input();
+    for (int i = 0; i < n; i++) y[i] = c.input();
+    for (size_t r = 0; r < rounds; r++) {
+        // bit i of x<<<s is bit i-s of x
+        for (int i = 0; i < n; i++) {
+            Wire t = x[(i - 1 + n) % n];
+            t *= x[(i - 8 + n) % n];
+            y[i] += t;
+            y[i] += x[(i - 2 + n) % n];
+            y[i] += c.input();
+        }
+        swap(x, y);
+    }
+    for (int i = 0; i < n; i++) c.output(x[i]);
+    for (int i = 0; i < n; i++) c.output(y[i]);
+    return c;
+}
+
+// Runs circ, from simonCircuit, on ct with the round keys from key[first]
+// on. maxLive bounds the values held at once as for Circuit::evaluate.
+void evalRounds (const Circuit &circ, EncryptedArray &ea, const FHEPubKey &pubkey,
+                 const vector<CTvec> &key, size_t first, heblock &ct, size_t maxLive = 0);
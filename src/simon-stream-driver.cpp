@@ -0,0 +1,103 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Encrypts or decrypts a file or pipe with plaintext SIMON in constant
+// memory.
+//
+//   simon-stream -e [-m ecb|ctr] [-j THREADS] -k KEY [in [out]]
+//   simon-stream -d [-j THREADS] -k KEY [in [out]]
+//
+// KEY is 32 hex digits, the four key words k[0]..k[3]. in and out default
+// to stdin and stdout. -j splits CTR work across threads; 0 means one per
+// core.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include "simon-stream.h"
+#include "thread-pool.h"
+
+static void usage () {
+    cerr << "usage: simon-stream -e [-m ecb|ctr] [-j THREADS] -k KEY [in [out]]" << endl
+         << "       simon-stream -d [-j THREADS] -k KEY [in [out]]" << endl;
+    exit(2);
+}
+
+static bool parseKey (const char *s, vector<pt_key32> &k) {
+    if (strlen(s) != 32) return false;
+    for (int i = 0; i < 4; i++) {
+        char word[9];
+        memcpy(word, s + 8*i, 8);
+        word[8] = '\0';
+        char *end;
+        k.push_back(strtoul(word, &end, 16));
+        if (*end) return false;
+    }
+    return true;
+}
+
+static uint64_t randomIV () {
+    uint64_t iv = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, &iv, sizeof iv) != sizeof iv) {
+        iv = (uint64_t) time(NULL) << 32 ^ getpid();
+    }
+    if (fd >= 0) close(fd);
+    return iv;
+}
+
+int main(int argc, char **argv)
+{
+    int dir = 0;
+    pt_mode mode = PT_CTR;
+    vector<pt_key32> k;
+    long nthreads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "edm:j:k:")) != -1) {
+        switch (opt) {
+        case 'e': dir = 'e'; break;
+        case 'd': dir = 'd'; break;
+        case 'm':
+            if      (!strcmp(optarg, "ecb")) mode = PT_ECB;
+            else if (!strcmp(optarg, "ctr")) mode = PT_CTR;
+            else usage();
+            break;
+        case 'j': {
+            char *end;
+            nthreads = strtol(optarg, &end, 10);
+            if (!*optarg || *end || nthreads < 0) usage();
+            break;
+        }
+        case 'k':
+            if (!parseKey(optarg, k)) usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (!dir || k.size() != 4 || argc - optind > 2) usage();
+
+    int inpfd = 0, outfd = 1;
+    if (optind < argc && strcmp(argv[optind], "-")) {
+        inpfd = open(argv[optind], O_RDONLY);
+        if (inpfd < 0) { perror(argv[optind]); return 1; }
+    }
+    if (optind + 1 < argc && strcmp(argv[optind+1], "-")) {
+        outfd = open(argv[optind+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outfd < 0) { perror(argv[optind+1]); return 1; }
+    }
+
+    pt_schedule ks (k);
+    ThreadPool *pool = nthreads == 1 ? NULL : new ThreadPool(nthreads);
+    bool ok = dir == 'e' ? pt_streamEncrypt(ks, mode, randomIV(), inpfd, outfd, pool)
+                         : pt_streamDecrypt(ks, inpfd, outfd, pool);
+    delete pool;
+    if (outfd != 1 && close(outfd)) { perror("close"); ok = false; }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Streaming file encryption with the plaintext SIMON cipher.
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "simon-stream.h"
+#include "thread-pool.h"
+
+// Hands out the input a chunk at a time: windows of a mapping for regular
+// files, or a fixed buffer filled with read() for pipes and sockets.
+class ChunkSource {
+    int fd;
+    unsigned char *map;
+    size_t mapLen;
+    size_t pos;
+    size_t dropped;
+    vector<unsigned char> buf;
+public:
+    ChunkSource (int inpfd, size_t skip) : fd(inpfd), map(NULL), mapLen(0), pos(skip), dropped(0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                map = (unsigned char*) p;
+                mapLen = st.st_size;
+                madvise(map, mapLen, MADV_SEQUENTIAL);
+                return;
+            }
+        }
+        buf.resize(pt_streamChunk);
+    }
+
+    ~ChunkSource () {
+        if (map) munmap(map, mapLen);
+    }
+
+    // Points *p at up to pt_streamChunk bytes. Only the last chunk is
+    // short; 0 means end of input and -1 a read error.
+    ssize_t next (const unsigned char **p) {
+        if (map) {
+            if (pos > mapLen) return 0;
+            size_t n = min(pt_streamChunk, mapLen - pos);
+            // drop pages already consumed so resident memory stays flat
+            size_t done = pos & ~(size_t) 4095;
+            if (done > dropped) {
+                madvise(map + dropped, done - dropped, MADV_DONTNEED);
+                dropped = done;
+            }
+            *p = map + pos;
+            pos += n;
+            return n;
+        }
+        size_t n = 0;
+        while (n < buf.size()) {
+            ssize_t r = read(fd, &buf[n], buf.size() - n);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) return -1;
+            if (r == 0) break;
+            n += r;
+        }
+        *p = buf.data();
+        return n;
+    }
+};
+
+static bool writeAll (int fd, const unsigned char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+static bool readAll (int fd, unsigned char *p, size_t n) {
+    while (n) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static void ecbCrypt (const pt_schedule &ks, bool enc, const unsigned char *inp,
+                      unsigned char *out, size_t nblocks)
+{
+    const size_t batch = 256;
+    pt_block bs[batch];
+    while (nblocks) {
+        size_t n = min(batch, nblocks);
+        for (size_t i = 0; i < n; i++) bs[i] = pt_loadBlock(inp + 8*i);
+        if (enc) pt_encBlocks(ks, bs, n);
+        else     pt_decBlocks(ks, bs, n);
+        for (size_t i = 0; i < n; i++) pt_storeBlock(bs[i], out + 8*i);
+        inp += 8*n;
+        out += 8*n;
+        nblocks -= n;
+    }
+}
+
+static void fail (const char *what) {
+    cerr << "simon-stream: " << what;
+    if (errno) cerr << ": " << strerror(errno);
+    cerr << endl;
+}
+
+static void ctrCrypt (ThreadPool *pool, const pt_schedule &ks, uint64_t iv, uint64_t ctr,
+                      const unsigned char *inp, unsigned char *out, size_t len)
+{
+    if (pool) pt_ctrCryptParallel(*pool, ks, iv, ctr, inp, out, len);
+    else      pt_ctrCrypt(ks, iv, ctr, inp, out, len);
+}
+
+bool pt_streamEncrypt (const pt_schedule &ks, pt_mode mode, uint64_t iv, int inpfd, int outfd,
+                       ThreadPool *pool)
+{
+    unsigned char hdr[pt_streamHeaderSize] = { 'S', 'I', 'M', 'N', 1, (unsigned char) mode, 0, 0 };
+    for (int i = 0; i < 8; i++) hdr[8+i] = iv >> (56 - 8*i);
+    if (!writeAll(outfd, hdr, sizeof hdr)) { fail("write"); return false; }
+
+    ChunkSource src (inpfd, 0);
+    vector<unsigned char> out (pt_streamChunk + 8);
+    uint64_t ctr = 0;
+    for (;;) {
+        const unsigned char *p = NULL;
+        ssize_t n = src.next(&p);
+        if (n < 0) { fail("read"); return false; }
+        size_t len = n;
+        if (mode == PT_CTR) {
+            ctrCrypt(pool, ks, iv, ctr, p, out.data(), len);
+            ctr += len / 8;
+        } else {
+            // chunks are multiples of 8 except the last, which gets padded
+            size_t full = len / 8 * 8;
+            ecbCrypt(ks, true, p, out.data(), full / 8);
+            if (len < pt_streamChunk) {
+                unsigned char last[8];
+                unsigned char pad = 8 - (len - full);
+                memcpy(last, p + full, len - full);
+                memset(last + (len - full), pad, pad);
+                ecbCrypt(ks, true, last, out.data() + full, 1);
+                len = full + 8;
+            }
+        }
+        if (!writeAll(outfd, out.data(), len)) { fail("write"); return false; }
+        if (n < (ssize_t) pt_streamChunk) return true;
+    }
+}
+
+bool pt_streamDecrypt (const pt_schedule &ks, int inpfd, int outfd, ThreadPool *pool) {
+    unsigned char hdr[pt_streamHeaderSize];
+    errno = 0;
+    if (!readAll(inpfd, hdr, sizeof hdr)) { fail("truncated header"); return false; }
+    if (memcmp(hdr, "SIMN", 4) || hdr[4] != 1 || (hdr[5] != PT_ECB && hdr[5] != PT_CTR)) {
+        errno = 0;
+        fail("not a SIMON stream");
+        return false;
+    }
+    pt_mode mode = (pt_mode) hdr[5];
+    uint64_t iv = 0;
+    for (int i = 0; i < 8; i++) iv = iv << 8 | hdr[8+i];
+
+    // a mapped file still has the header in front of it
+    ChunkSource src (inpfd, lseek(inpfd, 0, SEEK_CUR) == (off_t) sizeof hdr ? sizeof hdr : 0);
+    vector<unsigned char> out (pt_streamChunk);
+    uint64_t ctr = 0;
+    // ECB keeps the most recent block back until we know whether it is the
+    // last one and carries padding
+    unsigned char held[8];
+    bool holding = false;
+    for (;;) {
+        const unsigned char *p = NULL;
+        ssize_t n = src.next(&p);
+        if (n < 0) { fail("read"); return false; }
+        size_t len = n;
+        if (mode == PT_CTR) {
+            ctrCrypt(pool, ks, iv, ctr, p, out.data(), len);
+            ctr += len / 8;
+            if (!writeAll(outfd, out.data(), len)) { fail("write"); return false; }
+        } else if (len) {
+            if (len % 8) { errno = 0; fail("ECB body is not a multiple of 8 bytes"); return false; }
+            if (holding && !writeAll(outfd, held, 8)) { fail("write"); return false; }
+            ecbCrypt(ks, false, p, out.data(), len / 8);
+            memcpy(held, out.data() + len - 8, 8);
+            holding = true;
+            if (!writeAll(outfd, out.data(), len - 8)) { fail("write"); return false; }
+        }
+        if (n < (ssize_t) pt_streamChunk) break;
+    }
+    if (mode == PT_ECB) {
+        unsigned char pad = holding ? held[7] : 0;
+        bool ok = pad >= 1 && pad <= 8;
+        for (int i = 8 - pad; ok && i < 8; i++) ok = held[i] == pad;
+        if (!ok) { errno = 0; fail("bad padding"); return false; }
+        if (!writeAll(outfd, held, 8 - pad)) { fail("write"); return false; }
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Streaming file encryption with the plaintext SIMON cipher. Input is
+// mmapped when it is a regular file and read in chunks otherwise; output is
+// written a chunk at a time, so memory use does not depend on input size.
+//
+// Stream format: a 16 byte header, then the body.
+//
+//   "SIMN" | version (1) | mode (1) | 0 0 | iv (8, big-endian)
+//
+// ECB bodies are PKCS#7 padded to a multiple of 8 bytes. CTR bodies are the
+// same length as the plaintext; block i is XORed with E(iv + i).
+
+#ifndef SIMONSTREAM_H
+#define SIMONSTREAM_H
+
+#include "simon-pt.h"
+
+enum pt_mode { PT_ECB = 1, PT_CTR = 2 };
+
+const size_t pt_streamHeaderSize = 16;
+const size_t pt_streamChunk      = 1 << 20;  // bytes, a multiple of 8
+
+// With a pool, CTR chunks are split across its threads.
+bool pt_streamEncrypt (const pt_schedule &ks, pt_mode mode, uint64_t iv, int inpfd, int outfd,
+                       ThreadPool *pool = NULL);
+
+// the mode and iv come from the header
+bool pt_streamDecrypt (const pt_schedule &ks, int inpfd, int outfd, ThreadPool *pool = NULL);
+
+#endif
@@ -0,0 +1,252 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Load generator for simon-transcipherd. Sends REQUESTS requests of BLOCKS
+// random blocks each, encrypted with plain SIMON 64/128, spread over CONNS
+// connections, and reports throughput and p50/p99 latency.
+//
+//   simon-transcipher-client [-n BLOCKS] [-r REQUESTS] [-c CONNS] [-k KEY]
+//                            [-i IV [-s START]] [-v] SOCKET
+//   simon-transcipher-client -S [-k KEY]
+//
+// The client holds the SIMON key, the test-vector key unless KEY (32 hex
+// digits) is given. With -S it only encrypts its schedule under the keys in
+// HE_CACHE, made there if need be, into the file HE_SCHEDULE names, for the
+// server to load.
+//
+// With IV the blocks are sent as SIMON-CTR ciphertext under that iv, with
+// counters from START on, for a server started with the same iv.
+//
+// With -v it also decrypts the HElib ciphertexts it gets back and checks
+// them against the blocks it sent. That needs the secret key, so HE_CACHE
+// must name the key cache the schedule was written under.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include "simon-simd.h"
+#include "simon-transcipher.h"
+
+size_t global_nslots;
+CTvec* global_maxint;
+
+typedef chrono::steady_clock Clock;
+
+struct Sent {
+    vector<pt_block> pt;        // before SIMON
+    size_t answered;
+    Clock::time_point start;
+};
+
+struct Totals {
+    atomic<uint64_t> counter;   // the next CTR counter to use
+    mutex mtx;
+    vector<double> latencies;
+    size_t blocks, verified, wrong;
+    bool failed;
+};
+
+// checks the blocks of one response against what was sent, one response
+// at a time since decryption already runs on the shared pool
+static void verify (HElibInstance &he, const TcResponse &r, const string &payload,
+                    const Sent &req, Totals &tot) {
+    static mutex verifyMtx;
+    lock_guard<mutex> vlk (verifyMtx);
+    istringstream is (payload);
+    vector<Ctxt> cts;
+    string tmp;
+    for (size_t i = 0; i < r.nctxts; i++) {
+        if (!ctxt_readRecord(is, he.pubkey(), cts, tmp)) break;
+    }
+    size_t wrong = r.count;
+    if (cts.size() == 64) {
+        vector<Ctxt> ys (cts.begin() + 32, cts.end());
+        cts.erase(cts.begin() + 32, cts.end());
+        heblock ct = { CTvec(he.ea(), he.pubkey(), move(cts), global_nslots),
+                       CTvec(he.ea(), he.pubkey(), move(ys), global_nslots) };
+        vector<simon64_128::block> bs = heDecrypt<simon64_128>(he.seckey(), ct);
+        wrong = 0;
+        for (size_t i = 0; i < r.count; i++) {
+            const simon64_128::block &b = bs[r.slot + i];
+            const pt_block &want = req.pt[r.first + i];
+            wrong += b.x != want.x || b.y != want.y;
+        }
+    }
+    lock_guard<mutex> lk (tot.mtx);
+    tot.verified += r.count - wrong;
+    tot.wrong    += wrong;
+}
+
+static void runConnection (const char *path, const pt_schedule &ks, const uint64_t *iv,
+                           size_t nreq, size_t nblocks, unsigned seed, HElibInstance *he,
+                           Totals &tot) {
+    int fd = tc_connect(path);
+    if (fd < 0) {
+        perror(path);
+        lock_guard<mutex> lk (tot.mtx);
+        tot.failed = true;
+        return;
+    }
+    vector<Sent> sent (nreq);
+    vector<unsigned char> buf (8 * nblocks);
+    vector<pt_block> ct (nblocks);
+    mt19937 rng (seed);
+    for (size_t i = 0; i < nreq; i++) {
+        sent[i].pt.resize(nblocks);
+        for (size_t b = 0; b < nblocks; b++) sent[i].pt[b] = { (uint32_t) rng(), (uint32_t) rng() };
+        TcRequest rq = { tc_requestMagic, (uint32_t) i, (uint32_t) nblocks, 0, 0 };
+        if (iv) {
+            for (size_t b = 0; b < nblocks; b++) pt_storeBlock(sent[i].pt[b], &buf[8*b]);
+            rq.flags   = tc_ctr;
+            rq.counter = tot.counter.fetch_add(nblocks);
+            pt_ctrCrypt(ks, *iv, rq.counter, buf.data(), buf.data(), buf.size());
+        } else {
+            ct = sent[i].pt;
+            pt_encBlocks(ks, ct.data(), ct.size());
+            for (size_t b = 0; b < nblocks; b++) pt_storeBlock(ct[b], &buf[8*b]);
+        }
+        sent[i].answered = 0;
+        sent[i].start = Clock::now();
+        if (!tc_writeAll(fd, &rq, sizeof rq) || !tc_writeAll(fd, buf.data(), buf.size())) break;
+    }
+
+    size_t done = 0;
+    string payload;
+    while (done < nreq) {
+        TcResponse r;
+        if (!tc_readAll(fd, &r, sizeof r) || r.magic != tc_responseMagic || r.id >= nreq) break;
+        payload.resize(r.bytes);
+        if (!tc_readAll(fd, &payload[0], payload.size())) break;
+        Sent &s = sent[r.id];
+        if (he) verify(*he, r, payload, s, tot);
+        s.answered += r.count;
+        if (s.answered == nblocks) {
+            double lat = chrono::duration<double>(Clock::now() - s.start).count();
+            lock_guard<mutex> lk (tot.mtx);
+            tot.latencies.push_back(lat);
+            tot.blocks += nblocks;
+            done++;
+        }
+    }
+    close(fd);
+    if (done < nreq) {
+        lock_guard<mutex> lk (tot.mtx);
+        cerr << "connection lost with " << nreq - done << " requests unanswered" << endl;
+        tot.failed = true;
+    }
+}
+
+static bool parseKey (const char *s, vector<pt_key32> &k) {
+    if (strlen(s) != 32) return false;
+    for (int i = 0; i < 4; i++) {
+        char word[9];
+        memcpy(word, s + 8*i, 8);
+        word[8] = '\0';
+        char *end;
+        k.push_back(strtoul(word, &end, 16));
+        if (*end) return false;
+    }
+    return true;
+}
+
+// The key owner's half of the setup: the encrypted schedule of k, which
+// the server loads with the public key alone.
+static int writeServerSchedule (vector<pt_key32> k) {
+    const char *schedFile = getenv("HE_SCHEDULE");
+    if (!schedFile || !*schedFile || !getenv("HE_CACHE")) {
+        cerr << "-S needs HE_CACHE for the keys and HE_SCHEDULE for the schedule" << endl;
+        return 2;
+    }
+    HElibInstance he (he_paramsFor("simon-simd", T, 0));
+    global_nslots = he.nslots();
+    const HEParams &ps = he.params();
+    CtxtFileParams params = { he.m(), ps.p, ps.r, ps.L, ps.c, (long) global_nslots };
+    pt_expandKey(k);
+    vector<CTvec> key = heEncrypt(he.ea(), he.pubkey(), k);
+    if (!writeSchedule(schedFile, params, he.pubkey(), tc_scheduleLabel, key)) {
+        cerr << "cannot write " << schedFile << endl;
+        return 1;
+    }
+    cout << "wrote the encrypted key schedule to " << schedFile << endl;
+    return 0;
+}
+
+static void usage () {
+    cerr << "usage: simon-transcipher-client [-n BLOCKS] [-r REQUESTS] [-c CONNS] [-k KEY] "
+            "[-i IV [-s START]] [-v] SOCKET" << endl
+         << "       simon-transcipher-client -S [-k KEY]" << endl;
+    exit(2);
+}
+
+int main (int argc, char **argv) {
+    size_t nblocks = 100, nreq = 10, nconn = 4;
+    bool check = false, ctr = false, owner = false;
+    vector<pt_key32> k;
+    uint64_t iv = 0, start = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:c:k:i:s:vS")) != -1) {
+        switch (opt) {
+        case 'i': iv = strtoull(optarg, NULL, 16); ctr = true; break;
+        case 's': start = strtoull(optarg, NULL, 0); break;
+        case 'n': nblocks = atol(optarg); break;
+        case 'r': nreq    = atol(optarg); break;
+        case 'c': nconn   = atol(optarg); break;
+        case 'k': if (!parseKey(optarg, k)) usage(); break;
+        case 'v': check = true; break;
+        case 'S': owner = true; break;
+        default:  usage();
+        }
+    }
+    if (k.empty()) k = { 0x1b1a1918, 0x13121110, 0x0b0a0908, 0x03020100 };
+    if (owner) {
+        if (optind != argc) usage();
+        return writeServerSchedule(k);
+    }
+    if (optind + 1 != argc || !nconn) usage();
+    const char *path = argv[optind];
+    pt_schedule ks (k);
+
+    unique_ptr<HElibInstance> he;
+    if (check) {
+        if (!getenv("HE_CACHE")) {
+            cerr << "-v needs the server's keys: set HE_CACHE to its cache" << endl;
+            return 2;
+        }
+        he.reset(new HElibInstance(he_paramsFor("simon-simd", T, 0), "", false));
+        if (!he->cached()) {
+            cerr << "no keys in " << getenv("HE_CACHE") << " for the server's parameters" << endl;
+            return 2;
+        }
+        global_nslots = he->nslots();
+    }
+
+    unsigned seed = time(NULL);
+    Totals tot;
+    tot.counter = start;
+    tot.blocks = tot.verified = tot.wrong = 0;
+    tot.failed = false;
+    Clock::time_point t0 = Clock::now();
+    vector<thread> conns;
+    for (size_t i = 0; i < nconn; i++) {
+        size_t n = nreq / nconn + (i < nreq % nconn);
+        conns.push_back(thread(runConnection, path, cref(ks), ctr ? &iv : NULL, n, nblocks,
+                               seed + i, he.get(), ref(tot)));
+    }
+    for (size_t i = 0; i < conns.size(); i++) conns[i].join();
+    double wall = chrono::duration<double>(Clock::now() - t0).count();
+
+    printf("%zu blocks in %zu requests over %zu connections, %.2f s, %.1f blocks/s\n",
+           tot.blocks, tot.latencies.size(), nconn, wall, wall > 0 ? tot.blocks / wall : 0);
+    printf("latency p50 %.3f s p99 %.3f s\n", tc_quantile(tot.latencies, 0.5),
+           tc_quantile(tot.latencies, 0.99));
+    if (check) printf("verified %zu blocks, %zu wrong\n", tot.verified, tot.wrong);
+    return tot.failed || tot.wrong ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// Socket plumbing shared by simon-transcipherd and its client.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "simon-transcipher.h"
+
+bool tc_readAll (int fd, void *buf, size_t n) {
+    char *p = (char*) buf;
+    while (n) {
+        ssize_t k = read(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+bool tc_writeAll (int fd, const void *buf, size_t n) {
+    const char *p = (const char*) buf;
+    while (n) {
+        // a client that hung up must not kill the server with SIGPIPE
+        ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+static bool socketAddr (const string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) return false;
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+int tc_listen (const string &path) {
+    sockaddr_un addr;
+    if (!socketAddr(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (!lstat(path.c_str(), &st) && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+    if (bind(fd, (sockaddr*) &addr, sizeof addr) || listen(fd, 64)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int tc_connect (const string &path) {
+    sockaddr_un addr;
+    if (!socketAddr(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*) &addr, sizeof addr)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+double tc_quantile (vector<double> &xs, double q) {
+    if (xs.empty()) return 0;
+    sort(xs.begin(), xs.end());
+    size_t i = min(xs.size() - 1, (size_t) (q * xs.size()));
+    return xs[i];
+}
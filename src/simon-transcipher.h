@@ -0,0 +1,83 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// The wire format of simon-transcipherd, which turns blocks encrypted with
+// plain SIMON 64/128 into HElib ciphertexts of the same blocks, and of its
+// client. Frames go over a Unix stream socket, fixed-width and
+// little-endian.
+//
+// Requests, client to server:
+//
+//   TcRequest | nblocks blocks of 8 bytes, big-endian as pt_storeBlock
+//
+// The blocks are SIMON ciphertexts, or with tc_ctr in flags the CTR
+// ciphertext of blocks counter, counter+1, ... of a stream under the iv the
+// server was started with, as simon-stream writes it.
+//
+// Responses, one or more per request. The server batches blocks from all
+// connections into the slots of one heblock, so a request may be split
+// over several batches and its blocks answered out of order:
+//
+//   TcResponse | nctxts records as in ctxt-file.h
+//
+// Blocks first .. first+count-1 of the request sit in slots slot ..
+// slot+count-1 of the batch. The records are the bits of x, bit 0 first,
+// then those of y, and are the same for every request in the batch. A
+// request is done when the counts of its responses add up to nblocks.
+//
+// CTR requests skip the queue: each is answered from the precomputed
+// keystream batches its counters fall in, one response per keystream
+// batch, with the records made for that request alone.
+
+#ifndef SIMONTRANSCIPHER_H
+#define SIMONTRANSCIPHER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const uint32_t tc_requestMagic  = 0x51524354;     // "TCRQ"
+const uint32_t tc_responseMagic = 0x53524354;     // "TCRS"
+
+const uint32_t tc_ctr = 1;
+
+// The label of the encrypted key schedule the server runs under. The key
+// owner writes the file with simon-transcipher-client -S; the server only
+// reads it, with the public key.
+const char *const tc_scheduleLabel = "SIMON 64/128 transcipher key schedule";
+
+struct TcRequest {
+    uint32_t magic;
+    uint32_t id;                // chosen by the client, echoed back
+    uint32_t nblocks;
+    uint32_t flags;
+    uint64_t counter;
+};
+
+struct TcResponse {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t first;
+    uint32_t count;
+    uint32_t slot;
+    uint32_t nctxts;
+    uint64_t bytes;             // of the records
+};
+
+// whole reads and writes, retrying short ones; false on EOF or error
+bool tc_readAll (int fd, void *buf, size_t n);
+bool tc_writeAll (int fd, const void *buf, size_t n);
+
+// a listening socket at path, replacing a stale socket there; -1 on error
+int tc_listen (const string &path);
+
+int tc_connect (const string &path);
+
+// the q-quantile of xs, which it sorts
+double tc_quantile (vector<double> &xs, double q);
+
+#endif
@@ -0,0 +1,411 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// A transciphering server: clients send blocks encrypted with plain SIMON
+// 64/128, which is cheap, and get back HElib ciphertexts of the same blocks,
+// made by running SIMON decryption homomorphically under the encrypted key
+// schedule.
+//
+//   simon-transcipherd [-d DEADLINE] [-i IV [-s START] [-a AHEAD] [-D DIR]] SOCKET
+//
+// The server never sees the SIMON key. The key owner encrypts its schedule
+// with simon-transcipher-client -S into the file HE_SCHEDULE names, under
+// the keys in HE_CACHE, and the server loads it with the public key alone;
+// the file's header checks the context, public key and label. The context
+// and schedule are set up once and kept. Requests from all connections
+// queue up, and a batch runs as soon as its blocks fill every slot of an
+// heblock, or DEADLINE seconds (default 1) after the oldest queued request
+// came in. After each batch the server prints throughput and p50/p99
+// request latency; SIGINT or SIGTERM finishes the batch in flight and
+// exits. The wire format is in simon-transcipher.h.
+//
+// With IV (16 hex digits) the server also takes SIMON-CTR ciphertext under
+// that iv. Its keystream does not depend on the data, so AHEAD batches of
+// it (default 2) from counter START on are computed in the background, and
+// a CTR request only costs one addConstant per bit of each batch it
+// touches. With DIR the batches wait in files there, bounded the same way,
+// and survive restarts; see simon-keystream.h.
+
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "simon-keystream.h"
+#include "simon-transcipher.h"
+
+size_t global_nslots;
+CTvec* global_maxint;
+
+typedef chrono::steady_clock Clock;
+
+const uint32_t maxRequestBlocks = 1 << 20;
+
+struct Conn {
+    int fd;
+    mutex writeMtx;             // responses are written whole
+    explicit Conn (int fd) : fd(fd) {}
+    ~Conn () { close(fd); }
+};
+
+struct Request {
+    shared_ptr<Conn> conn;
+    uint32_t id;
+    vector<pt_block> blocks;
+    size_t taken;               // blocks handed to batches so far
+    size_t answered;
+    Clock::time_point arrival;
+};
+
+// a run of one request's blocks in a batch
+struct Piece {
+    shared_ptr<Request> req;
+    size_t first, count, slot;
+};
+
+static mutex queueMtx;
+static condition_variable queueCv;
+static deque<shared_ptr<Request>> queue;
+static size_t queuedBlocks;
+static bool stopping;
+
+static volatile sig_atomic_t gotSignal;
+
+static void onSignal (int) {
+    gotSignal = 1;
+}
+
+// Runs f with every signal blocked, so threads it starts leave them all to
+// the accept loop.
+template <typename F>
+static void signalsBlocked (F f) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    f();
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+template <typename F>
+static thread spawn (F f) {
+    thread t;
+    signalsBlocked([&] { t = thread(f); });
+    return t;
+}
+
+struct Stats {
+    size_t batches, blocks, requests;
+    Clock::time_point start;    // of the first request
+    bool started;
+    vector<double> latencies;   // seconds, per finished request
+};
+
+// the batcher and the CTR requests on the connection threads add to it
+static mutex statsMtx;
+static Stats stats = { 0, 0, 0, Clock::time_point(), false, {} };
+
+// nblocks of a request that came in at arrival were answered, and with
+// done that was the last of them
+static void served (Clock::time_point arrival, size_t nblocks, bool done) {
+    lock_guard<mutex> lk (statsMtx);
+    if (!stats.started || arrival < stats.start) {
+        stats.start   = arrival;
+        stats.started = true;
+    }
+    stats.blocks += nblocks;
+    if (done) {
+        double lat = chrono::duration<double>(Clock::now() - arrival).count();
+        stats.latencies.push_back(lat);
+        metrics_observe("latency", lat);
+        stats.requests++;
+    }
+}
+
+static void printStats (const char *prefix) {
+    lock_guard<mutex> lk (statsMtx);
+    double wall = chrono::duration<double>(Clock::now() - stats.start).count();
+    vector<double> ls (stats.latencies);
+    printf("%s%zu blocks in %zu requests, %.1f blocks/s, latency p50 %.3f s p99 %.3f s\n",
+           prefix, stats.blocks, stats.requests, wall > 0 ? stats.blocks / wall : 0,
+           tc_quantile(ls, 0.5), tc_quantile(ls, 0.99));
+    fflush(stdout);
+}
+
+static EncryptedArray *ctrEa;
+static KeystreamCache *ctrCache;
+
+static string serialize (const heblock &ct, uint32_t &nctxts) {
+    ostringstream os, tmp;
+    vector<Ctxt> xs = ct.x.ctxts(), ys = ct.y.ctxts();
+    for (size_t i = 0; i < xs.size(); i++) ctxt_writeRecord(os, xs[i], tmp);
+    for (size_t i = 0; i < ys.size(); i++) ctxt_writeRecord(os, ys[i], tmp);
+    nctxts = xs.size() + ys.size();
+    return os.str();
+}
+
+// The online half of CTR: the keystream of each batch the counters fall
+// in plus the encoded ciphertext, on this connection's thread.
+static bool answerCtr (Conn &conn, const TcRequest &rq, const vector<pt_block> &blocks,
+                       Clock::time_point arrival) {
+    size_t nslots = global_nslots;
+    for (size_t first = 0; first < blocks.size();) {
+        uint64_t ctr  = rq.counter + first;
+        uint64_t b    = ctr / nslots;
+        size_t slot   = ctr % nslots;
+        size_t count  = min(blocks.size() - first, nslots - slot);
+        heblock ct = *ctrCache->get(b);
+        ctrAddBlocks(*ctrEa, ct, vector<pt_block>(&blocks[first], &blocks[first] + count), slot);
+        ctrCache->used(b, count);
+        uint32_t nctxts;
+        string payload = serialize(ct, nctxts);
+        TcResponse r = { tc_responseMagic, rq.id, (uint32_t) first, (uint32_t) count,
+                         (uint32_t) slot, nctxts, payload.size() };
+        {
+            lock_guard<mutex> lk (conn.writeMtx);
+            if (!tc_writeAll(conn.fd, &r, sizeof r)) return false;
+            if (!tc_writeAll(conn.fd, payload.data(), payload.size())) return false;
+        }
+        first += count;
+        served(arrival, count, first == blocks.size());
+    }
+    return true;
+}
+
+static void readRequests (shared_ptr<Conn> conn) {
+    TcRequest rq;
+    vector<unsigned char> buf;
+    while (tc_readAll(conn->fd, &rq, sizeof rq)) {
+        if (rq.magic != tc_requestMagic || rq.nblocks > maxRequestBlocks) {
+            cerr << "bad request on fd " << conn->fd << ", dropping the connection" << endl;
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+        if ((rq.flags & tc_ctr) && !ctrCache) {
+            cerr << "CTR request, but no iv was given; dropping the connection" << endl;
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+        buf.resize(8 * (size_t) rq.nblocks);
+        if (!tc_readAll(conn->fd, buf.data(), buf.size())) return;
+        shared_ptr<Request> req (new Request { conn, rq.id, {}, 0, 0, Clock::now() });
+        req->blocks.resize(rq.nblocks);
+        for (size_t i = 0; i < rq.nblocks; i++) req->blocks[i] = pt_loadBlock(&buf[8*i]);
+        if ((rq.flags & tc_ctr) && !req->blocks.empty()) {
+            if (!answerCtr(*conn, rq, req->blocks, req->arrival)) return;
+            continue;
+        }
+        if (req->blocks.empty()) {
+            TcResponse r = { tc_responseMagic, rq.id, 0, 0, 0, 0, 0 };
+            lock_guard<mutex> lk (conn->writeMtx);
+            tc_writeAll(conn->fd, &r, sizeof r);
+            continue;
+        }
+        lock_guard<mutex> lk (queueMtx);
+        queue.push_back(req);
+        queuedBlocks += req->blocks.size();
+        queueCv.notify_one();
+    }
+}
+
+// Waits for a full batch or the deadline of the oldest request, and takes
+// the blocks for it off the queue. Empty when stopping.
+static vector<Piece> nextBatch (size_t nslots, Clock::duration deadline, bool &full) {
+    unique_lock<mutex> lk (queueMtx);
+    queueCv.wait(lk, [] { return stopping || !queue.empty(); });
+    while (!stopping && queuedBlocks < nslots) {
+        if (queueCv.wait_until(lk, queue.front()->arrival + deadline) == cv_status::timeout) break;
+    }
+    vector<Piece> pieces;
+    if (stopping) return pieces;
+    full = queuedBlocks >= nslots;
+    size_t slot = 0;
+    while (slot < nslots && !queue.empty()) {
+        shared_ptr<Request> req = queue.front();
+        size_t n = min(nslots - slot, req->blocks.size() - req->taken);
+        pieces.push_back({ req, req->taken, n, slot });
+        req->taken  += n;
+        queuedBlocks -= n;
+        slot += n;
+        if (req->taken == req->blocks.size()) queue.pop_front();
+    }
+    return pieces;
+}
+
+// SIMON decryption of the batch under the encrypted key, as records of the
+// bits of x then y
+static string transcipher (EncryptedArray &ea, const FHEPubKey &pubkey, vector<CTvec> &key,
+                           const vector<Piece> &pieces, uint32_t &nctxts) {
+    vector<simon64_128::block> bs;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        const vector<pt_block> &src = pieces[i].req->blocks;
+        for (size_t j = pieces[i].first; j < pieces[i].first + pieces[i].count; j++) {
+            bs.push_back({ src[j].x, src[j].y });
+        }
+    }
+    MetricScope enc ("encrypt");
+    heblock ct = heEncrypt<simon64_128>(ea, pubkey, bs);
+    enc.stop();
+    for (size_t i = T; i-- > 0;) {
+        MetricScope round ("round");
+        // the schedule stays at the levels the first batch needed, which
+        // every later batch needs too
+        scheduleLevels(ct, key[i]);
+        decRound(key[i], ct);
+    }
+    MetricScope ser ("serialize");
+    return serialize(ct, nctxts);
+}
+
+static void runBatches (EncryptedArray &ea, const FHEPubKey &pubkey, vector<CTvec> &key,
+                        Clock::duration deadline) {
+    for (size_t nbatch = 1;; nbatch++) {
+        bool full = false;
+        vector<Piece> pieces = nextBatch(global_nslots, deadline, full);
+        if (pieces.empty()) return;
+        MetricScope batch ("batch");
+        uint64_t t0 = metrics_now();
+        uint32_t nctxts;
+        string payload = transcipher(ea, pubkey, key, pieces, nctxts);
+        size_t nblocks = 0;
+        for (size_t i = 0; i < pieces.size(); i++) {
+            const Piece &p = pieces[i];
+            TcResponse r = { tc_responseMagic, p.req->id, (uint32_t) p.first, (uint32_t) p.count,
+                             (uint32_t) p.slot, nctxts, payload.size() };
+            Conn &conn = *p.req->conn;
+            {
+                // a client that went away loses its answers, nothing else
+                lock_guard<mutex> lk (conn.writeMtx);
+                if (tc_writeAll(conn.fd, &r, sizeof r)) {
+                    tc_writeAll(conn.fd, payload.data(), payload.size());
+                }
+            }
+            nblocks += p.count;
+            p.req->answered += p.count;
+            served(p.req->arrival, p.count, p.req->answered == p.req->blocks.size());
+        }
+        batch.stop();
+        metrics_observe("batch blocks", nblocks);
+        printf("batch %zu: %zu blocks (%.0f%% of slots) from %zu pieces, %s, %.2f s\n",
+               nbatch, nblocks, 100.0 * nblocks / global_nslots, pieces.size(),
+               full ? "full" : "deadline", (metrics_now() - t0) * 1e-9);
+        printStats("  total: ");
+    }
+}
+
+static void usage () {
+    cerr << "usage: simon-transcipherd [-d DEADLINE] [-i IV [-s START] [-a AHEAD] [-D DIR]] "
+            "SOCKET" << endl;
+    exit(2);
+}
+
+int main (int argc, char **argv) {
+    double deadline = 1;
+    const char *iv = NULL, *dir = "";
+    uint64_t start = 0;
+    size_t ahead = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:s:a:D:")) != -1) {
+        switch (opt) {
+        case 'd': deadline = atof(optarg); break;
+        case 'i': iv = optarg; break;
+        case 's': start = strtoull(optarg, NULL, 0); break;
+        case 'a': ahead = atol(optarg); break;
+        case 'D': dir = optarg; break;
+        default:  usage();
+        }
+    }
+    if (optind + 1 != argc || deadline < 0) usage();
+    const char *path = argv[optind];
+    const char *schedFile = getenv("HE_SCHEDULE");
+    if (!schedFile || !*schedFile) {
+        cerr << "set HE_SCHEDULE to the encrypted key schedule; simon-transcipher-client -S "
+                "writes it" << endl;
+        return 2;
+    }
+
+    MetricScope setup ("setup");
+    // one AND per round
+    HElibInstance he (he_paramsFor("simon-simd", T, 0));
+    EncryptedArray &ea = he.ea();
+    const FHEPubKey &pubkey = he.pubkey();
+    global_nslots = he.nslots();
+    setup.stop();
+
+    cout << "Loading SIMON key schedule..." << flush;
+    MetricScope loadKey ("load key", true);
+    const HEParams &ps = he.params();
+    CtxtFileParams params = { he.m(), ps.p, ps.r, ps.L, ps.c, (long) global_nslots };
+    vector<CTvec> key;
+    string err;
+    if (!readSchedule(schedFile, params, ea, pubkey, tc_scheduleLabel, key, err)
+            || key.size() != T) {
+        cerr << (err.empty() ? string(schedFile) + " does not hold " + to_string(T) + " round keys"
+                             : err) << endl;
+        return 1;
+    }
+    loadKey.stop();
+
+    unique_ptr<KeystreamCache> cache;
+    if (iv) {
+        ctrEa = &ea;
+        signalsBlocked([&] {
+            cache.reset(new KeystreamCache(ea, pubkey, key, strtoull(iv, NULL, 16),
+                                           start / global_nslots, ahead, dir, params));
+        });
+        ctrCache = cache.get();
+        cout << "CTR keystream for iv " << iv << ", " << ahead << " batches ahead from counter "
+             << start << endl;
+    }
+
+    int lfd = tc_listen(path);
+    if (lfd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = onSignal;
+    sa.sa_flags   = SA_RESETHAND;   // no SA_RESTART, so accept returns; twice kills
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    Clock::duration dl = chrono::duration_cast<Clock::duration>(chrono::duration<double>(deadline));
+    thread batcher = spawn([&] { runBatches(ea, pubkey, key, dl); });
+    cout << "listening on " << path << ", " << global_nslots << " blocks per batch" << endl;
+
+    while (!gotSignal) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) continue;
+        shared_ptr<Conn> conn (new Conn(fd));
+        spawn([conn] { readRequests(conn); }).detach();
+    }
+
+    cout << "stopping after the batch in flight" << endl;
+    {
+        lock_guard<mutex> lk (queueMtx);
+        stopping = true;
+        queueCv.notify_all();
+    }
+    batcher.join();
+    close(lfd);
+    unlink(path);
+    printStats("served ");
+    if (cache) {
+        KeystreamCache::Stats cs = cache->stats();
+        printf("keystream: %zu batches computed, %zu loaded; requests found %zu ready, waited for "
+               "%zu, computed %zu\n", cs.computed, cs.loaded, cs.hits, cs.waits, cs.misses);
+    }
+    // Left to exit rather than destroyed: its worker may be deep in a batch,
+    // and connection threads may still be using it.
+    cache.release();
+    return 0;
+}
@@ -6,15 +6,28 @@
 // This file contains mostly data mangling functions for use in simon-blocks
 // and simon-simd.
 
+#include <algorithm>
+#include <cassert>
 #include "simon-util.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define UTIL_X86 1
+#include <immintrin.h>
+#endif
+
+// a trailing partial block is padded with zeroes
 vector<pt_block> strToBlocks (string inp) {
     vector<pt_block> blocks;
-    for (uint32_t i = 0; i < inp.size(); i += 8) {
-        uint32_t x = inp[i]   << 24 | inp[i+1] << 16 | inp[i+2] << 8 | inp[i+3];
-        uint32_t y = inp[i+4] << 24 | inp[i+5] << 16 | inp[i+6] << 8 | inp[i+7];
-        pt_block b = { x, y };
-        blocks.push_back(b);
+    blocks.reserve((inp.size() + 7) / 8);
+    const unsigned char *p = (const unsigned char*) inp.data();
+    size_t i = 0;
+    for (; i + 8 <= inp.size(); i += 8) {
+        blocks.push_back(pt_loadBlock(p + i));
+    }
+    if (i < inp.size()) {
+        unsigned char last[8] = { 0 };
+        copy(p + i, p + inp.size(), last);
+        blocks.push_back(pt_loadBlock(last));
     }
     return blocks;
 }
@@ -50,10 +63,130 @@ vector<vector<long>> keyToVectors (vector<uint32_t> key, long nslots) {
     return ret;
 }
 
+void keyToSlots (const vector<uint32_t> &key, size_t nslots, vector<SlotBuffer> &out) {
+    out.resize(key.size());
+    for (size_t i = 0; i < key.size(); i++) {
+        out[i].reset(nslots);
+        out[i].setWord(0, key[i], 32);
+    }
+}
+
 vector<long> uint32ToBits (uint32_t n) {
-    vector<long> ret;
-    for (int i = 0; i < 32; i++) {
-        ret.push_back((n & (1 << i)) >> i);
+    return wordToBits(n, 32);
+}
+
+// the low nbits bits of n, least significant first
+vector<long> wordToBits (uint64_t n, size_t nbits) {
+    vector<long> ret (nbits);
+    for (size_t i = 0; i < nbits; i++) {
+        ret[i] = (n >> i) & 1;
+    }
+    return ret;
+}
+
+uint64_t bitsToWord (const vector<long> &inp) {
+    uint64_t ret = 0;
+    for (size_t i = 0; i < inp.size(); i++) {
+        ret |= (uint64_t) (inp[i] & 1) << i;
+    }
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bit-matrix transpose
+
+// One butterfly stage: swap the high j bits of a[k] with the low j bits of
+// a[k|j] for every k with bit j clear.
+static inline void transposeStage (uint64_t a[64], int j, uint64_t m) {
+    for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+        uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+        a[k]     ^= t << j;
+        a[k | j] ^= t;
+    }
+}
+
+static void transpose64Portable (uint64_t a[64]) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    for (int j = 32; j; j >>= 1, m ^= m << j) {
+        transposeStage(a, j, m);
+    }
+}
+
+#ifdef UTIL_X86
+// For j >= 4 the k with bit j clear come in runs of at least 4, so those
+// stages go 4 words per instruction. The last two stages stay scalar.
+__attribute__((target("avx2")))
+static void transpose64AVX2 (uint64_t a[64]) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    int j = 32;
+    for (; j >= 4; j >>= 1, m ^= m << j) {
+        __m256i vm = _mm256_set1_epi64x(m);
+        for (int base = 0; base < 64; base += 2 * j) {
+            for (int k = base; k < base + j; k += 4) {
+                __m256i lo = _mm256_loadu_si256((const __m256i*) &a[k]);
+                __m256i hi = _mm256_loadu_si256((const __m256i*) &a[k + j]);
+                __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(lo, j), hi), vm);
+                _mm256_storeu_si256((__m256i*) &a[k],     _mm256_xor_si256(lo, _mm256_slli_epi64(t, j)));
+                _mm256_storeu_si256((__m256i*) &a[k + j], _mm256_xor_si256(hi, t));
+            }
+        }
+    }
+    for (; j; j >>= 1, m ^= m << j) {
+        transposeStage(a, j, m);
+    }
+}
+#endif
+
+typedef void (*transposeFn)(uint64_t*);
+
+static transposeFn chooseTranspose () {
+#ifdef UTIL_X86
+    if (__builtin_cpu_supports("avx2")) return transpose64AVX2;
+#endif
+    return transpose64Portable;
+}
+
+void transpose64 (uint64_t a[64]) {
+    static const transposeFn f = chooseTranspose();
+    f(a);
+}
+
+// Bit slicing: row i holds bit i of every word. Words go through transpose64
+// 64 at a time, so each tile is read once and each row written once.
+vector<vector<long>> wordsToSlices (const vector<uint64_t> &ws, size_t nbits) {
+    assert(nbits <= 64);
+    vector<vector<long>> ret (nbits, vector<long>(ws.size()));
+    uint64_t a[64];
+    for (size_t j0 = 0; j0 < ws.size(); j0 += 64) {
+        size_t nw = min<size_t>(64, ws.size() - j0);
+        copy(&ws[j0], &ws[j0] + nw, a);
+        fill(a + nw, a + 64, 0);
+        transpose64(a);
+        for (size_t i = 0; i < nbits; i++) {
+            long *row = &ret[i][j0];
+            uint64_t w = a[i];
+            for (size_t c = 0; c < nw; c++) row[c] = (w >> c) & 1;
+        }
+    }
+    return ret;
+}
+
+vector<uint64_t> slicesToWords (const vector<vector<long>> &inp) {
+    assert(inp.size() <= 64);
+    size_t n = inp.empty() ? 0 : inp[0].size();
+    vector<uint64_t> ret (n);
+    uint64_t a[64];
+    for (size_t j0 = 0; j0 < n; j0 += 64) {
+        size_t nw = min<size_t>(64, n - j0);
+        fill(a, a + 64, 0);
+        for (size_t i = 0; i < inp.size(); i++) {
+            const long *row = &inp[i][j0];
+            uint64_t w = 0;
+            for (size_t c = 0; c < nw; c++) w |= (uint64_t) (row[c] & 1) << c;
+            a[i] = w;
+        }
+        transpose64(a);
+        copy(a, a + nw, &ret[j0]);
     }
     return ret;
 }
@@ -94,6 +227,15 @@ vector<vector<long>> strToVectors (string inp) {
     return ret;
 }
 
+void strToSlots (const string &inp, size_t nslots, vector<SlotBuffer> &out) {
+    vector<pt_block> bs = strToBlocks(inp);
+    out.resize(2 * bs.size());
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i].reset(nslots);
+        out[i].setWord(0, i % 2 ? bs[i/2].y : bs[i/2].x, 32);
+    }
+}
+
 string vectorsToStr (vector<vector<long>> inp){
     // takes a vector of vectors where each long is 0 or 1. turns it into a string.
     string ret;
@@ -155,31 +297,157 @@ vector<pt_block> vectorsToBlocks (vector<vector<long>> inp) {
     return res;
 }
 
-vector<vector<long>> transpose (vector<vector<long>> inp) {
-    vector<vector<long>> xs;
-    for (uint32_t i = 0; i < inp[0].size(); i++) {
-        vector<long> nextx;
-        for (uint32_t j = 0; j < inp.size(); j++) {
-            nextx.push_back(inp[j][i]);
+vector<vector<long>> transpose (const vector<vector<long>> &inp) {
+    vector<vector<long>> xs (inp[0].size(), vector<long>(inp.size()));
+    for (size_t j = 0; j < inp.size(); j++) {
+        for (size_t i = 0; i < inp[j].size(); i++) {
+            xs[i][j] = inp[j][i];
         }
-        xs.push_back(nextx);
     }
     return xs;
 }
 
-vector<vector<long>> transpose (vector<long> inp) {
-    vector<vector<long>> vec ({ inp });
-    return transpose(vec);
+vector<vector<long>> transpose (const vector<long> &inp) {
+    vector<vector<long>> xs (inp.size(), vector<long>(1));
+    for (size_t i = 0; i < inp.size(); i++) xs[i][0] = inp[i];
+    return xs;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// packed slot buffers
+
+vector<uint64_t> SlotArena::take (size_t nwords) {
+    vector<uint64_t> w;
+    if (!spare.empty()) {
+        w.swap(spare.back());
+        spare.pop_back();
+    }
+    w.assign(nwords, 0);
+    return w;
+}
+
+void SlotArena::give (vector<uint64_t> &&words) {
+    if (words.capacity() == 0 || spare.size() >= 4096) return;
+    spare.push_back(move(words));
+}
+
+SlotArena& SlotArena::local () {
+    static thread_local SlotArena arena;
+    return arena;
+}
+
+SlotBuffer::SlotBuffer (size_t n) : words(SlotArena::local().take((n + 63) / 64)), nslots(n) {}
+
+SlotBuffer::~SlotBuffer () { SlotArena::local().give(move(words)); }
+
+SlotBuffer::SlotBuffer (SlotBuffer &&other) : words(move(other.words)), nslots(other.nslots) {
+    other.nslots = 0;
+}
+
+SlotBuffer& SlotBuffer::operator= (SlotBuffer &&other) {
+    words.swap(other.words);
+    swap(nslots, other.nslots);
+    return *this;
+}
+
+SlotBuffer::SlotBuffer (const SlotBuffer &other)
+    : words(SlotArena::local().take(other.words.size())), nslots(other.nslots)
+{
+    copy(other.words.begin(), other.words.end(), words.begin());
+}
+
+SlotBuffer& SlotBuffer::operator= (const SlotBuffer &other) {
+    words.assign(other.words.begin(), other.words.end());
+    nslots = other.nslots;
+    return *this;
 }
 
-void timer(bool init) {
-    static time_t old_time;
-    static time_t new_time;
-    if (!init) {
-        old_time = new_time;
+void SlotBuffer::reset (size_t n) {
+    words.assign((n + 63) / 64, 0);
+    nslots = n;
+}
+
+void SlotBuffer::fill (long bit) {
+    std::fill(words.begin(), words.end(), (bit & 1) ? ~(uint64_t) 0 : 0);
+    if (nslots % 64) words.back() &= ((uint64_t) 1 << (nslots % 64)) - 1;
+}
+
+void SlotBuffer::setWord (size_t at, uint64_t w, size_t nbits) {
+    assert(nbits <= 64 && at + nbits <= nslots);
+    if (nbits == 0) return;
+    uint64_t m = nbits == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << nbits) - 1;
+    w &= m;
+    size_t i = at / 64, o = at % 64;
+    words[i] = (words[i] & ~(m << o)) | w << o;
+    if (o && o + nbits > 64) {
+        words[i+1] = (words[i+1] & ~(m >> (64 - o))) | w >> (64 - o);
+    }
+}
+
+uint64_t SlotBuffer::getWord (size_t at, size_t nbits) const {
+    assert(nbits <= 64 && at + nbits <= nslots);
+    if (nbits == 0) return 0;
+    uint64_t m = nbits == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << nbits) - 1;
+    size_t i = at / 64, o = at % 64;
+    uint64_t w = words[i] >> o;
+    if (o && o + nbits > 64) w |= words[i+1] << (64 - o);
+    return w & m;
+}
+
+const vector<long>& SlotBuffer::slots () const {
+    static thread_local vector<long> scratch;
+    scratch.resize(nslots);
+    long *p = scratch.data();
+    for (size_t i = 0; i < words.size(); i++) {
+        uint64_t w = words[i];
+        size_t nb = min<size_t>(64, nslots - 64 * i);
+        for (size_t c = 0; c < nb; c++) p[64*i + c] = (w >> c) & 1;
+    }
+    return scratch;
+}
+
+void SlotBuffer::assign (const vector<long> &inp) {
+    reset(inp.size());
+    for (size_t i = 0; i < words.size(); i++) {
+        size_t nb = min<size_t>(64, nslots - 64 * i);
+        const long *p = &inp[64*i];
+        uint64_t w = 0;
+        for (size_t c = 0; c < nb; c++) w |= (uint64_t) (p[c] & 1) << c;
+        words[i] = w;
+    }
+}
+
+SlotBuffer wordToSlots (uint64_t n, size_t nbits, size_t nslots) {
+    SlotBuffer b (nslots);
+    b.setWord(0, n, nbits);
+    return b;
+}
+
+void wordsToSlices (const vector<uint64_t> &ws, size_t nbits, size_t nslots, vector<SlotBuffer> &out) {
+    assert(nbits <= 64 && ws.size() <= nslots);
+    out.resize(nbits);
+    for (size_t i = 0; i < nbits; i++) out[i].reset(nslots);
+    uint64_t a[64];
+    for (size_t j0 = 0; j0 < ws.size(); j0 += 64) {
+        size_t nw = min<size_t>(64, ws.size() - j0);
+        copy(&ws[j0], &ws[j0] + nw, a);
+        std::fill(a + nw, a + 64, 0);
+        transpose64(a);
+        for (size_t i = 0; i < nbits; i++) out[i].data()[j0/64] = a[i];
     }
-    new_time = time(NULL);
-    if (!init) {
-        cout << (new_time - old_time) << "s" << endl;
+}
+
+vector<uint64_t> slicesToWords (const vector<SlotBuffer> &inp, size_t n) {
+    assert(inp.size() <= 64);
+    vector<uint64_t> ret (n);
+    uint64_t a[64];
+    for (size_t j0 = 0; j0 < n; j0 += 64) {
+        size_t nw = min<size_t>(64, n - j0);
+        uint64_t m = nw == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << nw) - 1;
+        std::fill(a, a + 64, 0);
+        for (size_t i = 0; i < inp.size(); i++) a[i] = inp[i].data()[j0/64] & m;
+        transpose64(a);
+        copy(a, a + nw, &ret[j0]);
     }
+    return ret;
 }
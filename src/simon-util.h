@@ -28,6 +28,18 @@ vector<long> charToBits (char c);
 
 vector<long> uint32ToBits (uint32_t n);
 
+vector<long> wordToBits (uint64_t n, size_t nbits);
+
+uint64_t bitsToWord (const vector<long> &inp);
+
+// in-place 64x64 bit transpose: afterwards bit c of a[r] is bit r of the
+// old a[c]. Uses AVX2 when the CPU has it.
+void transpose64 (uint64_t a[64]);
+
+vector<vector<long>> wordsToSlices (const vector<uint64_t> &ws, size_t nbits);
+
+vector<uint64_t> slicesToWords (const vector<vector<long>> &inp);
+
 void pad (long padWith, vector<long> &inp, long length);
 
 char charFromBits(vector<long> inp);
@@ -50,10 +62,76 @@ void printVector (vector<vector<long>> inp);
 
 vector<pt_block> vectorsToBlocks (vector<vector<long>> inp);
 
-vector<vector<long>> transpose (vector<vector<long>> inp);
-
-vector<vector<long>> transpose (vector<long> inp);
-
-void timer(bool init = false);
+vector<vector<long>> transpose (const vector<vector<long>> &inp);
+
+vector<vector<long>> transpose (const vector<long> &inp);
+
+////////////////////////////////////////////////////////////////////////////////
+// packed slot buffers
+
+// Storage for packed slot words. Buffers hand their words back when they are
+// destroyed and the next buffer of the same thread reuses them, so encoding
+// a whole key schedule allocates once.
+class SlotArena {
+    vector<vector<uint64_t>> spare;
+public:
+    vector<uint64_t> take (size_t nwords);     // zeroed
+    void give (vector<uint64_t> &&words);
+    static SlotArena& local ();                // one per thread
+};
+
+// The contents of nslots plaintext slots, one bit per slot, 64 slots per
+// word. Conversion to the vector<long> HElib wants happens only in slots().
+class SlotBuffer {
+    vector<uint64_t> words;
+    size_t nslots;
+public:
+    explicit SlotBuffer (size_t nslots = 0);
+    ~SlotBuffer ();
+    SlotBuffer (SlotBuffer &&other);
+    SlotBuffer& operator= (SlotBuffer &&other);
+    SlotBuffer (const SlotBuffer &other);
+    SlotBuffer& operator= (const SlotBuffer &other);
+
+    size_t size () const { return nslots; }
+    void reset (size_t n);                      // n zero slots
+    void fill (long bit);                       // every slot
+
+    long get (size_t i) const { return (words[i/64] >> (i%64)) & 1; }
+    void set (size_t i, long bit) {
+        uint64_t m = (uint64_t) 1 << (i%64);
+        words[i/64] = (bit & 1) ? words[i/64] | m : words[i/64] & ~m;
+    }
+
+    // nbits (<= 64) bits of w, least significant first, from slot at
+    void setWord (size_t at, uint64_t w, size_t nbits);
+    uint64_t getWord (size_t at, size_t nbits) const;
+
+    // slots 64*i .. 64*i+63
+    uint64_t* data () { return words.data(); }
+    const uint64_t* data () const { return words.data(); }
+    size_t nwords () const { return words.size(); }
+
+    // The slots as 0/1 longs in a per-thread scratch vector that is reused
+    // by the next call on the same thread. Hand it straight to HElib.
+    const vector<long>& slots () const;
+    void assign (const vector<long> &inp);      // from HElib, resizes
+};
+
+// A buffer of nslots slots holding the low nbits bits of n from slot 0
+SlotBuffer wordToSlots (uint64_t n, size_t nbits, size_t nslots);
+
+// Bit slicing into packed buffers of nslots (>= ws.size()) slots: buffer i
+// holds bit i of every word. This is just transpose64 on each tile.
+void wordsToSlices (const vector<uint64_t> &ws, size_t nbits, size_t nslots, vector<SlotBuffer> &out);
+
+// the first n slots of each buffer
+vector<uint64_t> slicesToWords (const vector<SlotBuffer> &inp, size_t n);
+
+// one buffer per key word, as keyToVectors
+void keyToSlots (const vector<uint32_t> &key, size_t nslots, vector<SlotBuffer> &out);
+
+// one buffer per 32-bit word, an even number of them, as strToVectors
+void strToSlots (const string &inp, size_t nslots, vector<SlotBuffer> &out);
 
 #endif
@@ -0,0 +1,146 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// A fixed pool of worker threads for splitting independent work, such as
+// the counter space in CTR mode or the ciphertexts of a round, across cores.
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include "thread-pool.h"
+
+// set while this thread runs part of a job
+static thread_local bool inJob = false;
+
+ThreadPool::ThreadPool (size_t nthreads)
+    : job(NULL), nparts(0), generation(0), pending(0), stopping(false)
+{
+    if (nthreads == 0) nthreads = thread::hardware_concurrency();
+    if (nthreads == 0) nthreads = 1;
+    for (size_t i = 1; i < nthreads; i++) {
+        workers.push_back(thread(&ThreadPool::work, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool () {
+    {
+        lock_guard<mutex> lock (mtx);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+// part i of n equal parts of [0, size)
+static void partRange (size_t size, size_t n, size_t i, size_t &begin, size_t &end) {
+    begin = size * i / n;
+    end   = size * (i + 1) / n;
+}
+
+void ThreadPool::work (size_t id) {
+    inJob = true;
+    size_t seen = 0;
+    for (;;) {
+        const function<void(size_t)> *fn;
+        size_t parts;
+        {
+            unique_lock<mutex> lock (mtx);
+            wake.wait(lock, [&]{ return stopping || generation != seen; });
+            if (stopping) return;
+            seen  = generation;
+            fn    = job;
+            parts = nparts;
+        }
+        if (id < parts) {
+            (*fn)(id);
+            lock_guard<mutex> lock (mtx);
+            if (--pending == 0) done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::run (size_t parts, const function<void(size_t)> &part) {
+    lock_guard<mutex> jobLock (jobMtx);
+    {
+        lock_guard<mutex> lock (mtx);
+        job     = &part;
+        nparts  = parts;
+        pending = parts - 1;
+        generation++;
+    }
+    wake.notify_all();
+    inJob = true;
+    part(0);
+    inJob = false;
+    unique_lock<mutex> lock (mtx);
+    done.wait(lock, [&]{ return pending == 0; });
+}
+
+void ThreadPool::parallelFor (size_t n, size_t grain, const function<void(size_t, size_t)> &fn) {
+    if (grain == 0) grain = 1;
+    size_t parts = min(size(), max((size_t) 1, n / grain));
+    if (parts == 1 || inJob) {
+        fn(0, n);
+        return;
+    }
+    run(parts, [&](size_t i) {
+        size_t begin, end;
+        partRange(n, parts, i, begin, end);
+        fn(begin, end);
+    });
+}
+
+// The items one thread has left. The owner takes from the front and
+// thieves from the back.
+struct WorkRange {
+    mutex mtx;
+    size_t begin, end;
+
+    bool take (size_t &i, bool back) {
+        lock_guard<mutex> lock (mtx);
+        if (begin == end) return false;
+        i = back ? --end : begin++;
+        return true;
+    }
+};
+
+void ThreadPool::parallelEach (size_t n, const function<void(size_t)> &fn) {
+    size_t parts = min(size(), n);
+    if (parts <= 1 || inJob) {
+        for (size_t i = 0; i < n; i++) fn(i);
+        return;
+    }
+    unique_ptr<WorkRange[]> ranges (new WorkRange[parts]);
+    for (size_t p = 0; p < parts; p++) partRange(n, parts, p, ranges[p].begin, ranges[p].end);
+    run(parts, [&](size_t id) {
+        size_t i;
+        for (;;) {
+            bool got = ranges[id].take(i, false);
+            for (size_t k = 1; !got && k < parts; k++) {
+                got = ranges[(id + k) % parts].take(i, true);
+            }
+            if (!got) return;
+            fn(i);
+        }
+    });
+}
+
+// HE_THREADS, or 0 when it is unset or not a whole number of at least 0
+static size_t envThreads () {
+    const char *s = getenv("HE_THREADS");
+    if (!s) return 0;
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (!*s || *end || n < 0) {
+        cerr << "ignoring HE_THREADS=" << s << ", using one thread per core" << endl;
+        return 0;
+    }
+    return n;
+}
+
+ThreadPool& ThreadPool::shared () {
+    static ThreadPool pool (envThreads());
+    return pool;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2013-2014 Galois, Inc.
+// Distributed under the terms of the GPLv3 license (see LICENSE file)
+//
+// Author: Brent Carmer
+//
+// A fixed pool of worker threads for splitting independent work, such as
+// the counter space in CTR mode or the ciphertexts of a round, across cores.
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Calls from inside a job, on any pool, run serially on the calling thread,
+// so library code can use the shared pool without caring whether its caller
+// already does. A pool runs one job at a time; jobs from several threads
+// wait their turn.
+class ThreadPool {
+public:
+    // nthreads counts the calling thread; 0 means one per core
+    explicit ThreadPool (size_t nthreads = 0);
+    ~ThreadPool ();
+    ThreadPool (const ThreadPool&) = delete;
+    ThreadPool& operator= (const ThreadPool&) = delete;
+
+    size_t size () const { return workers.size() + 1; }
+
+    // Splits [0, n) into contiguous ranges of at least grain items, one per
+    // thread, and runs fn(begin, end) on each. Blocks until all are done.
+    void parallelFor (size_t n, size_t grain, const function<void(size_t, size_t)> &fn);
+
+    // Runs fn(i) for each i in [0, n), for items that take long enough
+    // (a homomorphic op, say) that their cost matters more than balancing
+    // overhead. Each thread starts on its own range and, once that runs
+    // out, steals items from the back of the others'. Blocks until all are
+    // done.
+    void parallelEach (size_t n, const function<void(size_t)> &fn);
+
+    // The pool the HElib drivers share, with HE_THREADS threads, or one per
+    // core when that is unset.
+    static ThreadPool& shared ();
+
+private:
+    void work (size_t id);
+
+    // runs part(i) on thread i for i < nparts, this thread being 0
+    void run (size_t nparts, const function<void(size_t)> &part);
+
+    vector<thread> workers;
+    mutex jobMtx;                       // held by the thread whose job runs
+    mutex mtx;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(size_t)> *job;
+    size_t nparts;
+    size_t generation;
+    size_t pending;
+    bool stopping;
+};
+
+#endif